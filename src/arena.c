@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+struct arena_block
+{
+  ARENA_BLOCK *next;
+  size_t size;
+  size_t used;
+  char data[];
+};
+
+long heap_allocs;
+
+/* With ld's --wrap, our calls to malloc come here, and __real_malloc is
+ * the C library's */
+void *__real_malloc (size_t size);
+void *__real_calloc (size_t n, size_t size);
+void *__real_realloc (void *p, size_t size);
+char *__real_strdup (const char *s);
+
+void *
+__wrap_malloc (size_t size)
+{
+  __atomic_add_fetch (&heap_allocs, 1, __ATOMIC_RELAXED);
+  return __real_malloc (size);
+}
+
+void *
+__wrap_calloc (size_t n, size_t size)
+{
+  __atomic_add_fetch (&heap_allocs, 1, __ATOMIC_RELAXED);
+  return __real_calloc (n, size);
+}
+
+void *
+__wrap_realloc (void *p, size_t size)
+{
+  __atomic_add_fetch (&heap_allocs, 1, __ATOMIC_RELAXED);
+  return __real_realloc (p, size);
+}
+
+char *
+__wrap_strdup (const char *s)
+{
+  __atomic_add_fetch (&heap_allocs, 1, __ATOMIC_RELAXED);
+  return __real_strdup (s);
+}
+
+static ARENA_BLOCK *
+block_new (size_t size)
+{
+  ARENA_BLOCK *block;
+
+  if (size < ARENA_BLOCK_SIZE)
+    size = ARENA_BLOCK_SIZE;
+  block = (ARENA_BLOCK *) malloc (sizeof (ARENA_BLOCK) + size);
+  block->next = NULL;
+  block->size = size;
+  block->used = 0;
+  return block;
+}
+
+void *
+arena_alloc (ARENA *arena, size_t size)
+{
+  ARENA_BLOCK *block = arena->cur;
+  void *p;
+
+  size = ALIGN (size);
+  if (!block)
+    block = arena->first = arena->cur = block_new (size);
+  else if (block->size - block->used < size)
+  {
+    /* Move on to the next block we kept, if it is big enough */
+    if (!block->next || block->next->size < size)
+    {
+      ARENA_BLOCK *added = block_new (size);
+
+      added->next = block->next;
+      block->next = added;
+    }
+    block = arena->cur = block->next;
+    block->used = 0;
+  }
+  p = block->data + block->used;
+  block->used += size;
+  return p;
+}
+
+/* How much can be allocated without moving to another block */
+size_t
+arena_room (ARENA *arena)
+{
+  return (arena->cur ? arena->cur->size - arena->cur->used : 0);
+}
+
+char *
+arena_strdup (ARENA *arena, const char *s)
+{
+  size_t len = strlen (s) + 1;
+
+  return (char *) memcpy (arena_alloc (arena, len), s, len);
+}
+
+/* Lets go of everything allocated so far */
+void
+arena_reset (ARENA *arena)
+{
+  arena->cur = arena->first;
+  if (arena->cur)
+    arena->cur->used = 0;
+}
+
+void
+arena_free (ARENA *arena)
+{
+  ARENA_BLOCK *block;
+
+  while ((block = arena->first))
+  {
+    arena->first = block->next;
+    free (block);
+  }
+  arena->cur = NULL;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/* Bump allocation, for strings that all go away at once. Nothing is freed
+ * on its own; arena_reset lets everything go, but keeps the blocks, so an
+ * arena that is reset regularly stops calling malloc once it has grown to
+ * what it needs. A zeroed ARENA is empty. Like buffer.h, nothing here knows
+ * about the protocol. */
+
+/* Usual size of a block; bigger allocations get a block of their own */
+#define ARENA_BLOCK_SIZE 1024
+
+typedef struct arena_block ARENA_BLOCK;
+
+typedef struct
+{
+  ARENA_BLOCK *first;
+  ARENA_BLOCK *cur; /* being allocated from */
+} ARENA;
+
+/* Every malloc, calloc, realloc and strdup made by our own code, on any
+ * thread, to check that they stop. Only programs linked with the Makefile's
+ * WRAP_ALLOC count them; in others it stays 0. */
+extern long heap_allocs;
+
+void *arena_alloc (ARENA *arena, size_t size);
+size_t arena_room (ARENA *arena);
+char *arena_strdup (ARENA *arena, const char *s);
+void arena_reset (ARENA *arena);
+void arena_free (ARENA *arena);
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+/* A front end that plays by itself, for running many characters without a
+ * terminal. After a short pause to think, a bot answers every dialog: at
+ * the main menu it mostly walks around, and otherwise it picks a button at
+ * random. Once chat is on, it says something every so often. Nothing is
+ * drawn. */
+
+#include "phantcli.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Dialogs are answered after a random time around this many milliseconds */
+int bot_think_ms = 1000;
+
+/* Time between chat messages, give or take half, or 0 to not chat */
+int bot_chat_ms = 60000;
+
+/* Buttons a bot should never press */
+static const char *avoid[] = { "Quit", "Exit", "Leave", NULL };
+
+static const char *chatter[] =
+{
+  "Hello, everyone.",
+  "Anyone seen a trading post around here?",
+  "Nice weather for wandering.",
+  "I think I'm lost.",
+  NULL
+};
+
+struct BOT
+{
+  TIMER think;
+  TIMER chat;
+};
+
+/* Returns a number from ms / 2 to ms * 3 / 2 */
+static int
+jitter (int ms)
+{
+  return ms / 2 + rand () % (ms + 1);
+}
+
+static pbool
+avoided (const char *label)
+{
+  int i;
+
+  for (i = 0; avoid[i]; i++)
+    if (strstr (label, avoid[i]))
+      return TRUE;
+  return FALSE;
+}
+
+/* Picks one of the buttons we were given, at random */
+static int
+choose_button (STATE *state)
+{
+  int choices[8];
+  int n = 0;
+  int i;
+
+  for (i = 0; i < 8; i++)
+    if (state->buttons[i] && !avoided (state->buttons[i]))
+      choices[n++] = i;
+  return (n > 0 ? choices[rand () % n] : 0);
+}
+
+/* Picks someone from the player list, or ourselves if nobody else is on */
+static const char *
+choose_player (STATE *state)
+{
+  PLAYER *p;
+
+  if (state->roster.count == 0)
+    return (state->player.name ? state->player.name : "");
+  /* Skip the holes; there is at least one player */
+  do
+    p = &state->roster.players[rand () % state->roster.len];
+  while (!p->name);
+  return p->name;
+}
+
+static void
+think_timeout (LOOP *loop, TIMER *timer)
+{
+  STATE *state = (STATE *) timer->data;
+  int mode = state->dialog_mode;
+
+  if (!mode)
+    return; /* timed out, or the connection was lost */
+  state->dialog_mode = 0;
+
+  switch (mode)
+  {
+  case FULL_BUTTONS_PACKET:
+    /* The main menu. Walk, mostly; compass answers run from 8 (northwest)
+     * to 16 (southeast), with 12 to rest. */
+    if (rand () % 4)
+    {
+      respond (state, "%d", 8 + rand () % 9);
+      totals.moves++;
+      break;
+    }
+    respond (state, "%d", choose_button (state));
+    break;
+  case BUTTONS_PACKET:
+    respond (state, "%d", choose_button (state));
+    break;
+  case COORDINATES_DIALOG_PACKET:
+    /* Somewhere nearby. handle_location keeps the first coordinate in y. */
+    respond (state, "%d", state->player.y + rand () % 21 - 10);
+    respond (state, "%d", state->player.x + rand () % 21 - 10);
+    break;
+  case PLAYER_DIALOG_PACKET:
+    respond (state, "%s", choose_player (state));
+    break;
+  default:
+    /* Names and passwords. Use the same ones every time, so that a bot
+     * with a given cookie is always the same character. */
+    respond (state, "Bot%u", (unsigned int) state->cookie % 1000000);
+    break;
+  }
+}
+
+static void
+chat_timeout (LOOP *loop, TIMER *timer)
+{
+  STATE *state = (STATE *) timer->data;
+  int n;
+
+  for (n = 0; chatter[n]; n++);
+  send_string_f (state, "%d", C_CHAT_PACKET);
+  send_string (state, chatter[rand () % n]);
+  totals.chats++;
+  loop_add_timer (loop, timer, jitter (bot_chat_ms));
+}
+
+static void
+bot_init (STATE *state)
+{
+  state->bot = (struct BOT *) calloc (sizeof (struct BOT), 1);
+  state->bot->think.func = think_timeout;
+  state->bot->think.data = state;
+  state->bot->chat.func = chat_timeout;
+  state->bot->chat.data = state;
+}
+
+static void
+bot_teardown (STATE *state)
+{
+  if (!state->bot)
+    return;
+  loop_remove_timer (state->loop, &state->bot->think);
+  loop_remove_timer (state->loop, &state->bot->chat);
+  free (state->bot);
+  state->bot = NULL;
+}
+
+static void
+bot_present_dialog (STATE *state)
+{
+  loop_add_timer (state->loop, &state->bot->think, jitter (bot_think_ms));
+}
+
+static void
+bot_present_string_dialog (STATE *state, const char *buf)
+{
+  loop_add_timer (state->loop, &state->bot->think, jitter (bot_think_ms));
+}
+
+static void
+bot_chat_enable (STATE *state, pbool enable)
+{
+  if (enable && bot_chat_ms > 0 && !state->bot->chat.index)
+    loop_add_timer (state->loop, &state->bot->chat, jitter (bot_chat_ms));
+  else if (!enable)
+    loop_remove_timer (state->loop, &state->bot->chat);
+}
+
+static void
+bot_timeout (STATE *state)
+{
+  loop_remove_timer (state->loop, &state->bot->think);
+}
+
+const FRONTEND bot_frontend =
+{
+  bot_init,
+  bot_teardown,
+  NULL,
+  bot_present_dialog,
+  bot_present_string_dialog,
+  NULL,
+  NULL,
+  NULL,
+  bot_chat_enable,
+  NULL,
+  bot_timeout,
+  NULL,
+  NULL
+};
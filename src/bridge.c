@@ -0,0 +1,619 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+/* A front end that hands everything to another thread. The session stays
+ * with the network thread, which reads, parses and answers pings; the
+ * thread drawing the terminal works on a mirror of the session, which the
+ * bridge keeps up to date. So a slow terminal can't hold up the protocol.
+ *
+ * Each ui_ call becomes an event, carrying copies of whatever the front end
+ * will look at, and goes across in a ring (see ring.h). What the player
+ * types comes back the same way, as messages for the server. Neither
+ * thread ever waits for the other: if a ring is full, messages queue up on
+ * the sending side and are retried a little later.
+ *
+ * Messages are sent back once they have been handled, through a second
+ * ring, and used again with whatever buffer they had grown. So once there
+ * are enough of them, and big enough, the bridge allocates nothing. */
+
+#include "phantcli.h"
+#include "ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/* Ring sizes. Events can come in bursts of thousands when the server sends
+ * the player list; output is a few messages per keystroke. */
+#define EVENT_RING_SIZE 4096
+#define OUTPUT_RING_SIZE 256
+
+/* How soon to try again, in milliseconds, when a ring was full */
+#define SPILL_RETRY 5
+
+/* Smallest buffer a message is given, so most fit the first time */
+#define MESSAGE_BUF_SIZE 256
+
+/* Events, one for each ui_ call */
+#define EV_INIT 1
+#define EV_TEARDOWN 2
+#define EV_WRITELINE 3
+#define EV_DIALOG 4
+#define EV_STRING_DIALOG 5
+#define EV_CLEAR 6
+#define EV_STAT 7
+#define EV_CHAT_ENABLE 8
+#define EV_CHAT 9
+#define EV_TIMEOUT 10
+#define EV_SPECIAL_TEXT 11
+#define EV_STATUS 12
+#define EV_PLAYER_JOINED 13
+#define EV_PLAYER_LEFT 14
+#define EV_PROTOCOL 15 /* not a ui_ call: the server's version changed */
+
+typedef struct message MESSAGE;
+
+struct message
+{
+  int type; /* EV_*, or 0 for output */
+  int arg; /* packet, dialog mode or flag */
+  char *text; /* in buf, or NULL */
+  int len; /* of text, for output */
+  void *data; /* in buf: a copy of some of the session */
+  char *buf; /* kept when the message is used again */
+  int size;
+  MESSAGE *next; /* while waiting for room in the ring */
+};
+
+/* What the status line needs */
+typedef struct
+{
+  HISTOGRAM rtt;
+  int reconnects;
+  unsigned long long last_ms;
+} STATUS;
+
+/* One direction. The spill list belongs to the producer. */
+typedef struct
+{
+  RING ring;
+  RING returned; /* messages the consumer is done with, to use again */
+  MESSAGE *spill;
+  MESSAGE *spill_tail;
+  LOOP *loop; /* the producer's */
+  DEFER wake; /* tells the consumer, once per pass through the loop */
+  TIMER retry;
+  WATCH watch; /* the eventfd, in the consumer's loop */
+  LOOP *consumer;
+  void (*receive) (BRIDGE *bridge, MESSAGE *msg);
+  BRIDGE *bridge;
+} CHANNEL;
+
+struct bridge
+{
+  STATE *session; /* belongs to the network thread; NULL once it's closed */
+  STATE mirror; /* belongs to the UI thread */
+  const PROTOCOL *protocol; /* the mirror's, as the network thread last told it */
+  CHANNEL events;
+  CHANNEL output;
+};
+
+/* Returns the message's buffer, with room for size bytes. What was in it
+ * is lost if it has to grow. */
+static char *
+message_room (MESSAGE *msg, int size)
+{
+  if (size > msg->size)
+  {
+    msg->size = (size > MESSAGE_BUF_SIZE ? size : MESSAGE_BUF_SIZE);
+    free (msg->buf);
+    msg->buf = (char *) malloc (msg->size);
+  }
+  return msg->buf;
+}
+
+/* Returns a message for ch, one that came back if there is one. Any text
+ * is copied into its buffer. */
+static MESSAGE *
+message_new (CHANNEL *ch, int type, int arg, const char *text)
+{
+  MESSAGE *msg = (MESSAGE *) ring_pop (&ch->returned);
+
+  if (!msg)
+    msg = (MESSAGE *) calloc (sizeof (MESSAGE), 1);
+  msg->type = type;
+  msg->arg = arg;
+  msg->text = NULL;
+  msg->len = 0;
+  msg->data = NULL;
+  if (text)
+  {
+    msg->len = strlen (text) + 1;
+    msg->text = (char *) memcpy (message_room (msg, msg->len), text, msg->len);
+  }
+  return msg;
+}
+
+static void
+message_free (MESSAGE *msg)
+{
+  free (msg->buf);
+  free (msg);
+}
+
+static void
+channel_wake (LOOP *loop, DEFER *defer)
+{
+  CHANNEL *ch = (CHANNEL *) defer->data;
+
+  eventfd_write (ch->watch.fd, 1);
+}
+
+/* Moves as much of the spill list into the ring as will fit, oldest first.
+ * A message belongs to the consumer once it is in the ring, so don't touch
+ * it after pushing it. */
+static void
+channel_unspill (CHANNEL *ch)
+{
+  MESSAGE *msg;
+  MESSAGE *next;
+
+  while ((msg = ch->spill))
+  {
+    next = msg->next;
+    if (ring_push (&ch->ring, msg) < 0)
+      break;
+    ch->spill = next;
+  }
+  if (!ch->spill)
+    ch->spill_tail = NULL;
+  else if (!ch->retry.index)
+    loop_add_timer (ch->loop, &ch->retry, SPILL_RETRY);
+  loop_defer (ch->loop, &ch->wake);
+}
+
+static void
+channel_retry (LOOP *loop, TIMER *timer)
+{
+  channel_unspill ((CHANNEL *) timer->data);
+}
+
+static void
+channel_send (CHANNEL *ch, MESSAGE *msg)
+{
+  msg->next = NULL;
+  if (!ch->spill && ring_push (&ch->ring, msg) == 0)
+  {
+    loop_defer (ch->loop, &ch->wake);
+    return;
+  }
+
+  /* Keep the order: once anything has spilled, everything does */
+  if (ch->spill_tail)
+    ch->spill_tail->next = msg;
+  else
+    ch->spill = msg;
+  ch->spill_tail = msg;
+  channel_unspill (ch);
+}
+
+static void
+channel_io (LOOP *loop, WATCH *watch, unsigned int events)
+{
+  CHANNEL *ch = (CHANNEL *) watch->data;
+  eventfd_t value;
+  MESSAGE *msg;
+
+  eventfd_read (watch->fd, &value);
+  while ((msg = (MESSAGE *) ring_pop (&ch->ring)))
+  {
+    ch->receive (ch->bridge, msg);
+    if (ring_push (&ch->returned, msg) < 0)
+      message_free (msg);
+  }
+}
+
+static int
+channel_init (CHANNEL *ch, BRIDGE *bridge, unsigned int size, LOOP *producer, LOOP *consumer, void (*receive) (BRIDGE *, MESSAGE *))
+{
+  if (ring_init (&ch->ring, size) < 0 || ring_init (&ch->returned, size) < 0)
+    return -1;
+  ch->bridge = bridge;
+  ch->receive = receive;
+  ch->loop = producer;
+  ch->consumer = consumer;
+  ch->wake.func = channel_wake;
+  ch->wake.data = ch;
+  ch->retry.func = channel_retry;
+  ch->retry.data = ch;
+  ch->watch.fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  ch->watch.events = EPOLLIN;
+  ch->watch.func = channel_io;
+  ch->watch.data = ch;
+  if (ch->watch.fd == -1 || loop_add_watch (consumer, &ch->watch) < 0)
+    return -1;
+  return 0;
+}
+
+/* Once neither thread uses it */
+static void
+channel_free (CHANNEL *ch)
+{
+  MESSAGE *msg;
+
+  while ((msg = (MESSAGE *) ring_pop (&ch->ring)))
+    message_free (msg);
+  while ((msg = (MESSAGE *) ring_pop (&ch->returned)))
+    message_free (msg);
+  while ((msg = ch->spill))
+  {
+    ch->spill = msg->next;
+    message_free (msg);
+  }
+  ring_free (&ch->ring);
+  ring_free (&ch->returned);
+  loop_cancel_defer (ch->loop, &ch->wake);
+  loop_remove_timer (ch->loop, &ch->retry);
+  loop_remove_watch (ch->consumer, &ch->watch);
+  close (ch->watch.fd);
+}
+
+/* The network thread's side: the front end for the session */
+
+static void
+post (STATE *state, MESSAGE *msg)
+{
+  channel_send (&state->bridge->events, msg);
+}
+
+static MESSAGE *
+event_new (STATE *state, int type, int arg, const char *text)
+{
+  return message_new (&state->bridge->events, type, arg, text);
+}
+
+/* Copies s into buf at *off, and returns where it went */
+static char *
+put_string (char *buf, int *off, const char *s)
+{
+  char *p = buf + *off;
+  int len = strlen (s) + 1;
+
+  memcpy (p, s, len);
+  *off += len;
+  return p;
+}
+
+static void
+bridge_init (STATE *state)
+{
+  post (state, event_new (state, EV_INIT, 0, NULL));
+}
+
+static void
+bridge_teardown (STATE *state)
+{
+  post (state, event_new (state, EV_TEARDOWN, 0, NULL));
+  state->bridge->session = NULL;
+}
+
+static void
+bridge_writeline (STATE *state, const char *buf)
+{
+  post (state, event_new (state, EV_WRITELINE, 0, buf));
+}
+
+static void
+bridge_present_dialog (STATE *state)
+{
+  MESSAGE *msg = event_new (state, EV_DIALOG, state->dialog_mode, NULL);
+  int off = 8 * sizeof (char *);
+  char **buttons;
+  int i;
+
+  /* The pointers, then the buttons they point to */
+  for (i = 0; i < 8; i++)
+    if (state->buttons[i])
+      off += strlen (state->buttons[i]) + 1;
+  buttons = (char **) message_room (msg, off);
+  off = 8 * sizeof (char *);
+  for (i = 0; i < 8; i++)
+    buttons[i] = (state->buttons[i] ? put_string (msg->buf, &off, state->buttons[i]) : NULL);
+  msg->data = buttons;
+  post (state, msg);
+}
+
+static void
+bridge_present_string_dialog (STATE *state, const char *buf)
+{
+  post (state, event_new (state, EV_STRING_DIALOG, state->dialog_mode, buf));
+}
+
+static void
+bridge_clear (STATE *state)
+{
+  post (state, event_new (state, EV_CLEAR, 0, NULL));
+}
+
+static void
+bridge_update_stat (STATE *state, int packet)
+{
+  MESSAGE *msg;
+  __typeof__ (state->player) *player;
+  int off = sizeof (*player);
+
+  if (state->protocol != state->bridge->protocol)
+  {
+    state->bridge->protocol = state->protocol;
+    post (state, event_new (state, EV_PROTOCOL, 0, state->protocol->name));
+  }
+  /* The player, then the name and location */
+  msg = event_new (state, EV_STAT, packet, NULL);
+  player = (__typeof__ (player)) message_room (msg, off + (state->player.name ? strlen (state->player.name) + 1 : 0)
+                                                   + (state->player.location ? strlen (state->player.location) + 1 : 0));
+  memcpy (player, &state->player, sizeof (*player));
+  if (player->name)
+    player->name = put_string (msg->buf, &off, player->name);
+  if (player->location)
+    player->location = put_string (msg->buf, &off, player->location);
+  msg->data = player;
+  post (state, msg);
+}
+
+static void
+bridge_chat_enable (STATE *state, pbool enable)
+{
+  post (state, event_new (state, EV_CHAT_ENABLE, enable, NULL));
+}
+
+static void
+bridge_chat_message (STATE *state, const char *message)
+{
+  post (state, event_new (state, EV_CHAT, 0, message));
+}
+
+static void
+bridge_timeout (STATE *state)
+{
+  post (state, event_new (state, EV_TIMEOUT, 0, NULL));
+}
+
+static void
+bridge_post_special_text (STATE *state, const char *buf)
+{
+  post (state, event_new (state, EV_SPECIAL_TEXT, 0, buf));
+}
+
+static void
+bridge_update_status (STATE *state)
+{
+  MESSAGE *msg = event_new (state, EV_STATUS, 0, NULL);
+  STATUS *status = (STATUS *) message_room (msg, sizeof (STATUS));
+
+  status->rtt = state->latency.rtt;
+  status->reconnects = state->reconnect.count;
+  status->last_ms = state->reconnect.last_ms;
+  msg->data = status;
+  post (state, msg);
+}
+
+static void
+bridge_player_joined (STATE *state, const char *name, const char *type)
+{
+  MESSAGE *msg = event_new (state, EV_PLAYER_JOINED, 0, NULL);
+  int off = 0;
+
+  message_room (msg, strlen (name) + strlen (type) + 2);
+  msg->text = put_string (msg->buf, &off, name);
+  msg->data = put_string (msg->buf, &off, type);
+  post (state, msg);
+}
+
+static void
+bridge_player_left (STATE *state, const char *name)
+{
+  post (state, event_new (state, EV_PLAYER_LEFT, 0, name));
+}
+
+static const FRONTEND bridge_frontend =
+{
+  bridge_init,
+  bridge_teardown,
+  bridge_writeline,
+  bridge_present_dialog,
+  bridge_present_string_dialog,
+  NULL, /* keys are read by the other thread anyway */
+  bridge_clear,
+  bridge_update_stat,
+  bridge_chat_enable,
+  bridge_chat_message,
+  bridge_timeout,
+  bridge_post_special_text,
+  bridge_update_status,
+  bridge_player_joined,
+  bridge_player_left
+};
+
+/* Output from the mirror, to be sent by the network thread */
+static void
+forward_output (BRIDGE *bridge, MESSAGE *msg)
+{
+  if (bridge->session)
+    queue_output (bridge->session, msg->text, msg->len);
+}
+
+/* The mirror's name and location are kept the way the session keeps its
+ * own, and only copied when they change */
+static void
+mirror_string (STATE *state, char **field, const char *value)
+{
+  if (!value)
+    *field = NULL;
+  else if (!*field || strcmp (*field, value) != 0)
+    set_player_string (state, field, value);
+}
+
+/* The UI thread's side: updates the mirror, and passes the event on to the
+ * real front end */
+static void
+apply_event (BRIDGE *bridge, MESSAGE *msg)
+{
+  STATE *state = &bridge->mirror;
+  __typeof__ (state->player) *player;
+  STATUS *status;
+  PLAYER *p;
+  char **buttons;
+  char *name;
+  char *location;
+  int i;
+
+  switch (msg->type)
+  {
+  case EV_INIT:
+    ui_init (state);
+    break;
+  case EV_TEARDOWN:
+    /* As before threads, losing the session on the terminal ends us */
+    if (state->ui)
+    {
+      ui_teardown (state);
+      exit (1);
+    }
+    break;
+  case EV_WRITELINE:
+    ui_writeline (state, msg->text);
+    break;
+  case EV_DIALOG:
+    buttons = (char **) msg->data;
+    arena_reset (&state->dialog_arena);
+    for (i = 0; i < 8; i++)
+      state->buttons[i] = (buttons[i] ? arena_strdup (&state->dialog_arena, buttons[i]) : NULL);
+    state->dialog_mode = msg->arg;
+    ui_present_dialog (state);
+    break;
+  case EV_STRING_DIALOG:
+    state->dialog_mode = msg->arg;
+    ui_present_string_dialog (state, msg->text);
+    break;
+  case EV_CLEAR:
+    ui_clear (state);
+    break;
+  case EV_PROTOCOL:
+    state->protocol = protocol_find (msg->text);
+    break;
+  case EV_STAT:
+    player = msg->data;
+    name = state->player.name;
+    location = state->player.location;
+    memcpy (&state->player, player, sizeof (*player));
+    state->player.name = name;
+    state->player.location = location;
+    mirror_string (state, &state->player.name, player->name);
+    mirror_string (state, &state->player.location, player->location);
+    ui_update_stat (state, msg->arg);
+    break;
+  case EV_CHAT_ENABLE:
+    ui_chat_enable (state, msg->arg);
+    break;
+  case EV_CHAT:
+    ui_chat_message (state, msg->text);
+    break;
+  case EV_TIMEOUT:
+    ui_timeout (state);
+    break;
+  case EV_SPECIAL_TEXT:
+    ui_post_special_text (state, msg->text);
+    break;
+  case EV_STATUS:
+    status = (STATUS *) msg->data;
+    state->latency.rtt = status->rtt;
+    state->reconnect.count = status->reconnects;
+    state->reconnect.last_ms = status->last_ms;
+    ui_update_status (state);
+    break;
+  case EV_PLAYER_JOINED:
+    p = roster_add (&state->roster, msg->text);
+    p->type = strdup ((char *) msg->data);
+    ui_player_joined (state, p->name, p->type);
+    break;
+  case EV_PLAYER_LEFT:
+    if (msg->text)
+      roster_remove (&state->roster, msg->text);
+    else
+      roster_clear (&state->roster);
+    ui_player_left (state, msg->text);
+    break;
+  }
+}
+
+/* Called by queue_output for the mirror, on the UI thread */
+void
+bridge_output (BRIDGE *bridge, const char *buf, int len)
+{
+  MESSAGE *msg = message_new (&bridge->output, 0, 0, NULL);
+
+  msg->text = (char *) memcpy (message_room (msg, len), buf, len);
+  msg->len = len;
+  channel_send (&bridge->output, msg);
+}
+
+/* Moves the session's front end to a mirror of the session that is run by
+ * ui_loop, which will be run by another thread. Both loops must be idle. */
+BRIDGE *
+bridge_new (STATE *session, LOOP *ui_loop, const FRONTEND *frontend)
+{
+  BRIDGE *bridge = (BRIDGE *) calloc (sizeof (BRIDGE), 1);
+  STATE *mirror = &bridge->mirror;
+
+  bridge->session = session;
+  if (channel_init (&bridge->events, bridge, EVENT_RING_SIZE, session->loop, ui_loop, apply_event) < 0
+      || channel_init (&bridge->output, bridge, OUTPUT_RING_SIZE, ui_loop, session->loop, forward_output) < 0)
+  {
+    perror ("bridge_new");
+    exit (1);
+  }
+
+  mirror->fd = -1;
+  mirror->loop = ui_loop;
+  mirror->id = session->id;
+  mirror->cookie = session->cookie;
+  mirror->want_ui = session->want_ui;
+  mirror->frontend = frontend;
+  mirror->bridge = bridge;
+  mirror->mirror = TRUE;
+  mirror->protocol = bridge->protocol = session->protocol;
+
+  session->frontend = &bridge_frontend;
+  session->bridge = bridge;
+  return bridge;
+}
+
+/* Once both threads are done */
+void
+bridge_free (BRIDGE *bridge)
+{
+  ui_teardown (&bridge->mirror);
+  roster_clear (&bridge->mirror.roster);
+  arena_free (&bridge->mirror.dialog_arena);
+  arena_free (&bridge->mirror.strings[0]);
+  arena_free (&bridge->mirror.strings[1]);
+  channel_free (&bridge->events);
+  channel_free (&bridge->output);
+  free (bridge);
+}
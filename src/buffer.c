@@ -0,0 +1,296 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+#include "buffer.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+/* Makes sure that there are at least INBUF_CHUNK bytes free at the end of
+ * the buffer. Returns -1 if the buffer would grow past INBUF_MAX. */
+static int
+inbuf_make_room (INBUF *in)
+{
+  int size;
+
+  if (in->size - in->end >= INBUF_CHUNK)
+    return 0;
+
+  /* Move the partial record at the end down to the front, if that helps */
+  if (in->start > 0)
+  {
+    memmove (in->data, in->data + in->start, in->end - in->start);
+    in->scan -= in->start;
+    in->end -= in->start;
+    in->start = 0;
+    if (in->size - in->end >= INBUF_CHUNK)
+      return 0;
+  }
+
+  size = (in->size > 0 ? in->size * 2 : INBUF_CHUNK);
+  while (size - in->end < INBUF_CHUNK)
+    size *= 2;
+  if (size > INBUF_MAX)
+  {
+    errno = ENOBUFS;
+    return -1;
+  }
+  in->data = (char *) realloc (in->data, size);
+  if (in->size > 0)
+    in->grows++;
+  in->size = size;
+  return 0;
+}
+
+/* Adds data that was received some other way, ie through io_uring */
+int
+inbuf_append (INBUF *in, const char *buf, int len)
+{
+  int n;
+
+  while (len > 0)
+  {
+    if (inbuf_make_room (in) < 0)
+      return -1;
+    n = in->size - in->end;
+    if (n > len)
+      n = len;
+    memcpy (in->data + in->end, buf, n);
+    in->end += n;
+    buf += n;
+    len -= n;
+  }
+  if (in->end - in->start > in->high_water)
+    in->high_water = in->end - in->start;
+  return 0;
+}
+
+/* Reads whatever is available from fd, filling as much of the buffer as
+ * possible. Returns the number of bytes read, 0 at end of file, or -1 on
+ * error (with errno set; EAGAIN is possible for a non-blocking fd). */
+int
+inbuf_read (INBUF *in, int fd)
+{
+  int res;
+
+  if (inbuf_make_room (in) < 0)
+    return -1;
+
+  res = read (fd, in->data + in->end, in->size - in->end);
+  if (res <= 0)
+    return res;
+
+  in->end += res;
+  if (in->end - in->start > in->high_water)
+    in->high_water = in->end - in->start;
+  return res;
+}
+
+/* Returns the next complete record, with its delimiter replaced by a NUL,
+ * and its length (not counting the delimiter) in *len. Returns NULL if no
+ * complete record is buffered. The pointer is valid until the next call to
+ * inbuf_read. */
+char *
+inbuf_next (INBUF *in, char delim, int *len)
+{
+  char *rec;
+  char *p;
+
+  p = NULL;
+  if (in->scan < in->end)
+    p = (char *) memchr (in->data + in->scan, delim, in->end - in->scan);
+  if (!p)
+  {
+    in->scan = in->end;
+    if (in->start == in->end)
+      in->start = in->scan = in->end = 0;
+    return NULL;
+  }
+
+  *p = '\0';
+  rec = in->data + in->start;
+  *len = p - rec;
+  in->start = in->scan = p + 1 - in->data;
+  return rec;
+}
+
+/* Discards any buffered data, keeping the memory */
+void
+inbuf_reset (INBUF *in)
+{
+  in->start = in->scan = in->end = 0;
+}
+
+void
+inbuf_free (INBUF *in)
+{
+  free (in->data);
+  memset (in, 0, sizeof (*in));
+}
+
+/* Outgoing buffers start this big, and double as needed */
+#define OUTBUF_INITIAL 4096
+
+static void
+outbuf_grow (OUTBUF *out, unsigned int need)
+{
+  unsigned int size = (out->size > 0 ? out->size : OUTBUF_INITIAL);
+  unsigned int len = outbuf_pending (out);
+  unsigned int first;
+  char *data;
+
+  while (size - len < need)
+    size *= 2;
+  data = (char *) malloc (size);
+
+  /* Unwrap the old contents while copying them */
+  if (len > 0)
+  {
+    first = out->size - (out->head & (out->size - 1));
+    if (first > len)
+      first = len;
+    memcpy (data, out->data + (out->head & (out->size - 1)), first);
+    memcpy (data + first, out->data, len - first);
+  }
+  free (out->data);
+  out->data = data;
+  out->size = size;
+  out->head = 0;
+  out->tail = len;
+}
+
+void
+outbuf_append (OUTBUF *out, const char *buf, unsigned int len)
+{
+  unsigned int pos;
+  unsigned int first;
+
+  if (out->size - outbuf_pending (out) < len)
+    outbuf_grow (out, len);
+
+  pos = out->tail & (out->size - 1);
+  first = out->size - pos;
+  if (first > len)
+    first = len;
+  memcpy (out->data + pos, buf, first);
+  memcpy (out->data, buf + first, len - first);
+  out->tail += len;
+}
+
+/* Writes as much as the fd will take. Returns 1 if everything was written,
+ * 0 if some data is still pending (so the caller should wait for the fd to
+ * become writable), or -1 on error. */
+int
+outbuf_flush (OUTBUF *out, int fd)
+{
+  struct iovec iov[2];
+  unsigned int len;
+  unsigned int pos;
+  unsigned int written = 0;
+  int iovcnt;
+  int res;
+
+  while ((len = outbuf_pending (out)) > 0)
+  {
+    pos = out->head & (out->size - 1);
+    iov[0].iov_base = out->data + pos;
+    if (pos + len <= out->size)
+    {
+      iov[0].iov_len = len;
+      iovcnt = 1;
+    }
+    else
+    {
+      iov[0].iov_len = out->size - pos;
+      iov[1].iov_base = out->data;
+      iov[1].iov_len = len - iov[0].iov_len;
+      iovcnt = 2;
+    }
+
+    out->syscalls++;
+    res = writev (fd, iov, iovcnt);
+    if (res < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      return -1;
+    }
+    out->head += res;
+    written += res;
+    /* A short write means that the socket buffer is full; don't spend a
+     * syscall just to be told so. */
+    if (res < len)
+      break;
+  }
+
+  if (written > 0)
+  {
+    out->flushes++;
+    out->bytes += written;
+    if (written > out->max_flush)
+      out->max_flush = written;
+  }
+
+  if (outbuf_pending (out) == 0)
+  {
+    out->head = out->tail = 0;
+    return 1;
+  }
+  return 0;
+}
+
+/* Moves up to len pending bytes into buf, for a writer that isn't a plain
+ * fd. Returns the number of bytes moved. */
+unsigned int
+outbuf_take (OUTBUF *out, char *buf, unsigned int len)
+{
+  unsigned int pos = out->head & (out->size - 1);
+  unsigned int first;
+
+  if (len > outbuf_pending (out))
+    len = outbuf_pending (out);
+  if (len == 0)
+    return 0;
+  first = out->size - pos;
+  if (first > len)
+    first = len;
+  memcpy (buf, out->data + pos, first);
+  memcpy (buf + first, out->data, len - first);
+  out->head += len;
+  if (outbuf_pending (out) == 0)
+    out->head = out->tail = 0;
+  return len;
+}
+
+/* Discards any pending data, keeping the memory and the counters */
+void
+outbuf_reset (OUTBUF *out)
+{
+  out->head = out->tail = 0;
+}
+
+void
+outbuf_free (OUTBUF *out)
+{
+  free (out->data);
+  memset (out, 0, sizeof (*out));
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+/* Buffers for socket data. Like loop.h, nothing here knows about the
+ * protocol. */
+
+/* Smallest amount of free space we will read into */
+#define INBUF_CHUNK 16384
+
+/* Refuse to buffer a single line longer than this */
+#define INBUF_MAX (16 * 1024 * 1024)
+
+/* Incoming data, split into delimited records. Complete records are handed
+ * out in place; bytes are only moved when a partial record has to be shifted
+ * to the front to make room, and are never searched twice. */
+typedef struct
+{
+  char *data;
+  int size;
+  int start;	/* first byte not yet handed out */
+  int scan;	/* bytes before this have been searched for a delimiter */
+  int end;	/* end of valid data */
+  int high_water;	/* most bytes that were ever buffered at once */
+  int grows;	/* times the buffer had to be enlarged */
+} INBUF;
+
+/* Outgoing data. Writers append as often as they like, and the owner
+ * flushes everything with one writev once per trip around the event loop.
+ * The data is kept in a ring whose size is a power of two, so that a flush
+ * never needs more than two iovecs. */
+typedef struct
+{
+  char *data;
+  unsigned int size;
+  unsigned int head;	/* free-running offsets; head == tail when empty */
+  unsigned int tail;
+  long flushes;	/* flushes that wrote anything */
+  long syscalls;	/* writev calls, including ones that would block */
+  long bytes;	/* bytes written */
+  unsigned int max_flush;	/* most bytes written by one flush */
+} OUTBUF;
+
+#define outbuf_pending(out) ((out)->tail - (out)->head)
+
+int inbuf_read (INBUF *in, int fd);
+int inbuf_append (INBUF *in, const char *buf, int len);
+char *inbuf_next (INBUF *in, char delim, int *len);
+void inbuf_reset (INBUF *in);
+void inbuf_free (INBUF *in);
+void outbuf_append (OUTBUF *out, const char *buf, unsigned int len);
+int outbuf_flush (OUTBUF *out, int fd);
+unsigned int outbuf_take (OUTBUF *out, char *buf, unsigned int len);
+void outbuf_reset (OUTBUF *out);
+void outbuf_free (OUTBUF *out);
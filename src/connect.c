@@ -0,0 +1,432 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+/* Connecting without blocking the event loop. Host names are looked up on a
+ * helper thread, and the results are shared by every connection to the same
+ * host and port. The addresses are then tried in parallel, staggered a
+ * little and alternating between IPv6 and IPv4, and the first connection to
+ * succeed wins. */
+
+#include "phantcli.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+/* How long to wait on one address before also trying the next one */
+#define ATTEMPT_DELAY 250
+
+/* How long a lookup result may be reused */
+#define RESOLVE_TTL 60000
+
+/* Addresses tried per connection, at most */
+#define MAX_ADDRS 8
+
+typedef struct resolve RESOLVE;
+typedef struct attempt ATTEMPT;
+
+struct resolve
+{
+  char *host;
+  char service[8];
+  pbool done;
+  int error; /* from getaddrinfo */
+  struct addrinfo *res;
+  unsigned long long expires;
+  CONNECTOR *waiters;
+  RESOLVE *next;
+};
+
+struct attempt
+{
+  WATCH watch;
+  CONNECTOR *conn;
+};
+
+struct connector
+{
+  LOOP *loop;
+  RESOLVE *resolve;
+  CONNECTOR *next_waiter;
+  ConnectFunc func;
+  void *data;
+  TIMER deadline;
+  TIMER stagger;
+  struct sockaddr_storage addrs[MAX_ADDRS];
+  socklen_t addrlens[MAX_ADDRS];
+  int naddrs;
+  int next_addr;
+  ATTEMPT attempts[MAX_ADDRS];
+  int inflight;
+  int error; /* errno from the most recent failure */
+  const char *failure; /* set if the lookup failed */
+};
+
+static RESOLVE *resolves;
+
+/* Lookup threads hand finished RESOLVEs back to the loop through this pipe */
+static int resolve_pipe[2] = { -1, -1 };
+static WATCH resolve_watch;
+
+static void connector_done (CONNECTOR *conn, int fd, const char *error);
+static void start_attempt (CONNECTOR *conn);
+
+static void *
+resolve_thread (void *data)
+{
+  RESOLVE *resolve = (RESOLVE *) data;
+  struct addrinfo hints;
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_ADDRCONFIG;
+  resolve->error = getaddrinfo (resolve->host, resolve->service, &hints, &resolve->res);
+
+  /* The pointer is smaller than PIPE_BUF, so this write is atomic */
+  write (resolve_pipe[1], &resolve, sizeof (resolve));
+  return NULL;
+}
+
+/* Copies the looked-up addresses into the connector, alternating between
+ * address families so that a broken IPv6 route can't hold up IPv4. */
+static void
+take_addresses (CONNECTOR *conn, struct addrinfo *res)
+{
+  struct addrinfo *v6 = NULL, *v4 = NULL;
+  struct addrinfo *ai;
+  pbool six = TRUE;
+
+  for (ai = res; ai; ai = ai->ai_next)
+  {
+    if (ai->ai_family == AF_INET6 && !v6)
+      v6 = ai;
+    else if (ai->ai_family == AF_INET && !v4)
+      v4 = ai;
+  }
+
+  conn->naddrs = 0;
+  while ((v6 || v4) && conn->naddrs < MAX_ADDRS)
+  {
+    ai = (six && v6 ? v6 : v4 ? v4 : v6);
+    memcpy (&conn->addrs[conn->naddrs], ai->ai_addr, ai->ai_addrlen);
+    conn->addrlens[conn->naddrs++] = ai->ai_addrlen;
+    if (ai == v6)
+      do v6 = v6->ai_next; while (v6 && v6->ai_family != AF_INET6);
+    else
+      do v4 = v4->ai_next; while (v4 && v4->ai_family != AF_INET);
+    six = !six;
+  }
+}
+
+/* Takes the result of a lookup. Nothing is reported until the loop calls us
+ * back, so that connector_start never calls its callback directly. */
+static void
+resolved (CONNECTOR *conn, RESOLVE *resolve)
+{
+  conn->resolve = NULL;
+  if (resolve->error)
+    conn->failure = gai_strerror (resolve->error);
+  else
+    take_addresses (conn, resolve->res);
+  loop_add_timer (conn->loop, &conn->stagger, 0);
+}
+
+static void
+resolve_io (LOOP *loop, WATCH *watch, unsigned int events)
+{
+  RESOLVE *resolve;
+  CONNECTOR *conn;
+
+  while (read (resolve_pipe[0], &resolve, sizeof (resolve)) == sizeof (resolve))
+  {
+    resolve->done = TRUE;
+    resolve->expires = loop_now () + RESOLVE_TTL;
+    while ((conn = resolve->waiters))
+    {
+      resolve->waiters = conn->next_waiter;
+      resolved (conn, resolve);
+    }
+  }
+}
+
+static void
+free_resolve (RESOLVE *resolve)
+{
+  if (resolve->res)
+    freeaddrinfo (resolve->res);
+  free (resolve->host);
+  free (resolve);
+}
+
+/* Finds or starts a lookup for host:port. Expired results that nobody is
+ * waiting on are dropped along the way. */
+static RESOLVE *
+get_resolve (LOOP *loop, const char *host, int port)
+{
+  RESOLVE **pp = &resolves;
+  RESOLVE *resolve;
+  char service[8];
+  pthread_t thread;
+  pthread_attr_t attr;
+  unsigned long long now = loop_now ();
+
+  snprintf (service, sizeof (service), "%d", port);
+  while ((resolve = *pp))
+  {
+    if (resolve->done && resolve->expires <= now)
+    {
+      *pp = resolve->next;
+      free_resolve (resolve);
+      continue;
+    }
+    if (!strcmp (resolve->host, host) && !strcmp (resolve->service, service))
+      return resolve;
+    pp = &resolve->next;
+  }
+
+  if (resolve_pipe[0] == -1)
+  {
+    if (pipe (resolve_pipe) < 0)
+      return NULL;
+    fcntl (resolve_pipe[0], F_SETFL, O_NONBLOCK);
+    resolve_watch.fd = resolve_pipe[0];
+    resolve_watch.events = EPOLLIN;
+    resolve_watch.func = resolve_io;
+    loop_add_watch (loop, &resolve_watch);
+  }
+
+  resolve = (RESOLVE *) calloc (sizeof (RESOLVE), 1);
+  resolve->host = strdup (host);
+  strcpy (resolve->service, service);
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create (&thread, &attr, resolve_thread, resolve) != 0)
+  {
+    pthread_attr_destroy (&attr);
+    free_resolve (resolve);
+    return NULL;
+  }
+  pthread_attr_destroy (&attr);
+
+  resolve->next = resolves;
+  resolves = resolve;
+  return resolve;
+}
+
+static void
+close_attempt (CONNECTOR *conn, ATTEMPT *attempt)
+{
+  loop_remove_watch (conn->loop, &attempt->watch);
+  close (attempt->watch.fd);
+  attempt->watch.fd = -1;
+  conn->inflight--;
+}
+
+static void
+attempt_io (LOOP *loop, WATCH *watch, unsigned int events)
+{
+  ATTEMPT *attempt = (ATTEMPT *) watch->data;
+  CONNECTOR *conn = attempt->conn;
+  int fd = watch->fd;
+  int err = 0;
+  socklen_t len = sizeof (err);
+
+  if (getsockopt (fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+    err = errno;
+  if (err)
+  {
+    conn->error = err;
+    close_attempt (conn, attempt);
+    /* Don't wait for the stagger timer; try the next address now */
+    start_attempt (conn);
+    return;
+  }
+
+  /* This one won. Keep its descriptor, and drop the others. */
+  loop_remove_watch (loop, watch);
+  conn->inflight--;
+  attempt->watch.fd = -1;
+  connector_done (conn, fd, NULL);
+}
+
+static void
+stagger_timeout (LOOP *loop, TIMER *timer)
+{
+  CONNECTOR *conn = (CONNECTOR *) timer->data;
+
+  if (conn->failure)
+    connector_done (conn, -1, conn->failure);
+  else
+    start_attempt (conn);
+}
+
+/* Starts connecting to the next address, if there is one. Fails the whole
+ * connection if nothing is left to try. */
+static void
+start_attempt (CONNECTOR *conn)
+{
+  ATTEMPT *attempt;
+  struct sockaddr *sa;
+  int fd;
+
+  while (conn->next_addr < conn->naddrs)
+  {
+    attempt = &conn->attempts[conn->next_addr];
+    sa = (struct sockaddr *) &conn->addrs[conn->next_addr];
+    fd = socket (sa->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+      conn->error = errno;
+      conn->next_addr++;
+      continue;
+    }
+    if (connect (fd, sa, conn->addrlens[conn->next_addr]) < 0 && errno != EINPROGRESS)
+    {
+      conn->error = errno;
+      close (fd);
+      conn->next_addr++;
+      continue;
+    }
+    conn->next_addr++;
+
+    attempt->conn = conn;
+    attempt->watch.fd = fd;
+    attempt->watch.events = EPOLLOUT;
+    attempt->watch.func = attempt_io;
+    attempt->watch.data = attempt;
+    loop_add_watch (conn->loop, &attempt->watch);
+    conn->inflight++;
+
+    if (conn->next_addr < conn->naddrs)
+      loop_add_timer (conn->loop, &conn->stagger, ATTEMPT_DELAY);
+    return;
+  }
+
+  if (conn->inflight == 0)
+    connector_done (conn, -1, strerror (conn->error ? conn->error : ECONNREFUSED));
+}
+
+static void
+deadline_timeout (LOOP *loop, TIMER *timer)
+{
+  connector_done ((CONNECTOR *) timer->data, -1, strerror (ETIMEDOUT));
+}
+
+/* Reports the result and frees the connector */
+static void
+connector_done (CONNECTOR *conn, int fd, const char *error)
+{
+  ConnectFunc func = conn->func;
+  void *data = conn->data;
+
+  connector_cancel (conn);
+  func (fd, error, data);
+}
+
+/* Starts connecting to host:port. func is called from the loop with the
+ * connected, non-blocking socket, or with -1 and a description of what went
+ * wrong; timeout_ms bounds the whole thing, lookup included. Returns NULL
+ * (without calling func) if the connection can't even be started. */
+CONNECTOR *
+connector_start (LOOP *loop, const char *host, int port, int timeout_ms, ConnectFunc func, void *data)
+{
+  CONNECTOR *conn;
+  RESOLVE *resolve;
+  struct addrinfo hints;
+  struct addrinfo *res;
+  char service[8];
+  int i;
+
+  conn = (CONNECTOR *) calloc (sizeof (CONNECTOR), 1);
+  conn->loop = loop;
+  conn->func = func;
+  conn->data = data;
+  for (i = 0; i < MAX_ADDRS; i++)
+    conn->attempts[i].watch.fd = -1;
+  conn->deadline.func = deadline_timeout;
+  conn->deadline.data = conn;
+  conn->stagger.func = stagger_timeout;
+  conn->stagger.data = conn;
+  loop_add_timer (loop, &conn->deadline, timeout_ms);
+
+  /* Numeric addresses don't need the lookup thread */
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+  snprintf (service, sizeof (service), "%d", port);
+  if (getaddrinfo (host, service, &hints, &res) == 0)
+  {
+    take_addresses (conn, res);
+    freeaddrinfo (res);
+    loop_add_timer (loop, &conn->stagger, 0);
+    return conn;
+  }
+
+  resolve = get_resolve (loop, host, port);
+  if (!resolve)
+  {
+    connector_cancel (conn);
+    return NULL;
+  }
+  if (resolve->done)
+  {
+    resolved (conn, resolve);
+    return conn;
+  }
+  conn->resolve = resolve;
+  conn->next_waiter = resolve->waiters;
+  resolve->waiters = conn;
+  return conn;
+}
+
+/* Gives up on a connection without calling its callback */
+void
+connector_cancel (CONNECTOR *conn)
+{
+  CONNECTOR **pp;
+  int i;
+
+  if (conn->resolve)
+  {
+    for (pp = &conn->resolve->waiters; *pp; pp = &(*pp)->next_waiter)
+    {
+      if (*pp == conn)
+      {
+        *pp = conn->next_waiter;
+        break;
+      }
+    }
+  }
+  for (i = 0; i < MAX_ADDRS; i++)
+    if (conn->attempts[i].watch.fd != -1)
+      close_attempt (conn, &conn->attempts[i]);
+  loop_remove_timer (conn->loop, &conn->deadline);
+  loop_remove_timer (conn->loop, &conn->stagger);
+  free (conn);
+}
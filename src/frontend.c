@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+/* The ui_ functions, which pass events from the handlers on to the
+ * session's front end, if it has one */
+
+#include "phantcli.h"
+
+#define HAS(state, op) ((state)->frontend && (state)->frontend->op)
+
+/* Calls op, timing it for the packet trace */
+#define CALL(state, op, ...) \
+  do \
+  { \
+    if (HAS (state, op)) \
+    { \
+      unsigned long long begin = (trace_fp ? trace_ui_begin (state) : 0); \
+      (state)->frontend->op (__VA_ARGS__); \
+      trace_ui_end (state, begin); \
+    } \
+  } while (0)
+
+void
+ui_init (STATE *state)
+{
+  CALL (state, init, state);
+}
+
+void
+ui_teardown (STATE *state)
+{
+  CALL (state, teardown, state);
+}
+
+void
+ui_writeline (STATE *state, const char *buf)
+{
+  CALL (state, writeline, state, buf);
+}
+
+void
+ui_present_dialog (STATE *state)
+{
+  CALL (state, present_dialog, state);
+}
+
+void
+ui_present_string_dialog (STATE *state, const char *buf)
+{
+  CALL (state, present_string_dialog, state, buf);
+}
+
+void
+ui_get_key (STATE *state)
+{
+  CALL (state, get_key, state);
+}
+
+void
+ui_clear (STATE *state)
+{
+  CALL (state, clear, state);
+}
+
+void
+ui_update_stat (STATE *state, int packet)
+{
+  CALL (state, update_stat, state, packet);
+}
+
+void
+ui_chat_enable (STATE *state, pbool enable)
+{
+  CALL (state, chat_enable, state, enable);
+}
+
+void
+ui_chat_message (STATE *state, const char *message)
+{
+  CALL (state, chat_message, state, message);
+}
+
+/* The server gave up waiting for an answer. Whatever we were asked is no
+ * longer open, whether or not anyone is looking. */
+void
+ui_timeout (STATE *state)
+{
+  state->dialog_mode = 0;
+  CALL (state, timeout, state);
+}
+
+void
+ui_post_special_text (STATE *state, const char *buf)
+{
+  CALL (state, post_special_text, state, buf);
+}
+
+void
+ui_update_status (STATE *state)
+{
+  CALL (state, update_status, state);
+}
+
+/* The roster has already been changed; these are for front ends that keep
+ * their own */
+void
+ui_player_joined (STATE *state, const char *name, const char *type)
+{
+  CALL (state, player_joined, state, name, type);
+}
+
+void
+ui_player_left (STATE *state, const char *name)
+{
+  CALL (state, player_left, state, name);
+}
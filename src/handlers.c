@@ -17,6 +17,7 @@
 
 #include "phantcli.h"
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,8 +25,6 @@
 #include <unistd.h>
 #include <bsd/md5.h>
 
-static ServerDataHandler handlers[MAX_PACKET_COUNT];
-
 static void
 get_hash (int cookie, char *out)
 {
@@ -52,14 +51,20 @@ get_hash (int cookie, char *out)
 }
 
 static pbool
-handle_handshake (STATE *state, const char *buf)
+handle_handshake (STATE *state, const char *buf, int len)
 {
   char hash[33];
+  const char *const *line;
 
-#ifdef PHANT5
-  respond (state, "BETA");
-  respond (state, "010");
-#endif
+  /* Reconnecting. The server will send everyone again, and anyone who left
+   * while we were away must go. */
+  if (state->roster.len)
+  {
+    roster_clear (&state->roster);
+    ui_player_left (state, NULL);
+  }
+  for (line = state->protocol->handshake; *line; line++)
+    respond (state, "%s", *line);
   respond (state, "1004");
   respond (state, "%d", state->cookie);
   get_hash (state->cookie, hash);
@@ -69,105 +74,85 @@ handle_handshake (STATE *state, const char *buf)
 }
 
 static pbool
-handle_close (STATE *state, const char *buf)
+handle_close (STATE *state, const char *buf, int len)
 {
+  if (!state->protocol_known)
+    state->refused = TRUE;
+  state->reconnect.closing = TRUE;
   return FALSE;
 }
 
 static pbool
-handle_ping (STATE *state, const char *buf)
+handle_ping (STATE *state, const char *buf, int len)
 {
   send_string_f (state, "%d", C_PING_PACKET);
+  latency_reply_queued (state);
   ui_timeout (state);
   return FALSE;
 }
 
 static pbool
-handle_add_player (STATE *state, const char *buf)
+handle_add_player (STATE *state, const char *buf, int len)
 {
   PLAYER *player;
-  PLAYER *p;
 
   if (!buf)
     return TRUE;
 
   if (state->line_count++ == 0)
   {
-    player = (PLAYER *) calloc (sizeof (PLAYER), 1);
-    player->name = strdup (buf);
-    if (!state->players)
-    {
-      state->players = player;
-      return TRUE;
-    }
-    p = state->players;
-    while (p->next)
-      p = p->next;
-    p->next = player;
+    roster_add (&state->roster, buf);
     return TRUE;
   }
-  else
-  {
-    for (p = state->players; p->next; p = p->next);
-    p->type = strdup (buf);
-    return FALSE;
-  }
+  player = &state->roster.players[state->roster.len - 1];
+  player->type = strdup (buf);
+  ui_player_joined (state, player->name, player->type);
+  return FALSE;
 }
 
 static pbool
-handle_remove_player (STATE *state, const char *buf)
+handle_remove_player (STATE *state, const char *buf, int len)
 {
-  PLAYER *player = state->players;
-  PLAYER *prev = NULL;;
-
   if (!buf)
     return TRUE;
-
-  while (player)
-  {
-    if (!strcmp (player->name, buf))
-    {
-      if (prev)
-        prev->next = player->next;
-      else
-        state->players = player->next;
-      free (player->name);
-      free (player);
-      return FALSE;
-    }
-    prev = player;
-    player = player->next;
-  }
-
+  if (roster_remove (&state->roster, buf) == 0)
+    ui_player_left (state, buf);
   return FALSE;
 }
 
 static pbool
-handle_shutdown (STATE *state, const char *buf)
+handle_shutdown (STATE *state, const char *buf, int len)
 {
+  if (state->reconnect.max_attempts != 0)
+  {
+    ui_writeline (state, "The game is shutting down. We will reconnect when it comes back.");
+    return FALSE;
+  }
   ui_writeline (state, "The game is shutting down. Press any key to exit..");
   ui_get_key (state);
   return FALSE;
 }
 
 static pbool
-handle_error (STATE *state, const char *buf)
+handle_error (STATE *state, const char *buf, int len)
 {
   if (!buf)
     return TRUE;
+  if (!state->protocol_known)
+    state->refused = TRUE;
   fprintf (stderr, "ERROR: %s\n", buf);
   return FALSE;
 }
 
 static pbool
-handle_clear (STATE *state, const char *buf)
+handle_clear (STATE *state, const char *buf, int len)
 {
   ui_clear (state);
   return FALSE;
 }
 
 static pbool
-handle_writeline (STATE *state, const char *buf)
+handle_writeline (STATE *state, const char *buf, int len)
 {
   if (!buf)
     return TRUE;
@@ -176,21 +161,19 @@ handle_writeline (STATE *state, const char *buf)
 }
 
 static pbool
-handle_buttons (STATE *state, const char *buf)
+handle_buttons (STATE *state, const char *buf, int len)
 {
   if (!buf)
   {
     int i;
     for (i = 0; i < 8; i++)
-    {
-      free (state->buttons[i]);
       state->buttons[i] = NULL;
-    }
+    arena_reset (&state->dialog_arena);
     state->dialog_mode = state->cur_packet;
     return TRUE;
   }
   if (buf[0])
-    state->buttons[state->line_count] = strdup (buf);
+    state->buttons[state->line_count] = arena_strdup (&state->dialog_arena, buf);
   state->line_count++;
   if (state->line_count < 8)
     return TRUE;
@@ -199,7 +182,7 @@ handle_buttons (STATE *state, const char *buf)
 }
 
 static pbool
-handle_string_dialog (STATE *state, const char *buf)
+handle_string_dialog (STATE *state, const char *buf, int len)
 {
   if (!buf)
     return TRUE;
@@ -210,7 +193,7 @@ handle_string_dialog (STATE *state, const char *buf)
 }
 
 static pbool
-handle_scoreboard_dialog (STATE *state, const char *buf)
+handle_scoreboard_dialog (STATE *state, const char *buf, int len)
 {
   if (!buf)
     return TRUE;
@@ -236,7 +219,7 @@ handle_scoreboard_dialog (STATE *state, const char *buf)
 }
 
 static pbool
-handle_chat (STATE *state, const char *buf)
+handle_chat (STATE *state, const char *buf, int len)
 {
   if (!buf)
     return TRUE;
@@ -245,20 +228,86 @@ handle_chat (STATE *state, const char *buf)
 }
 
 static pbool
-handle_activate_chat (STATE *state, const char *buf)
+handle_activate_chat (STATE *state, const char *buf, int len)
 {
   ui_chat_enable (state, 1);
   return FALSE;
 }
 
 static pbool
-handle_deactivate_chat (STATE *state, const char *buf)
+handle_deactivate_chat (STATE *state, const char *buf, int len)
 {
   ui_chat_enable (state, 0);
   return FALSE;
 }
 
-static const char *player_info_records[] =
+/* Not from the server: a spectator is about to be sent a snapshot of the
+ * session it watches (see spectate.c), so forget what we had. Its line is
+ * the version that session speaks. */
+static pbool
+handle_spectate_reset (STATE *state, const char *buf, int len)
+{
+  const PROTOCOL *protocol;
+
+  if (!buf)
+    return TRUE;
+  protocol = protocol_find (buf);
+  if (protocol)
+    state->protocol = protocol;
+  roster_clear (&state->roster);
+  ui_player_left (state, NULL);
+  ui_timeout (state);
+  ui_clear (state);
+  return FALSE;
+}
+
+static const char *const player_info_records_403[] =
+{
+  "TItle",
+  "Location",
+  "Account",
+  "Network",
+  "Channel",
+  "Level",
+  "Experience",
+  "Next level",
+  "Energy",
+  "Max energy",
+  "Shield",
+  "Strength",
+  "Max strength",
+  "Sword",
+  "Quickness",
+  "Max quickness",
+  "Quicksilver",
+  "Brains",
+  "Magic level",
+  "Mana",
+  "Gender",
+  "Poison",
+  "Sin",
+  "Lives",
+  "Gold",
+  "Gems",
+  "Holy water",
+  "Amulets",
+  "Charms",
+  "Crowns",
+  "Virgin",
+  "Blessing",
+  "Palantir",
+  "Ring",
+  "Cloaked",
+  "Blind",
+  "Age",
+  "Degenerated",
+  "Time played",
+  "Date loaded",
+  "Date created",
+  NULL
+};
+
+static const char *const player_info_records_501[] =
 {
   "TItle",
   "Location",
@@ -294,9 +343,7 @@ static const char *player_info_records[] =
   "Blessing",
   "Palantir",
   "Ring",
-#ifdef PHANT5
   "Staff",
-#endif
   "Cloaked",
   "Blind",
   "Age",
@@ -308,18 +355,18 @@ static const char *player_info_records[] =
 };
 
 static pbool
-handle_player_info (STATE *state, const char *buf)
+handle_player_info (STATE *state, const char *buf, int len)
 {
   char out[256];
 
   if (!buf)
     return TRUE;
 
-  snprintf (out, sizeof (out), "%s: %s", player_info_records[state->line_count++], buf);
+  snprintf (out, sizeof (out), "%s: %s", state->protocol->player_info_records[state->line_count++], buf);
   out[sizeof(out) - 1] = '\0';
   ui_post_special_text (state, out);
 
-  if (!player_info_records[state->line_count])
+  if (!state->protocol->player_info_records[state->line_count])
   {
     ui_post_special_text (state, NULL);
     return FALSE;
@@ -329,7 +376,7 @@ handle_player_info (STATE *state, const char *buf)
 }
 
 static pbool
-handle_examine (STATE *state, const char *buf)
+handle_examine (STATE *state, const char *buf, int len)
 {
   if (!buf)
     return TRUE;
@@ -351,27 +398,29 @@ handle_examine (STATE *state, const char *buf)
   }
 }
 
-static pbool
-handle_name (STATE *state, const char *buf)
+/* The player's name and location are replaced every so often, so they are
+ * kept in two arenas that take turns. Once the one in use has filled its
+ * block, the other is emptied, and both strings move there. */
+void
+set_player_string (STATE *state, char **field, const char *buf)
 {
-  if (!buf)
+  char **other = (field == &state->player.name ? &state->player.location : &state->player.name);
+
+  if (arena_room (&state->strings[state->strings_cur]) <= strlen (buf))
   {
-    free (state->player.name);
-    state->player.name = NULL;
-    return TRUE;
+    state->strings_cur ^= 1;
+    arena_reset (&state->strings[state->strings_cur]);
+    if (*other)
+      *other = arena_strdup (&state->strings[state->strings_cur], *other);
   }
-  if (buf[0])
-    state->player.name = strdup (buf);
-  ui_update_stat (state, state->cur_packet);
-  return FALSE;
+  *field = arena_strdup (&state->strings[state->strings_cur], buf);
 }
 
 static pbool
-handle_location (STATE *state, const char *buf)
+handle_location (STATE *state, const char *buf, int len)
 {
   if (!buf)
   {
-    free (state->player.location);
     state->player.location = NULL;
     return TRUE;
   }
@@ -384,7 +433,7 @@ handle_location (STATE *state, const char *buf)
     state->player.x = atoi (buf);
     return TRUE;
   case 2:
-    state->player.location = strdup (buf);
+    set_player_string (state, &state->player.location, buf);
     ui_update_stat (state, state->cur_packet);
     return FALSE;
   default: /* shouldn't reach here */
@@ -393,235 +442,117 @@ handle_location (STATE *state, const char *buf)
 }
 
 static pbool
-handle_int_array (STATE *state, const char *buf, int *out, int count)
-{
-  if (!buf)
-    return TRUE;
-
-  out[state->line_count++] = atoi (buf);
-  if (state->line_count >= count)
-  {
-    ui_update_stat (state, state->cur_packet);
-    return FALSE;
-  }
-
-  return TRUE;
-}
-
-static pbool
-handle_energy (STATE *state, const char *buf)
-{
-  return handle_int_array (state, buf, state->player.energy, 3);
-}
-
-static pbool
-handle_strength (STATE *state, const char *buf)
+handle_timed_ping (STATE *state, const char *buf, int len)
 {
-  return handle_int_array (state, buf, state->player.strength, 2);
+  send_string_f (state, "%d", C_PONG_PACKET);
+  latency_reply_queued (state);
+  latency_ping_received (state);
+  return FALSE;
 }
 
+/* Packets that just set fields of state->player (see PACKET_TABLE) */
 static pbool
-handle_speed (STATE *state, const char *buf)
+handle_stat (STATE *state, const char *buf, int len)
 {
-  return handle_int_array (state, buf, state->player.speed, 2);
-}
+  const PACKET_INFO *info = &state->protocol->packets[state->cur_packet];
+  char *field = (char *) state + info->offset;
 
-static pbool
-handle_int_val (STATE *state, const char *buf, int *out)
-{
   if (!buf)
+  {
+    if (info->kind == PACKET_STRING)
+      *(char **) field = NULL;
     return TRUE;
-  *out = atoi (buf);
-  ui_update_stat (state, state->cur_packet);
-  return FALSE;
-}
-
-static pbool
-handle_shield (STATE *state, const char *buf)
-{
-  return handle_int_val (state, buf, &state->player.shield);
-}
-
-static pbool
-handle_sword (STATE *state, const char *buf)
-{
-  return handle_int_val (state, buf, &state->player.sword);
-}
-
-static pbool
-handle_quicksilver (STATE *state, const char *buf)
-{
-  return handle_int_val (state, buf, &state->player.quicksilver);
-  return FALSE;
-}
-
-static pbool
-handle_mana (STATE *state, const char *buf)
-{
-#ifdef PHANT5
-  return handle_int_array (state, buf, state->player.mana, 2);
-#else
-  return handle_int_array (state, buf, state->player.mana, 1);
-#endif
-}
-
-static pbool
-handle_level (STATE *state, const char *buf)
-{
-  return handle_int_val (state, buf, &state->player.level);
-}
-
-static pbool
-handle_gold (STATE *state, const char *buf)
-{
-  return handle_int_val (state, buf, &state->player.gold);
-}
+  }
 
-static pbool
-handle_gems (STATE *state, const char *buf)
-{
-  return handle_int_val (state, buf, &state->player.gems);
-}
+  switch (info->kind)
+  {
+  case PACKET_INT:
+    ((int *) field)[state->line_count] = atoi (buf);
+    break;
+  case PACKET_BOOL:
+    if (!strcmp (buf, "Yes"))
+      ((pbool *) field)[state->line_count] = 1;
+    else if (!strcmp (buf, "No"))
+      ((pbool *) field)[state->line_count] = 0;
+    else
+      log_error (LOG_PROTO, "%s: Unexpected value %s, packet %d\n", __func__, buf, state->cur_packet);
+    break;
+  case PACKET_STRING:
+    if (buf[0])
+      set_player_string (state, (char **) field, buf);
+    break;
+  }
 
-static pbool
-handle_bool_val (STATE *state, const char *buf, int *out)
-{
-  if (!buf)
+  if (++state->line_count < info->count)
     return TRUE;
-  if (!strcmp (buf, "Yes"))
-    *out = 1;
-  else if (!strcmp (buf, "No"))
-    *out = 0;
-  else
-    dlog ("ERROR: %s: Unexpected value %s, packet %d\n", __func__, buf, state->cur_packet);
   ui_update_stat (state, state->cur_packet);
   return FALSE;
 }
 
-static pbool
-handle_cloak (STATE *state, const char *buf)
-{
-  return handle_bool_val (state, buf, &state->player.cloak);
-}
-
-static pbool
-handle_blessing (STATE *state, const char *buf)
-{
-  return handle_bool_val (state, buf, &state->player.blessing);
-}
-
-static pbool
-handle_crown (STATE *state, const char *buf)
-{
-  return handle_bool_val (state, buf, &state->player.crown);
-}
-
-static pbool
-handle_palantir (STATE *state, const char *buf)
-{
-  return handle_bool_val (state, buf, &state->player.palantir);
-}
+#define HANDLER_HANDLER(field) handle_##field
+#define HANDLER_INT(field) handle_stat
+#define HANDLER_BOOL(field) handle_stat
+#define HANDLER_STRING(field) handle_stat
+#define OFFSET_HANDLER(field) 0
+#define OFFSET_INT(field) offsetof (STATE, player.field)
+#define OFFSET_BOOL(field) offsetof (STATE, player.field)
+#define OFFSET_STRING(field) offsetof (STATE, player.field)
 
-static pbool
-handle_ring (STATE *state, const char *buf)
-{
-  return handle_bool_val (state, buf, &state->player.ring);
-}
+#define PACKET(number, kind, field, count, label) \
+  [number] = { #number, HANDLER_##kind (field), PACKET_##kind, OFFSET_##kind (field), count, label },
 
-static pbool
-handle_virgin (STATE *state, const char *buf)
-{
-  return handle_bool_val (state, buf, &state->player.virgin);
-}
+static const char *const handshake_403[] = { NULL };
+static const char *const handshake_501[] = { "BETA", "010", NULL };
 
-static pbool
-handle_timed_ping (STATE *state, const char *buf)
+#define PER_VERSION(v403, v501) v403
+const PROTOCOL protocol_403 =
 {
-  send_string_f (state, "%d", C_PONG_PACKET);
-  return FALSE;
-}
-
-static pbool
-handle_amulets (STATE *state, const char *buf)
-{
-  return handle_int_val (state, buf, &state->player.amulets);
-}
+  "4.03",
+  handshake_403,
+  player_info_records_403,
+  {
+    PACKET_TABLE (PACKET)
+    PACKET (SPECTATE_RESET_PACKET, HANDLER, spectate_reset, 0, NULL)
+  }
+};
+#undef PER_VERSION
 
-static pbool
-handle_charms (STATE *state, const char *buf)
+#define PER_VERSION(v403, v501) v501
+const PROTOCOL protocol_501 =
 {
-  return handle_int_val (state, buf, &state->player.charms);
-}
+  "5.01",
+  handshake_501,
+  player_info_records_501,
+  {
+    PACKET_TABLE (PACKET)
+    PACKET (SPECTATE_RESET_PACKET, HANDLER, spectate_reset, 0, NULL)
+  }
+};
+#undef PER_VERSION
 
-static pbool
-handle_tokens (STATE *state, const char *buf)
-{
-  return handle_int_val (state, buf, &state->player.tokens);
-}
+#undef PACKET
 
-static pbool
-handle_staff (STATE *state, const char *buf)
-{
-  /* TODO: ui.c has no support for this */
-  return handle_bool_val (state, buf, &state->player.staff);
-}
+const PROTOCOL *forced_protocol;
 
-void
-init_handlers ()
+/* Returns NULL if name isn't a version we speak */
+const PROTOCOL *
+protocol_find (const char *name)
 {
-  handlers[HANDSHAKE_PACKET] = handle_handshake;
-  handlers[CLOSE_CONNECTION_PACKET] = handle_close;
-  handlers[PING_PACKET] = handle_ping;
-  handlers[ADD_PLAYER_PACKET] = handle_add_player;
-  handlers[REMOVE_PLAYER_PACKET] = handle_remove_player;
-  handlers[SHUTDOWN_PACKET] = handle_shutdown;
-  handlers[ERROR_PACKET] = handle_error;
-  handlers[CLEAR_PACKET] = handle_clear;
-  handlers[WRITE_LINE_PACKET] = handle_writeline;
-  handlers[BUTTONS_PACKET] = handle_buttons;
-  handlers[FULL_BUTTONS_PACKET] = handle_buttons;
-  handlers[STRING_DIALOG_PACKET] = handle_string_dialog;
-  handlers[COORDINATES_DIALOG_PACKET] = handle_string_dialog;
-  handlers[PLAYER_DIALOG_PACKET] = handle_string_dialog;
-  handlers[PASSWORD_DIALOG_PACKET] = handle_string_dialog;
-  handlers[SCOREBOARD_DIALOG_PACKET] = handle_scoreboard_dialog;
-  handlers[CHAT_PACKET] = handle_chat;
-  handlers[ACTIVATE_CHAT_PACKET] = handle_activate_chat;
-  handlers[DEACTIVATE_CHAT_PACKET] = handle_deactivate_chat;
-  handlers[PLAYER_INFO_PACKET] = handle_player_info;
-  handlers[EXAMINE_PACKET] = handle_examine;
-  handlers[NAME_PACKET] = handle_name;
-  handlers[LOCATION_PACKET] = handle_location;
-  handlers[ENERGY_PACKET] = handle_energy;
-  handlers[STRENGTH_PACKET] = handle_strength;
-  handlers[SPEED_PACKET] = handle_speed;
-  handlers[SHIELD_PACKET] = handle_shield;
-  handlers[SWORD_PACKET] = handle_sword;
-  handlers[QUICKSILVER_PACKET] = handle_quicksilver;
-  handlers[MANA_PACKET] = handle_mana;
-  handlers[LEVEL_PACKET] = handle_level;
-  handlers[GOLD_PACKET] = handle_gold;
-  handlers[GEMS_PACKET] = handle_gems;
-  handlers[CLOAK_PACKET] = handle_cloak;
-  handlers[BLESSING_PACKET] = handle_blessing;
-  handlers[CROWN_PACKET] = handle_crown;
-  handlers[PALANTIR_PACKET] = handle_palantir;
-  handlers[RING_PACKET] = handle_ring;
-  handlers[VIRGIN_PACKET] = handle_virgin;
-  handlers[TIMED_PING_PACKET] = handle_timed_ping;
-  handlers[AMULETS_PACKET] = handle_amulets;
-  handlers[CHARMS_PACKET] = handle_charms;
-  handlers[TOKENS_PACKET] = handle_tokens;
-  handlers[STAFF_PACKET] = handle_staff;
+  if (!strcmp (name, protocol_403.name))
+    return &protocol_403;
+  if (!strcmp (name, protocol_501.name))
+    return &protocol_501;
+  return NULL;
 }
 
 pbool
-handle_packet (STATE *state, const char *buf)
+handle_packet (STATE *state, const char *buf, int len)
 {
+  const PACKET_INFO *info;
   int type = 0;
   int ret;
 
-  dlog ("%s: %s\n", __func__, buf);
+  log_trace (LOG_PROTO, "%s: %s\n", __func__, buf);
   sscanf (buf, "%d", &type);
   if (type == 0)
   {
@@ -636,16 +567,21 @@ handle_packet (STATE *state, const char *buf)
 
   state->cur_packet = type;
   state->line_count = 0;
-  if (!handlers[type])
+  info = &state->protocol->packets[type];
+  if (!info->handler)
   {
     fprintf (stderr, "%s: No handler for packet %d\n", __func__, type);
     return -1;
   }
 
-  ret = handlers[type] (state, NULL);
+  /* Anything but a refusal means the server took our handshake */
+  if (type != HANDSHAKE_PACKET && type != ERROR_PACKET && type != CLOSE_CONNECTION_PACKET)
+    state->protocol_known = TRUE;
+
+  ret = info->handler (state, NULL, 0);
 
   if (ret == 1)
-    state->sdh = handlers[type];
+    state->sdh = info->handler;
 
   return ret;
 }
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+#include "histogram.h"
+
+#include <string.h>
+
+/* Values below HIST_SUB_COUNT get a bucket each. Above that, the bucket is
+ * picked by the position of the highest set bit and the HIST_SUB_BITS bits
+ * that follow it. */
+static int
+bucket_for (unsigned long long value)
+{
+  int bits;
+  int index;
+
+  if (value < HIST_SUB_COUNT)
+    return (int) value;
+
+  bits = 63 - __builtin_clzll (value);	/* index of the highest set bit */
+  if (bits >= HIST_MAX_BITS)
+    return HIST_BUCKETS - 1;
+  index = (bits - HIST_SUB_BITS + 1) * HIST_SUB_COUNT;
+  return index + (int) ((value >> (bits - HIST_SUB_BITS)) - HIST_SUB_COUNT);
+}
+
+/* The largest value that maps to the given bucket */
+static unsigned long long
+bucket_value (int bucket)
+{
+  int bits;
+  unsigned long long sub;
+
+  if (bucket < HIST_SUB_COUNT)
+    return bucket;
+
+  bits = bucket / HIST_SUB_COUNT + HIST_SUB_BITS - 1;
+  sub = bucket % HIST_SUB_COUNT + HIST_SUB_COUNT;
+  return ((sub + 1) << (bits - HIST_SUB_BITS)) - 1;
+}
+
+void
+hist_record (HISTOGRAM *hist, unsigned long long value)
+{
+  hist->counts[bucket_for (value)]++;
+  if (hist->count == 0 || value < hist->min)
+    hist->min = value;
+  if (value > hist->max)
+    hist->max = value;
+  hist->count++;
+  hist->sum += value;
+}
+
+/* Returns the value below which the given percentage (0 - 100) of the
+ * recorded values fall, or 0 if nothing has been recorded. */
+unsigned long long
+hist_percentile (const HISTOGRAM *hist, double percentile)
+{
+  unsigned long long want;
+  unsigned long long seen = 0;
+  unsigned long long value;
+  int i;
+
+  if (hist->count == 0)
+    return 0;
+
+  want = (unsigned long long) (hist->count * percentile / 100.0 + 0.5);
+  if (want < 1)
+    want = 1;
+
+  for (i = 0; i < HIST_BUCKETS; i++)
+  {
+    seen += hist->counts[i];
+    if (seen >= want)
+    {
+      value = bucket_value (i);
+      return (value > hist->max ? hist->max : value);
+    }
+  }
+  return hist->max;
+}
+
+void
+hist_merge (HISTOGRAM *dst, const HISTOGRAM *src)
+{
+  int i;
+
+  if (src->count == 0)
+    return;
+  for (i = 0; i < HIST_BUCKETS; i++)
+    dst->counts[i] += src->counts[i];
+  if (dst->count == 0 || src->min < dst->min)
+    dst->min = src->min;
+  if (src->max > dst->max)
+    dst->max = src->max;
+  dst->count += src->count;
+  dst->sum += src->sum;
+}
+
+void
+hist_reset (HISTOGRAM *hist)
+{
+  memset (hist, 0, sizeof (*hist));
+}
+
+/* Writes a summary as a JSON object, with times converted from nanoseconds
+ * to milliseconds */
+void
+hist_print_json (FILE *fp, const HISTOGRAM *hist)
+{
+  fprintf (fp, "{\"count\": %llu", hist->count);
+  if (hist->count > 0)
+  {
+    fprintf (fp, ", \"min_ms\": %.3f, \"mean_ms\": %.3f", hist->min / 1e6, (double) hist->sum / hist->count / 1e6);
+    fprintf (fp, ", \"p50_ms\": %.3f", hist_percentile (hist, 50.0) / 1e6);
+    fprintf (fp, ", \"p90_ms\": %.3f", hist_percentile (hist, 90.0) / 1e6);
+    fprintf (fp, ", \"p99_ms\": %.3f", hist_percentile (hist, 99.0) / 1e6);
+    fprintf (fp, ", \"p999_ms\": %.3f", hist_percentile (hist, 99.9) / 1e6);
+    fprintf (fp, ", \"max_ms\": %.3f", hist->max / 1e6);
+  }
+  fprintf (fp, "}");
+}
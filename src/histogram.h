@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdio.h>
+
+/* A log-bucketed histogram, in the style of HdrHistogram. Each power of two
+ * is split into 2^HIST_SUB_BITS linear buckets, so any recorded value is
+ * known to within about 3%, and recording is a few shifts and an increment.
+ * Values are normally nanoseconds; anything from 2^HIST_MAX_BITS up (about
+ * 18 minutes) lands in the last bucket. */
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+typedef struct
+{
+  unsigned int counts[HIST_BUCKETS];
+  unsigned long long count;
+  unsigned long long min;
+  unsigned long long max;
+  unsigned long long sum;
+} HISTOGRAM;
+
+void hist_record (HISTOGRAM *hist, unsigned long long value);
+unsigned long long hist_percentile (const HISTOGRAM *hist, double percentile);
+void hist_merge (HISTOGRAM *dst, const HISTOGRAM *src);
+void hist_reset (HISTOGRAM *hist);
+void hist_print_json (FILE *fp, const HISTOGRAM *hist);
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+#include "history.h"
+
+#include <stdlib.h>
+
+void
+history_add (HISTORY *history, const char *s)
+{
+  int chunk = history->count / HISTORY_CHUNK;
+
+  if (chunk == history->nchunks)
+  {
+    if (history->nchunks == history->chunks_size)
+    {
+      history->chunks_size = (history->chunks_size ? history->chunks_size * 2 : 16);
+      history->chunks = (const char ***) realloc (history->chunks, history->chunks_size * sizeof (const char **));
+    }
+    history->chunks[history->nchunks++] = (const char **) malloc (HISTORY_CHUNK * sizeof (const char *));
+  }
+  history->chunks[chunk][history->count % HISTORY_CHUNK] = arena_strdup (&history->text, s);
+  history->count++;
+}
+
+/* n counts from 0, the oldest */
+const char *
+history_get (HISTORY *history, long n)
+{
+  if (n < 0 || n >= history->count)
+    return NULL;
+  return history->chunks[n / HISTORY_CHUNK][n % HISTORY_CHUNK];
+}
+
+void
+history_free (HISTORY *history)
+{
+  int i;
+
+  for (i = 0; i < history->nchunks; i++)
+    free (history->chunks[i]);
+  free (history->chunks);
+  arena_free (&history->text);
+  history->chunks = NULL;
+  history->nchunks = history->chunks_size = 0;
+  history->count = 0;
+}
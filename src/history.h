@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "arena.h"
+
+/* An append-only list of strings, such as chat messages, that can hold
+ * hundreds of thousands of them. The text goes into an arena, so it never
+ * moves, and the index of where each string starts is kept in chunks of
+ * HISTORY_CHUNK, so that growing it never copies it and string n is found
+ * in O(1). A zeroed HISTORY is empty. */
+
+#define HISTORY_CHUNK 4096
+
+typedef struct
+{
+  ARENA text;
+  const char ***chunks; /* each HISTORY_CHUNK string pointers */
+  int nchunks;
+  int chunks_size;
+  long count;
+} HISTORY;
+
+void history_add (HISTORY *history, const char *s);
+const char *history_get (HISTORY *history, long n);
+void history_free (HISTORY *history);
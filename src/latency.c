@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+/* Latency measurement. Two things are timed, with the monotonic clock:
+ * - rtt: we send C_PING_REQUEST every so often, and the server answers
+ *   with a TIMED_PING. This is the round trip as the player feels it.
+ * - reply: how long a PING or TIMED_PING from the server waits before our
+ *   answer is written to the socket. This is our own contribution, ie
+ *   time spent parsing a burst or drawing the screen.
+ */
+
+#include "phantcli.h"
+
+#include <stdio.h>
+
+/* A probe that hasn't been answered in this long is given up on. The
+ * server sends TIMED_PINGs of its own too, every 10 seconds or so, and one
+ * of those must not be taken for the answer to a probe it never saw. */
+#define PROBE_EXPIRE 2000000000ULL
+
+/* Whether the probe sent, if any, can still be answered */
+static pbool
+probe_waiting (STATE *state, unsigned long long now)
+{
+  if (state->latency.probe_sent && now > state->latency.probe_sent + PROBE_EXPIRE)
+    state->latency.probe_sent = 0;
+  return (state->latency.probe_sent != 0);
+}
+
+/* Only one probe is out at a time, so that each TIMED_PING is the answer
+ * to a known probe, or to none */
+static void
+probe_timeout (LOOP *loop, TIMER *timer)
+{
+  STATE *state = (STATE *) timer->data;
+  unsigned long long now = loop_now_ns ();
+
+  if (state->fd != -1 && !probe_waiting (state, now))
+  {
+    send_string_f (state, "%d", C_PING_REQUEST_PACKET);
+    state->latency.probe_sent = now;
+  }
+
+  loop_add_timer (loop, timer, state->latency.probe_interval);
+}
+
+/* Starts probing the server every interval_ms milliseconds, if that isn't
+ * 0. Called whenever the session (re)connects. */
+void
+latency_start (STATE *state, int interval_ms)
+{
+  state->latency.probe_sent = 0;
+  state->latency.reply_since = 0;
+  state->latency.probe_interval = interval_ms;
+  if (interval_ms <= 0)
+    return;
+  state->latency.probe_timer.func = probe_timeout;
+  state->latency.probe_timer.data = state;
+  loop_add_timer (state->loop, &state->latency.probe_timer, interval_ms);
+}
+
+void
+latency_stop (STATE *state)
+{
+  loop_remove_timer (state->loop, &state->latency.probe_timer);
+}
+
+/* A reply to a server ping has been queued. Time runs from when the ping
+ * was read until the reply is flushed. */
+void
+latency_reply_queued (STATE *state)
+{
+  if (!state->latency.reply_since)
+    state->latency.reply_since = state->latency.read_ns;
+}
+
+/* Called after a flush has emptied the output buffer */
+void
+latency_reply_flushed (STATE *state)
+{
+  if (!state->latency.reply_since)
+    return;
+  hist_record (&state->latency.reply, loop_now_ns () - state->latency.reply_since);
+  state->latency.reply_since = 0;
+}
+
+/* A TIMED_PING arrived. If our probe is still waiting, this answers it;
+ * otherwise the server sent it on its own, and it is no sample. */
+void
+latency_ping_received (STATE *state)
+{
+  unsigned long long sent = state->latency.probe_sent;
+
+  /* A viewer sees the player's pings, which answer nobody's probe */
+  if (state->watching || !probe_waiting (state, state->latency.read_ns) || state->latency.read_ns < sent)
+    return; /* or it was read before the probe went */
+  state->latency.probe_sent = 0;
+  hist_record (&state->latency.rtt, state->latency.read_ns - sent);
+  hist_record (&totals.rtt, state->latency.read_ns - sent);
+  ui_update_status (state);
+}
+
+/* Formats the round trip percentiles for the status line */
+void
+latency_describe (STATE *state, char *buf, int size)
+{
+  const HISTOGRAM *rtt = &state->latency.rtt;
+
+  if (rtt->count == 0)
+  {
+    snprintf (buf, size, "RTT: no samples");
+    return;
+  }
+  snprintf (buf, size, "RTT p50 %.1fms p99 %.1fms p999 %.1fms (%llu)", hist_percentile (rtt, 50.0) / 1e6, hist_percentile (rtt, 99.0) / 1e6, hist_percentile (rtt, 99.9) / 1e6, rtt->count);
+}
+
+/* Writes the session's statistics as a JSON object */
+void
+latency_print_json (FILE *fp, STATE *state)
+{
+  fprintf (fp, "{\"session\": %d, \"rtt\": ", state->id);
+  hist_print_json (fp, &state->latency.rtt);
+  fprintf (fp, ", \"reply\": ");
+  hist_print_json (fp, &state->latency.reply);
+  fprintf (fp, ", \"reconnects\": %d, \"recover_max_ms\": %llu, \"recover_total_ms\": %llu", state->reconnect.count, state->reconnect.max_ms, state->reconnect.total_ms);
+  fprintf (fp, ", \"in_high_water\": %d, \"out_bytes\": %ld, \"out_flushes\": %ld, \"out_syscalls\": %ld}", state->in.high_water, state->out.bytes, state->out.flushes, state->out.syscalls);
+}
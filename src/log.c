@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+#include "log.h"
+#include "loop.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_SLOTS 4096 /* a power of two */
+#define LOG_TEXT 240
+#define FLUSH_MS 50
+
+/* Unlike a RING, the log has a producer on every thread. A producer claims
+ * a slot by moving tail on, and then hands it to the flush thread by setting
+ * its seq to one past the claimed position. The flush thread hands it back
+ * by setting seq to the position it will have the next time around. */
+typedef struct
+{
+  unsigned int seq;
+  unsigned short category;
+  unsigned short len;
+  unsigned long long ns;
+  char text[LOG_TEXT];
+} SLOT;
+
+int log_level;
+int log_categories;
+
+static SLOT *slots;
+static unsigned int tail __attribute__ ((aligned (64)));
+static unsigned int head __attribute__ ((aligned (64)));
+static unsigned long dropped;
+static unsigned long long start_ns;
+static FILE *log_fp;
+static pthread_t flush_thread;
+static int stopping;
+
+static const struct
+{
+  const char *name;
+  int category;
+} category_names[] =
+{
+  { "net", LOG_NET },
+  { "proto", LOG_PROTO },
+  { "ui", LOG_UI },
+  { "spectate", LOG_SPECTATE },
+  { "replay", LOG_REPLAY },
+};
+
+static const char *level_names[] = { "error", "info", "debug", "trace" };
+
+static const char *
+category_name (int category)
+{
+  int i;
+
+  for (i = 0; i < sizeof (category_names) / sizeof (category_names[0]); i++)
+    if (category_names[i].category == category)
+      return category_names[i].name;
+  return "?";
+}
+
+static int
+parse_categories (const char *list)
+{
+  char *copy = strdup (list);
+  char *save;
+  char *name;
+  int mask = 0;
+  int i;
+
+  for (name = strtok_r (copy, ",", &save); name; name = strtok_r (NULL, ",", &save))
+  {
+    for (i = 0; i < sizeof (category_names) / sizeof (category_names[0]); i++)
+      if (!strcmp (name, category_names[i].name))
+        mask |= category_names[i].category;
+  }
+  free (copy);
+  return mask;
+}
+
+/* Writes out everything in the ring. Flush thread only, or at exit once it
+ * has stopped. */
+static void
+drain ()
+{
+  unsigned long lost;
+
+  for (;;)
+  {
+    SLOT *slot = &slots[head & (LOG_SLOTS - 1)];
+    unsigned long long ms;
+
+    if (__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) != head + 1)
+      break;
+    ms = (slot->ns - start_ns) / 1000000;
+    fprintf (log_fp, "%llu.%03llu %s: ", ms / 1000, ms % 1000, category_name (slot->category));
+    fwrite (slot->text, 1, slot->len, log_fp);
+    __atomic_store_n (&slot->seq, head + LOG_SLOTS, __ATOMIC_RELEASE);
+    head++;
+  }
+  lost = __atomic_exchange_n (&dropped, 0, __ATOMIC_RELAXED);
+  if (lost)
+    fprintf (log_fp, "(log full: dropped %lu messages)\n", lost);
+  fflush (log_fp);
+}
+
+static void *
+flush_main (void *data)
+{
+  struct timespec ts = { 0, FLUSH_MS * 1000000 };
+
+  while (!__atomic_load_n (&stopping, __ATOMIC_ACQUIRE))
+  {
+    nanosleep (&ts, NULL);
+    drain ();
+  }
+  return NULL;
+}
+
+/* Registered with atexit by log_init, so it runs after any cleanup that was
+ * registered later, and what that logs is written out too. */
+static void
+log_shutdown ()
+{
+  __atomic_store_n (&stopping, 1, __ATOMIC_RELEASE);
+  if (!pthread_equal (pthread_self (), flush_thread))
+    pthread_join (flush_thread, NULL);
+  drain ();
+  fclose (log_fp);
+  log_level = 0;
+}
+
+/* Reads PHANTCLI_DEBUG and, if it asks for anything, starts the flush
+ * thread. Call once, before any other threads are started. */
+void
+log_init ()
+{
+  const char *env = getenv ("PHANTCLI_DEBUG");
+  const char *colon;
+  int len;
+  int level;
+  int i;
+
+  if (!env || !*env)
+    return;
+  colon = strchr (env, ':');
+  log_categories = (colon ? parse_categories (colon + 1) : LOG_ALL);
+  len = (colon ? colon - env : strlen (env));
+  level = LOG_TRACE;
+  for (i = 0; len && i < LOG_TRACE; i++)
+    if (!strncmp (env, level_names[i], len))
+      level = i + 1;
+
+  slots = (SLOT *) calloc (LOG_SLOTS, sizeof (SLOT));
+  log_fp = fopen ("debug.log", "a");
+  if (!slots || !log_fp)
+  {
+    perror ("debug.log");
+    free (slots);
+    if (log_fp)
+      fclose (log_fp);
+    return;
+  }
+  for (i = 0; i < LOG_SLOTS; i++)
+    slots[i].seq = i;
+  start_ns = loop_now_ns ();
+  if (pthread_create (&flush_thread, NULL, flush_main, NULL))
+  {
+    fclose (log_fp);
+    free (slots);
+    return;
+  }
+  atexit (log_shutdown);
+  log_level = level;
+}
+
+/* Formats a message into the ring. Safe from any thread; if the ring is
+ * full, the message is counted and dropped. */
+void
+log_write (int level, int category, const char *fmt, ...)
+{
+  unsigned int pos = __atomic_load_n (&tail, __ATOMIC_RELAXED);
+  SLOT *slot;
+  va_list args;
+  int len;
+
+  for (;;)
+  {
+    int diff;
+
+    slot = &slots[pos & (LOG_SLOTS - 1)];
+    diff = (int) (__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) - pos);
+    if (diff == 0)
+    {
+      if (__atomic_compare_exchange_n (&tail, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (diff < 0)
+    {
+      __atomic_add_fetch (&dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    else
+      pos = __atomic_load_n (&tail, __ATOMIC_RELAXED);
+  }
+
+  va_start (args, fmt);
+  len = vsnprintf (slot->text, LOG_TEXT, fmt, args);
+  va_end (args);
+  if (len < 0)
+    len = 0;
+  if (len >= LOG_TEXT)
+  {
+    /* Too long for a slot; keep the start */
+    len = LOG_TEXT - 1;
+    memcpy (slot->text + len - 4, "...\n", 4);
+  }
+  slot->len = len;
+  slot->category = category;
+  slot->ns = loop_now_ns ();
+  __atomic_store_n (&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+/* The debug log. A message is formatted straight into a slot of an
+ * in-memory ring, which any thread may write to without taking a lock, and
+ * a background thread writes the ring out to debug.log. A full ring drops
+ * messages rather than holding up the caller.
+ *
+ * What is logged is read once, from PHANTCLI_DEBUG, by log_init: a level
+ * (error, info, debug or trace), optionally followed by a colon and a list
+ * of categories, as in "info:net,spectate". Any other value, such as the
+ * old "1", logs everything. Levels above LOG_MAX_LEVEL and categories
+ * outside LOG_CATEGORIES are compiled out, arguments and all, so building
+ * with -DLOG_MAX_LEVEL=0 leaves nothing behind. */
+
+#define LOG_ERROR 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+#define LOG_TRACE 4 /* every line and packet */
+
+#define LOG_NET 0x01 /* connections and socket data */
+#define LOG_PROTO 0x02 /* packets and responses */
+#define LOG_UI 0x04
+#define LOG_SPECTATE 0x08
+#define LOG_REPLAY 0x10
+#define LOG_ALL 0x1f
+
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_TRACE
+#endif
+
+#ifndef LOG_CATEGORIES
+#define LOG_CATEGORIES LOG_ALL
+#endif
+
+extern int log_level;
+extern int log_categories;
+
+void log_init ();
+void log_write (int level, int category, const char *fmt, ...)
+  __attribute__ ((format (printf, 3, 4)));
+
+#define LOG_ON(level, category) \
+  (((category) & LOG_CATEGORIES) && (level) <= log_level && ((category) & log_categories))
+
+#define LOG(level, category, ...) \
+  do { if (LOG_ON (level, category)) log_write (level, category, __VA_ARGS__); } while (0)
+
+#if LOG_MAX_LEVEL >= LOG_ERROR
+#define log_error(category, ...) LOG (LOG_ERROR, category, __VA_ARGS__)
+#else
+#define log_error(category, ...) do { } while (0)
+#endif
+
+#if LOG_MAX_LEVEL >= LOG_INFO
+#define log_info(category, ...) LOG (LOG_INFO, category, __VA_ARGS__)
+#else
+#define log_info(category, ...) do { } while (0)
+#endif
+
+#if LOG_MAX_LEVEL >= LOG_DEBUG
+#define log_debug(category, ...) LOG (LOG_DEBUG, category, __VA_ARGS__)
+#else
+#define log_debug(category, ...) do { } while (0)
+#endif
+
+#if LOG_MAX_LEVEL >= LOG_TRACE
+#define log_trace(category, ...) LOG (LOG_TRACE, category, __VA_ARGS__)
+#else
+#define log_trace(category, ...) do { } while (0)
+#endif
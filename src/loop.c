@@ -0,0 +1,352 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+#include "loop.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+
+/* How many ready descriptors to fetch per epoll_wait call */
+#define MAX_EVENTS 256
+
+static void
+wake_io (LOOP *loop, WATCH *watch, unsigned int events)
+{
+  eventfd_t value;
+
+  eventfd_read (watch->fd, &value);
+}
+
+LOOP *
+loop_new ()
+{
+  LOOP *loop;
+  struct rlimit rl;
+  struct epoll_event ev;
+
+  loop = (LOOP *) calloc (sizeof (LOOP), 1);
+  loop->epfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (loop->epfd == -1)
+  {
+    perror ("epoll_create1");
+    free (loop);
+    return NULL;
+  }
+
+  /* Not counted in nwatches, so that it doesn't keep the loop running */
+  loop->wake.fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  loop->wake.events = EPOLLIN;
+  loop->wake.func = wake_io;
+  ev.events = EPOLLIN;
+  ev.data.ptr = &loop->wake;
+  if (loop->wake.fd == -1 || epoll_ctl (loop->epfd, EPOLL_CTL_ADD, loop->wake.fd, &ev) == -1)
+  {
+    perror ("eventfd");
+    close (loop->epfd);
+    free (loop);
+    return NULL;
+  }
+
+  /* Running many sessions needs many descriptors, so raise our soft limit
+   * as far as we're allowed to. */
+  if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+  {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit (RLIMIT_NOFILE, &rl);
+  }
+
+  return loop;
+}
+
+void
+loop_free (LOOP *loop)
+{
+  if (!loop)
+    return;
+  close (loop->epfd);
+  close (loop->wake.fd);
+  free (loop->timers);
+  free (loop);
+}
+
+int
+loop_add_watch (LOOP *loop, WATCH *watch)
+{
+  struct epoll_event ev;
+
+  ev.events = watch->events;
+  ev.data.ptr = watch;
+  if (epoll_ctl (loop->epfd, EPOLL_CTL_ADD, watch->fd, &ev) == -1)
+  {
+    perror ("epoll_ctl");
+    return -1;
+  }
+  loop->nwatches++;
+  return 0;
+}
+
+int
+loop_modify_watch (LOOP *loop, WATCH *watch, unsigned int events)
+{
+  struct epoll_event ev;
+
+  if (watch->events == events)
+    return 0;
+  watch->events = events;
+  ev.events = events;
+  ev.data.ptr = watch;
+  return epoll_ctl (loop->epfd, EPOLL_CTL_MOD, watch->fd, &ev);
+}
+
+void
+loop_remove_watch (LOOP *loop, WATCH *watch)
+{
+  int i;
+
+  /* Closing the descriptor would also remove it, but the descriptor may be
+   * shared (ie, stdin), so be explicit. */
+  if (epoll_ctl (loop->epfd, EPOLL_CTL_DEL, watch->fd, NULL) == 0)
+    loop->nwatches--;
+
+  /* The watch may be freed once we return, so make sure that we don't
+   * dispatch any events that are still queued for it in this batch. */
+  for (i = 0; i < loop->nready; i++)
+    if (loop->ready[i].data.ptr == watch)
+      loop->ready[i].data.ptr = NULL;
+}
+
+void
+loop_defer (LOOP *loop, DEFER *defer)
+{
+  if (defer->queued)
+    return;
+  defer->queued = 1;
+  defer->prev = NULL;
+  defer->next = loop->deferred;
+  if (loop->deferred)
+    loop->deferred->prev = defer;
+  loop->deferred = defer;
+}
+
+void
+loop_cancel_defer (LOOP *loop, DEFER *defer)
+{
+  if (!defer->queued)
+    return;
+  if (defer->prev)
+    defer->prev->next = defer->next;
+  else
+    loop->deferred = defer->next;
+  if (defer->next)
+    defer->next->prev = defer->prev;
+  defer->queued = 0;
+}
+
+/* Runs everything that was deferred. A callback may queue or cancel other
+ * work (or free its own DEFER), so take each one off the list before
+ * calling it. */
+static void
+run_deferred (LOOP *loop)
+{
+  DEFER *defer;
+
+  while ((defer = loop->deferred))
+  {
+    loop_cancel_defer (loop, defer);
+    defer->func (loop, defer);
+  }
+}
+
+/* Monotonic time in nanoseconds */
+unsigned long long
+loop_now_ns ()
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Monotonic time in milliseconds, as used for timers */
+unsigned long long
+loop_now ()
+{
+  return loop_now_ns () / 1000000;
+}
+
+static void
+heap_set (LOOP *loop, int i, TIMER *timer)
+{
+  loop->timers[i] = timer;
+  timer->index = i + 1;
+}
+
+static void
+heap_up (LOOP *loop, int i)
+{
+  TIMER *timer = loop->timers[i];
+  int parent;
+
+  while (i > 0)
+  {
+    parent = (i - 1) / 2;
+    if (loop->timers[parent]->when <= timer->when)
+      break;
+    heap_set (loop, i, loop->timers[parent]);
+    i = parent;
+  }
+  heap_set (loop, i, timer);
+}
+
+static void
+heap_down (LOOP *loop, int i)
+{
+  TIMER *timer = loop->timers[i];
+  int child;
+
+  for (;;)
+  {
+    child = i * 2 + 1;
+    if (child >= loop->ntimers)
+      break;
+    if (child + 1 < loop->ntimers && loop->timers[child + 1]->when < loop->timers[child]->when)
+      child++;
+    if (timer->when <= loop->timers[child]->when)
+      break;
+    heap_set (loop, i, loop->timers[child]);
+    i = child;
+  }
+  heap_set (loop, i, timer);
+}
+
+/* Arms the timer to fire in ms milliseconds, replacing any earlier time */
+void
+loop_add_timer (LOOP *loop, TIMER *timer, int ms)
+{
+  loop_remove_timer (loop, timer);
+  timer->when = loop_now () + (ms > 0 ? ms : 0);
+
+  if (loop->ntimers == loop->timers_size)
+  {
+    loop->timers_size = (loop->timers_size > 0 ? loop->timers_size * 2 : 16);
+    loop->timers = (TIMER **) realloc (loop->timers, loop->timers_size * sizeof (TIMER *));
+  }
+  loop->timers[loop->ntimers++] = timer;
+  heap_up (loop, loop->ntimers - 1);
+}
+
+void
+loop_remove_timer (LOOP *loop, TIMER *timer)
+{
+  int i = timer->index - 1;
+  TIMER *last;
+
+  if (!timer->index)
+    return;
+  timer->index = 0;
+
+  last = loop->timers[--loop->ntimers];
+  if (i == loop->ntimers)
+    return;
+  heap_set (loop, i, last);
+  heap_down (loop, i);
+  heap_up (loop, last->index - 1);
+}
+
+/* Fires every timer that is due */
+static void
+run_timers (LOOP *loop)
+{
+  unsigned long long now = loop_now ();
+  TIMER *timer;
+
+  while (loop->ntimers > 0 && loop->timers[0]->when <= now)
+  {
+    timer = loop->timers[0];
+    loop_remove_timer (loop, timer);
+    timer->func (loop, timer);
+  }
+}
+
+/* How long epoll_wait may sleep before the next timer is due */
+static int
+next_timeout (LOOP *loop)
+{
+  unsigned long long now;
+
+  if (loop->deferred)
+    return 0;
+  if (loop->ntimers == 0)
+    return -1;
+  now = loop_now ();
+  if (loop->timers[0]->when <= now)
+    return 0;
+  return (int) (loop->timers[0]->when - now);
+}
+
+/* Makes loop_run return. This may be called from a signal handler, or
+ * from another thread. */
+void
+loop_quit (LOOP *loop)
+{
+  loop->quit = 1;
+  eventfd_write (loop->wake.fd, 1);
+}
+
+void
+loop_run (LOOP *loop)
+{
+  struct epoll_event events[MAX_EVENTS];
+  WATCH *watch;
+  int n;
+  int i;
+
+  for (;;)
+  {
+    run_deferred (loop);
+    if (loop->quit || (loop->nwatches == 0 && loop->ntimers == 0))
+      break;
+
+    n = epoll_wait (loop->epfd, events, MAX_EVENTS, next_timeout (loop));
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      perror ("epoll_wait");
+      return;
+    }
+
+    loop->ready = events;
+    loop->nready = n;
+    for (i = 0; i < n; i++)
+    {
+      watch = (WATCH *) events[i].data.ptr;
+      if (watch)
+        watch->func (loop, watch, events[i].events);
+    }
+    loop->ready = NULL;
+    loop->nready = 0;
+
+    run_timers (loop);
+  }
+}
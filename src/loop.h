@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+/* A small epoll-based event loop. It knows nothing about the protocol, so
+ * that it can be shared with the other programs built from this tree. */
+
+struct epoll_event;
+
+typedef struct loop LOOP;
+typedef struct watch WATCH;
+typedef struct defer DEFER;
+typedef struct timer TIMER;
+
+typedef void (*WatchFunc) (LOOP *loop, WATCH *watch, unsigned int events);
+typedef void (*DeferFunc) (LOOP *loop, DEFER *defer);
+typedef void (*TimerFunc) (LOOP *loop, TIMER *timer);
+
+/* A file descriptor registered with the loop. The structure is normally
+ * embedded in whatever owns the descriptor, and must stay at the same
+ * address while it is registered. */
+struct watch
+{
+  int fd;
+  unsigned int events; /* EPOLLIN, EPOLLOUT, ... */
+  WatchFunc func;
+  void *data;
+};
+
+/* Work to be done once the current batch of events has been handled, ie
+ * flushing output that several events may have added to. Queueing a DEFER
+ * that is already queued does nothing. */
+struct defer
+{
+  DeferFunc func;
+  void *data;
+  DEFER *prev;
+  DEFER *next;
+  int queued;
+};
+
+/* A one-shot timeout. Like a WATCH, it is normally embedded in its owner.
+ * A zeroed TIMER is not armed. */
+struct timer
+{
+  unsigned long long when; /* in loop_now () milliseconds */
+  TimerFunc func;
+  void *data;
+  int index; /* 1-based position in the heap, or 0 if not armed */
+};
+
+struct loop
+{
+  int epfd;
+  int nwatches;
+  volatile int quit; /* may be set from a signal handler */
+  WATCH wake; /* an eventfd, so that loop_quit can interrupt epoll_wait */
+  struct epoll_event *ready; /* the batch currently being dispatched */
+  int nready;
+  DEFER *deferred;
+  TIMER **timers; /* binary heap, soonest first */
+  int ntimers;
+  int timers_size;
+};
+
+LOOP *loop_new ();
+void loop_free (LOOP *loop);
+int loop_add_watch (LOOP *loop, WATCH *watch);
+int loop_modify_watch (LOOP *loop, WATCH *watch, unsigned int events);
+void loop_remove_watch (LOOP *loop, WATCH *watch);
+void loop_defer (LOOP *loop, DEFER *defer);
+void loop_cancel_defer (LOOP *loop, DEFER *defer);
+void loop_add_timer (LOOP *loop, TIMER *timer, int ms);
+void loop_remove_timer (LOOP *loop, TIMER *timer);
+unsigned long long loop_now ();
+unsigned long long loop_now_ns ();
+void loop_run (LOOP *loop);
+void loop_quit (LOOP *loop);
@@ -15,107 +15,25 @@
  * along with this program; if not, see: <http://www.gnu.org/licenses/>.
  */
 
+
 #include "phantcli.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <netdb.h>
+#include <signal.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <time.h>
 
-int sockconnect (const char *host, int port)
-{
-  int fd;
-  struct sockaddr_in servaddr;
-
-  fd = socket (AF_INET, SOCK_STREAM, 0);
-  if (fd == -1)
-  {
-    perror ("socket");
-    return -1;
-  }
-
-  memset (&servaddr, 0, sizeof (servaddr));
-  servaddr.sin_family = AF_INET;
-  servaddr.sin_port = htons(port);
-
-  if (inet_pton(AF_INET, host, &servaddr.sin_addr) <= 0)
-  {
-    struct hostent *h;
-    h = gethostbyname (host);
-    if (!h)
-    {
-      perror ("gethostbyname");
-      return -1;
-    }
-    memcpy ((char *)&servaddr.sin_addr, h->h_addr, sizeof (servaddr.sin_addr));
-  }
-
-  if (connect(fd, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0)
-  {
-    perror("connect");
-    return -1;
-  }
-  return fd;
-}
-
-void
-dlog (const char *fmt, ...)
-{
-  FILE *fp;
-  va_list args;
-
-  if (!getenv ("PHANTCLI_DEBUG"))
-    return;
-
-  fp = fopen ("debug.log", "a");
-  va_start (args, fmt);
-  vfprintf (fp, fmt, args);
-  va_end (args);
-  fclose (fp);
-}
-
-int
-read_socket (STATE *state)
-{
-  int res;
-  int i;
-  char *p;
-
-  res = read (state->fd, state->buf + state->bufpos, sizeof (state->buf) - 1 - state->bufpos);
-  dlog("data: %s", state->buf + state->bufpos);
-  if (res <= 0)
-    return -1;
-  state->bufpos += res;
-  state->buf[state->bufpos] = '\0';
-
-  i = 0;
-  while (i < state->bufpos)
-  for (;;)
-  {
-    p = strchr (state->buf + i, '\n');
-    if (!p)
-    {
-      if (i)
-        memmove (state->buf, state->buf + i, sizeof (state->buf) - i);
-      state->bufpos = strlen (state->buf);
-      return 0;
-    }
-    *p = '\0';
-    res = state->sdh (state, state->buf + i);
-    if (res == 0)
-      state->sdh = handle_packet;
-    i = p + 1 - state->buf;
-  }
-
-  return 0;
-}
+static const char *stats_file;
+static const char *trace_file;
+static const char *replay_file;
+static const char *publish_path;
+static const char *watch_path;
+static pbool replay_fast;
+static pbool bots;
 
 static void
 mkdirs (char *buf)
@@ -173,114 +91,252 @@ get_cookie ()
   return cookie;
 }
 
-void
-do_client (const char *host, int port)
+static LOOP *main_loop;
+
+/* With a terminal, the sessions run on a thread of their own, and the main
+ * thread runs the UI, so that drawing never holds up the network */
+static LOOP *ui_loop;
+static BRIDGE *bridge;
+static pthread_t network_thread;
+static pbool network_running;
+
+static void *
+network_main (void *data)
 {
-  fd_set fds;
-  STATE state;
-  int result;
+  loop_run (main_loop);
+  loop_quit (ui_loop);
+  return NULL;
+}
 
-  init_handlers ();
+/* Gives a session the terminal */
+static void
+attach_terminal (STATE *state)
+{
+  state->want_ui = TRUE;
+  ui_loop = loop_new ();
+  if (!ui_loop)
+    exit (1);
+  bridge = bridge_new (state, ui_loop, &term_frontend);
+}
 
-  memset (&state, 0, sizeof (state));
-  state.sdh = handle_packet;
-  state.fd = sockconnect (host, port);
-  if (state.fd == -1)
-  {
-    fprintf(stderr, "Could not connect to %s port %d\n", host, port);
+/* Stops the network thread, unless we are it. The sessions are ours after
+ * this. */
+static void
+stop_network ()
+{
+  if (!network_running || pthread_equal (pthread_self (), network_thread))
     return;
-  }
+  loop_quit (main_loop);
+  pthread_join (network_thread, NULL);
+  network_running = FALSE;
+}
 
-  state.cookie = get_cookie ();
+/* Stop cleanly on ^C and friends, so that the terminal is restored and the
+ * statistics get written */
+static void
+quit_signal (int sig)
+{
+  loop_quit (main_loop);
+}
 
-  ui_init (&state);
+/* Writes the statistics of every session still running, and finishes their
+ * recordings. Registered with atexit, since the UI can exit from several
+ * places. */
+static void
+cleanup ()
+{
+  int i;
 
-  for (;;)
+  stop_network ();
+  for (i = 0; i < nsessions; i++)
   {
-    FD_ZERO (&fds);
-    FD_SET (0, &fds);
-    FD_SET (state.fd, &fds);
-    select (state.fd + 1, &fds, NULL, NULL, NULL);
-    if (FD_ISSET (state.fd, &fds))
+    if (stats_fp)
     {
-      result = read_socket (&state);
-      if (result < 0)
-      {
-        ui_teardown (&state);
-        exit (1);
-      }
+      latency_print_json (stats_fp, sessions[i]);
+      fputc ('\n', stats_fp);
+    }
+    if (sessions[i]->recorder)
+    {
+      recorder_close (sessions[i]->recorder);
+      sessions[i]->recorder = NULL;
     }
-    if (FD_ISSET (0, &fds))
-      ui_get_key (&state);
   }
+  if (stats_fp)
+    fclose (stats_fp);
+  trace_close ();
 }
 
+/* Runs count sessions. The first one gets the terminal, and any others run
+ * without a UI, unless they are all bots. With a terminal, this thread
+ * draws it and the sessions run on the network thread. */
 void
-send_string (STATE *state, const char *buf)
+do_client (int count)
 {
-  write (state->fd, buf, strlen (buf) + 1);
-}
-
-void
-send_string_fv (STATE *state, const char *fmt, va_list args)
-{
-  char buf[1024];
+  LOOP *loop;
+  STATE *state;
+  int fd;
+  int i;
 
-  vsnprintf (buf, sizeof (buf), fmt, args);
-  buf[sizeof(buf) - 1] = '\0';
-  write (state->fd, buf, strlen (buf) + 1);
-}
+  log_init ();
+  if (stats_file)
+  {
+    stats_fp = fopen (stats_file, "w");
+    if (!stats_fp)
+    {
+      perror (stats_file);
+      return;
+    }
+  }
+  if (trace_file && trace_open (trace_file) < 0)
+  {
+    perror (trace_file);
+    return;
+  }
+  atexit (cleanup);
 
-void
-send_string_f (STATE *state, const char *fmt, ...)
-{
-  va_list args;
+  loop = loop_new ();
+  if (!loop)
+    return;
+  main_loop = loop;
+  signal (SIGINT, quit_signal);
+  signal (SIGTERM, quit_signal);
+  signal (SIGHUP, quit_signal);
+  signal (SIGPIPE, SIG_IGN);
 
-  va_start (args, fmt);
-  send_string_fv (state, fmt, args);
-  va_end (args);
-}
+  if (watch_path)
+  {
+    /* Show someone else's session, without a server of our own */
+    state = session_alloc (loop, 0, 1);
+    attach_terminal (state);
+    state->watching = TRUE;
+    state->reconnect.max_attempts = 0;
+    fd = spectate_connect (watch_path);
+    if (fd == -1)
+      return;
+    session_connected (fd, NULL, state);
+    count = 0;
+  }
 
-void
-respondv (STATE *state, const char *fmt, va_list args)
-{
-  char buf[1024];
+  if (replay_file)
+  {
+    /* Play a recording to a single session, in place of the server */
+    state = session_alloc (loop, get_cookie (), 1);
+    attach_terminal (state);
+    state->reconnect.max_attempts = 0;
+    if (publish_path && !publisher_new (state, publish_path))
+      return;
+    fd = replay_start (loop, state, replay_file, replay_fast);
+    if (fd == -1)
+      return;
+    session_connected (fd, NULL, state);
+    count = 0;
+  }
 
-  sprintf (buf, "%d", C_RESPONSE_PACKET);
-  vsnprintf (buf + 2, sizeof (buf) - 2, fmt, args);
-  dlog ("sending response: %s\n", buf);
-  write (state->fd, buf, strlen (buf + 2) + 3);
-}
+  for (i = 0; i < count; i++)
+  {
+    state = session_new (loop, (i == 0 ? get_cookie () : rand ()), count);
+    if (!state)
+      continue;
+    if (bots)
+      state->frontend = &bot_frontend;
+    else if (i == 0)
+      attach_terminal (state);
+    if (i == 0 && publish_path && !publisher_new (state, publish_path))
+      return;
+  }
 
-void
-respond (STATE *state, const char *fmt, ...)
-{
-  va_list args;
+  if (!bridge)
+  {
+    loop_run (loop);
+    loop_free (loop);
+    return;
+  }
 
-  va_start (args, fmt);
-  respondv (state, fmt, args);
-  va_end (args);
+  if (pthread_create (&network_thread, NULL, network_main, NULL) != 0)
+  {
+    perror ("pthread_create");
+    return;
+  }
+  network_running = TRUE;
+  loop_run (ui_loop);
+  stop_network ();
+  bridge_free (bridge);
+  bridge = NULL;
+  loop_free (ui_loop);
+  loop_free (loop);
 }
 
+
 int
 main(int argc, char *argv[])
 {
-  const char *host = "phantasia.dev";
-  int port = 43302;
+  int count = 1;
   int done = 0;
 
   while (!done)
   {
-    switch (getopt (argc, argv, "h:p:"))
+    switch (getopt (argc, argv, "bFf:h:i:l:n:o:P:p:r:s:T:t:UV:W:"))
     {
+    case 'b':
+      bots = TRUE;
+      break;
+    case 'F':
+      replay_fast = TRUE;
+      break;
+    case 'f':
+      term_fps = atoi (optarg);
+      break;
     case 'h':
-      host = strdup (optarg);
+      server_host = strdup (optarg);
+      break;
+    case 'i':
+      replay_file = strdup (optarg);
+      probe_interval = 0;
+      break;
+    case 'l':
+      probe_interval = atoi (optarg) * 1000;
+      break;
+    case 'n':
+      count = atoi (optarg);
+      break;
+    case 'o':
+      record_file = strdup (optarg);
+      break;
+    case 'P':
+      publish_path = strdup (optarg);
       break;
     case 'p':
-      port = atoi (optarg);
+      server_port = atoi (optarg);
+      break;
+    case 'r':
+      max_reconnects = atoi (optarg);
+      break;
+    case 's':
+      stats_file = strdup (optarg);
+      break;
+    case 'T':
+      trace_file = strdup (optarg);
+      break;
+    case 't':
+      connect_timeout = atoi (optarg) * 1000;
+      break;
+    case 'U':
+      use_uring = TRUE;
+      break;
+    case 'V':
+      forced_protocol = protocol_find (optarg);
+      if (!forced_protocol)
+      {
+        fprintf (stderr, "Unknown server version %s; try 4.03 or 5.01\n", optarg);
+        exit (1);
+      }
+      break;
+    case 'W':
+      watch_path = strdup (optarg);
+      probe_interval = 0;
       break;
     case '?':
-      fprintf (stderr, "Usage: %s [-h <host>] [-p <port>]\n", argv[0]);
+      fprintf (stderr, "Usage: %s [-h <host>] [-p <port>] [-n <sessions>] [-b] [-f <frames per second>] [-r <reconnect attempts>] [-t <connect timeout>] [-l <latency probe interval>] [-s <stats file>] [-T <trace file>] [-U] [-V <server version>] [-o <recording>] [-i <recording> [-F]] [-P <socket>] [-W <socket>]\n", argv[0]);
       exit (0);
     default:
       done = 1;
@@ -290,5 +346,5 @@ main(int argc, char *argv[])
 
   srand (time (NULL));
 
-  do_client (host, port);
+  do_client (count);
 }
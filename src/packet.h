@@ -71,6 +71,7 @@
 #define TOKENS_PACKET           61
 #define STAFF_PACKET            62
 #define EXP_PACKET              63
+#define EXAMINE_PACKET          35	/* another player's details */
 
 /* player->client packet headers */
 #define C_RESPONSE_PACKET	1	/* player feedback for game */
@@ -83,3 +84,62 @@
 /* Following were added after the source posted online -MPG */
 #define C_PONG_PACKET           8
 #define C_PING_REQUEST_PACKET   9
+
+/* What the client does with each server packet. handlers.c builds a
+ * dispatch table from this for each server version, and ui.c lays out its
+ * stat window from that.
+ * PACKET (number, kind, field, count, label):
+ * - HANDLER: handle_<field> in handlers.c deals with it
+ * - INT: count lines, each a number, into STATE's player.<field>
+ * - BOOL: count lines, each Yes or No, into player.<field>
+ * - STRING: one line, copied into player.<field>
+ * label is what the stat window calls it, or NULL to leave it out.
+ * Where 4.03 and 5.01 differ, PER_VERSION (for 4.03, for 5.01) is used;
+ * whoever expands the table defines it. */
+
+#define PACKET_TABLE(PACKET) \
+  PACKET (HANDSHAKE_PACKET, HANDLER, handshake, 0, NULL) \
+  PACKET (CLOSE_CONNECTION_PACKET, HANDLER, close, 0, NULL) \
+  PACKET (PING_PACKET, HANDLER, ping, 0, NULL) \
+  PACKET (ADD_PLAYER_PACKET, HANDLER, add_player, 0, NULL) \
+  PACKET (REMOVE_PLAYER_PACKET, HANDLER, remove_player, 0, NULL) \
+  PACKET (SHUTDOWN_PACKET, HANDLER, shutdown, 0, NULL) \
+  PACKET (ERROR_PACKET, HANDLER, error, 0, NULL) \
+  PACKET (CLEAR_PACKET, HANDLER, clear, 0, NULL) \
+  PACKET (WRITE_LINE_PACKET, HANDLER, writeline, 0, NULL) \
+  PACKET (BUTTONS_PACKET, HANDLER, buttons, 0, NULL) \
+  PACKET (FULL_BUTTONS_PACKET, HANDLER, buttons, 0, NULL) \
+  PACKET (STRING_DIALOG_PACKET, HANDLER, string_dialog, 0, NULL) \
+  PACKET (COORDINATES_DIALOG_PACKET, HANDLER, string_dialog, 0, NULL) \
+  PACKET (PLAYER_DIALOG_PACKET, HANDLER, string_dialog, 0, NULL) \
+  PACKET (PASSWORD_DIALOG_PACKET, HANDLER, string_dialog, 0, NULL) \
+  PACKET (SCOREBOARD_DIALOG_PACKET, HANDLER, scoreboard_dialog, 0, NULL) \
+  PACKET (CHAT_PACKET, HANDLER, chat, 0, NULL) \
+  PACKET (ACTIVATE_CHAT_PACKET, HANDLER, activate_chat, 0, NULL) \
+  PACKET (DEACTIVATE_CHAT_PACKET, HANDLER, deactivate_chat, 0, NULL) \
+  PACKET (PLAYER_INFO_PACKET, HANDLER, player_info, 0, NULL) \
+  PACKET (EXAMINE_PACKET, HANDLER, examine, 0, NULL) \
+  PACKET (NAME_PACKET, STRING, name, 1, NULL) \
+  PACKET (LOCATION_PACKET, HANDLER, location, 0, NULL) \
+  PACKET (ENERGY_PACKET, INT, energy, 3, "Energy") \
+  PACKET (STRENGTH_PACKET, INT, strength, 2, "Strength") \
+  PACKET (SPEED_PACKET, INT, speed, 2, "Speed") \
+  PACKET (SHIELD_PACKET, INT, shield, 1, "Shield") \
+  PACKET (SWORD_PACKET, INT, sword, 1, "Sword") \
+  PACKET (QUICKSILVER_PACKET, INT, quicksilver, 1, "Quicksilver") \
+  PACKET (MANA_PACKET, INT, mana, PER_VERSION (1, 2), "Mana") \
+  PACKET (LEVEL_PACKET, INT, level, 1, "Level") \
+  PACKET (GOLD_PACKET, INT, gold, 1, "Gold") \
+  PACKET (GEMS_PACKET, INT, gems, 1, "Gems") \
+  PACKET (CLOAK_PACKET, BOOL, cloak, 1, "Cloak") \
+  PACKET (BLESSING_PACKET, BOOL, blessing, 1, "Blessing") \
+  PACKET (CROWN_PACKET, BOOL, crown, 1, "Crowns") \
+  PACKET (PALANTIR_PACKET, BOOL, palantir, 1, "Palantir") \
+  PACKET (RING_PACKET, BOOL, ring, 1, "Ring") \
+  PACKET (VIRGIN_PACKET, BOOL, virgin, 1, "Virgin") \
+  PACKET (TIMED_PING_PACKET, HANDLER, timed_ping, 0, NULL) \
+  PACKET (AMULETS_PACKET, INT, amulets, 1, PER_VERSION (NULL, "Amulets")) \
+  PACKET (CHARMS_PACKET, INT, charms, 1, PER_VERSION (NULL, "Charms")) \
+  PACKET (TOKENS_PACKET, INT, tokens, 1, PER_VERSION (NULL, "Tokens")) \
+  PACKET (STAFF_PACKET, BOOL, staff, 1, PER_VERSION (NULL, "Staff")) \
+  PACKET (EXP_PACKET, INT, experience, 1, PER_VERSION (NULL, "Experience"))
@@ -18,6 +18,13 @@
 #pragma once
 
 #include "packet.h"
+#include "loop.h"
+#include "buffer.h"
+#include "arena.h"
+#include "histogram.h"
+#include "log.h"
+#include "roster.h"
+#include "uring.h"
 
 #include <stdarg.h>
 
@@ -33,32 +40,66 @@ typedef int pbool;
 /* Used for array sizes. Actually 57, as of v1004 */
 #define MAX_PACKET_COUNT 64
 
-typedef struct player PLAYER;
 
 typedef struct state STATE;
 
-typedef pbool (*ServerDataHandler) (STATE *, const char *buf);
+typedef struct connector CONNECTOR;
+typedef struct recorder RECORDER;
+typedef struct replay REPLAY;
+typedef struct frontend FRONTEND;
+typedef struct bridge BRIDGE;
+typedef struct publisher PUBLISHER;
+typedef struct protocol PROTOCOL;
 
-struct player
-{
-  char *name;
-  char *type;
-  struct player *next;
-};
+/* Record directions in a session recording */
+#define REC_IN 0 /* a line from the server */
+#define REC_OUT 1 /* a message to the server */
+
+/* Called when a connection attempt finishes. fd is -1 on failure, and error
+ * then says why. */
+typedef void (*ConnectFunc) (int fd, const char *error, void *data);
+
+/* Called with each line of a packet, NUL-terminated and without its newline.
+ * The first call for a packet is made with buf == NULL. Returns TRUE if more
+ * lines are wanted. */
+typedef pbool (*ServerDataHandler) (STATE *, const char *buf, int len);
 
 struct state
 {
   int fd;
+  WATCH watch; /* for fd */
+  UCONN conn; /* for fd instead, when using io_uring */
+  LOOP *loop;
+  CONNECTOR *connector; /* set while connecting */
+  unsigned long long connect_start; /* loop_now_ns () when we first tried */
+  pbool want_ui; /* show this session on the terminal once connected */
+  RECORDER *recorder; /* if recording the session */
+  int id; /* for logging */
+  int index; /* position in the session list */
   int cookie;
-  char buf[1024]; /* for socket data */
-  int bufpos;
+  INBUF in; /* for socket data */
+  OUTBUF out; /* responses waiting to be flushed */
+  DEFER flush;
   ServerDataHandler sdh;
   int cur_packet;
   int line_count; /* used when reading certain packets */
   int lines_expected; /* used when reading scoreboard */
   int dialog_mode;
   char *buttons[8];
-  struct UI *ui;
+  ARENA dialog_arena; /* the buttons, until the next dialog */
+  ARENA strings[2]; /* player.name and location (see set_player_string) */
+  int strings_cur;
+  const FRONTEND *frontend; /* NULL if nothing is shown */
+  struct UI *ui; /* the terminal front end's data */
+  struct BOT *bot; /* the bot front end's data */
+  BRIDGE *bridge; /* if the front end runs on another thread */
+  pbool mirror; /* TRUE for the other thread's copy of the session */
+  PUBLISHER *publisher; /* if spectators can watch this session */
+  pbool watching; /* TRUE if this session is a spectator; it never answers */
+  const PROTOCOL *protocol; /* what the server speaks, or our guess */
+  pbool protocol_known; /* the server got past the handshake */
+  pbool protocol_switched; /* we already fell back to the other version */
+  pbool refused; /* ERROR or CLOSE came before we got past the handshake */
   struct
   {
     char *name;
@@ -85,19 +126,175 @@ struct state
     int charms;
     int tokens;
     pbool staff;
+    int experience;
   } player;
-  PLAYER *players;
+  ROSTER roster; /* who is online */
+  struct
+  {
+    int max_attempts; /* per outage; -1 for no limit, 0 to not reconnect */
+    int attempts; /* made since the connection was lost */
+    TIMER timer;
+    unsigned long long lost_at; /* loop_now () when we lost the server */
+    pbool closing; /* the server said goodbye, so don't come back */
+    int count; /* times we have recovered */
+    unsigned long long last_ms; /* time to recover, most recent outage */
+    unsigned long long max_ms;
+    unsigned long long total_ms;
+  } reconnect;
+  struct
+  {
+    unsigned long long read_ns; /* when the data being parsed arrived */
+    unsigned long long reply_since; /* arrival of a ping not yet answered */
+    unsigned long long probe_sent; /* when the unanswered probe went, or 0 */
+    TIMER probe_timer;
+    int probe_interval; /* milliseconds, or 0 for no probes */
+    HISTOGRAM rtt; /* our probes, until the server's TIMED_PING */
+    HISTOGRAM reply; /* server pings, until our answer left the socket */
+  } latency;
+  struct
+  {
+    unsigned long long arrived_ns; /* read_ns for the packet's first line */
+    unsigned long long handler_ns; /* in its handlers so far */
+    unsigned long long ui_ns; /* of that, in ui_ calls */
+    int lines;
+    pbool in_handler;
+    pbool in_ui;
+  } trace; /* the packet being parsed, if trace_fp is set */
 };
 
-void dlog (const char *fmt, ...);
+/* Counts over all sessions, for the load generator */
+typedef struct
+{
+  long connects; /* sessions that got connected the first time */
+  long reconnects;
+  long connect_errors; /* failed attempts, first or later */
+  long lost; /* connections that broke */
+  long bad_packets; /* lines the handlers didn't understand */
+  long lines_in;
+  long bytes_in;
+  long messages_out;
+  long bytes_out;
+  long moves; /* made by bots */
+  long chats; /* sent by bots */
+  HISTOGRAM connect_time; /* from starting a session until connected */
+  HISTOGRAM rtt; /* as in each session's latency.rtt */
+} TOTALS;
+
+/* Settings for new sessions */
+extern const char *server_host;
+extern int server_port;
+extern int connect_timeout; /* milliseconds */
+extern int max_reconnects;
+extern int probe_interval; /* milliseconds */
+extern pbool use_uring; /* if it was built in */
+extern const char *record_file;
+extern FILE *stats_fp; /* where sessions write their statistics on closing */
+extern FILE *trace_fp; /* packet trace, if one was asked for */
+extern pbool quit_when_idle; /* stop the loop when the last session closes */
+
+extern STATE **sessions;
+extern int nsessions;
+extern TOTALS totals;
+
+STATE *session_alloc (LOOP *loop, int cookie, int count);
+STATE *session_new (LOOP *loop, int cookie, int count);
+void session_connected (int fd, const char *error, void *data);
+long session_uring_submits ();
+int read_socket (STATE *state);
+
+CONNECTOR *connector_start (LOOP *loop, const char *host, int port, int timeout_ms, ConnectFunc func, void *data);
+void connector_cancel (CONNECTOR *conn);
+
+RECORDER *recorder_open (const char *path);
+void recorder_add (RECORDER *rec, int dir, const char *buf, int len);
+void recorder_close (RECORDER *rec);
+int replay_start (LOOP *loop, STATE *state, const char *path, pbool fast);
+
 void respond (STATE *state, const char *fmt, ...);
 void respondv (STATE *state, const char *fmt, va_list args);
+void queue_output (STATE *state, const char *buf, int len);
 void send_string (STATE *state, const char *buf);
 void send_string_f (STATE *state, const char *fmt, ...);
 void send_string_fv (STATE *state, const char *fmt, va_list args);
 
-pbool handle_packet (STATE *state, const char *buf);
-void init_handlers ();
+void latency_start (STATE *state, int interval_ms);
+void latency_stop (STATE *state);
+void latency_reply_queued (STATE *state);
+void latency_reply_flushed (STATE *state);
+void latency_ping_received (STATE *state);
+void latency_describe (STATE *state, char *buf, int size);
+void latency_print_json (FILE *fp, STATE *state);
+
+int trace_open (const char *path);
+void trace_close ();
+unsigned long long trace_line_begin (STATE *state);
+void trace_line_end (STATE *state, unsigned long long begin, int res);
+unsigned long long trace_ui_begin (STATE *state);
+void trace_ui_end (STATE *state, unsigned long long begin);
+
+/* A row of PACKET_TABLE (see packet.h) */
+typedef struct
+{
+  const char *name;
+  ServerDataHandler handler;
+  int kind;
+  int offset; /* of the field in STATE */
+  int count;
+  const char *label;
+} PACKET_INFO;
+
+#define PACKET_HANDLER 0
+#define PACKET_INT 1
+#define PACKET_BOOL 2
+#define PACKET_STRING 3
+
+/* What differs between server versions. Each has its own copy of the
+ * packet table, so dispatch is a lookup either way. */
+struct protocol
+{
+  const char *name; /* "4.03" or "5.01" */
+  const char *const *handshake; /* lines to answer with, before ours */
+  const char *const *player_info_records; /* NULL-terminated */
+  PACKET_INFO packets[MAX_PACKET_COUNT];
+};
+
+extern const PROTOCOL protocol_403;
+extern const PROTOCOL protocol_501;
+extern const PROTOCOL *forced_protocol; /* from -V, or NULL to detect it */
+
+const PROTOCOL *protocol_find (const char *name);
+
+pbool handle_packet (STATE *state, const char *buf, int len);
+void set_player_string (STATE *state, char **field, const char *buf);
+
+/* A session's front end: what it does with the game as the server
+ * describes it. The ui_ functions pass everything on to it. The terminal
+ * (ui.c) is one front end, and bots (bot.c) are another; a session without
+ * one shows nothing and answers nothing. Any entry may be NULL. */
+struct frontend
+{
+  void (*init) (STATE *state);
+  void (*teardown) (STATE *state);
+  void (*writeline) (STATE *state, const char *buf);
+  void (*present_dialog) (STATE *state);
+  void (*present_string_dialog) (STATE *state, const char *buf);
+  void (*get_key) (STATE *state);
+  void (*clear) (STATE *state);
+  void (*update_stat) (STATE *state, int packet);
+  void (*chat_enable) (STATE *state, pbool enable);
+  void (*chat_message) (STATE *state, const char *message);
+  void (*timeout) (STATE *state);
+  void (*post_special_text) (STATE *state, const char *buf);
+  void (*update_status) (STATE *state);
+  void (*player_joined) (STATE *state, const char *name, const char *type);
+  void (*player_left) (STATE *state, const char *name); /* NULL for everyone */
+};
+
+extern const FRONTEND term_frontend;
+extern int term_fps; /* frames per second at most, or 0 for no limit */
+extern const FRONTEND bot_frontend;
+extern int bot_think_ms;
+extern int bot_chat_ms;
 
 void ui_init (STATE *state);
 void ui_teardown (STATE *state);
@@ -111,3 +308,22 @@ void ui_chat_enable (STATE *state, pbool enable);
 void ui_chat_message (STATE *state, const char *message);
 void ui_timeout (STATE *state);
 void ui_post_special_text (STATE *state, const char *buf);
+void ui_update_status (STATE *state);
+void ui_player_joined (STATE *state, const char *name, const char *type);
+void ui_player_left (STATE *state, const char *name);
+
+/* bridge.c: runs a session's front end on another thread */
+BRIDGE *bridge_new (STATE *session, LOOP *ui_loop, const FRONTEND *frontend);
+void bridge_free (BRIDGE *bridge);
+void bridge_output (BRIDGE *bridge, const char *buf, int len);
+
+/* spectate.c: lets others watch a session. Viewers get the server's
+ * packets, with this one added, which starts a snapshot and gives the
+ * server's version; the server doesn't use it. */
+#define SPECTATE_RESET_PACKET 1
+
+PUBLISHER *publisher_new (STATE *state, const char *path);
+void publisher_free (PUBLISHER *pub);
+void publisher_line (PUBLISHER *pub, const char *line, int len, pbool start);
+void publisher_commit (PUBLISHER *pub, int type);
+int spectate_connect (const char *path);
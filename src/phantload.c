@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+/* phantload: puts load on a server. It starts bot sessions (see bot.c) at
+ * a steady rate until it has as many as it was asked for, and prints what
+ * they are seeing once a second: throughput, connection times, errors and
+ * round trip times. The sessions are the client's own, so the server can't
+ * tell them from players. */
+
+#include "phantcli.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* How often the ramp starts its next sessions */
+#define RAMP_TICK 10
+
+static LOOP *loop;
+static int clients = 100;
+static double ramp_rate = 10; /* sessions started per second */
+static int base_cookie;
+static int duration; /* seconds, or 0 to run until interrupted */
+
+static int started;
+static unsigned long long start_ms;
+static TIMER ramp_timer;
+static TIMER report_timer;
+static TIMER stop_timer;
+
+/* totals as of the last report; the histograms in totals only cover the
+ * time since then */
+static TOTALS last;
+static HISTOGRAM all_connect_time;
+static HISTOGRAM all_rtt;
+static int reports;
+
+static void
+ramp_timeout (LOOP *loop, TIMER *timer)
+{
+  int target = (int) ((loop_now () - start_ms) * ramp_rate / 1000.0) + 1;
+  STATE *state;
+
+  if (target > clients)
+    target = clients;
+  while (started < target)
+  {
+    state = session_new (loop, base_cookie + started, clients);
+    started++;
+    if (!state)
+    {
+      totals.connect_errors++;
+      continue;
+    }
+    state->frontend = &bot_frontend;
+  }
+  if (started < clients)
+    loop_add_timer (loop, timer, RAMP_TICK);
+}
+
+/* Times are in milliseconds */
+static void
+print_header ()
+{
+  printf ("%6s %7s %6s %6s %8s %8s %8s %7s %7s %15s %21s\n", "time", "clients", "conn/s", "errors", "lines/s", "KB/s in", "KB/s out", "moves/s", "chats/s", "connect p50/p99", "rtt p50/p99/p999");
+}
+
+static void
+report_timeout (LOOP *loop, TIMER *timer)
+{
+  double secs = (loop_now () - start_ms) / 1000.0;
+  long errors;
+  int connected = 0;
+  int i;
+
+  for (i = 0; i < nsessions; i++)
+    if (sessions[i]->fd != -1)
+      connected++;
+
+  if (reports++ % 20 == 0)
+    print_header ();
+  errors = (totals.connect_errors - last.connect_errors) + (totals.lost - last.lost) + (totals.bad_packets - last.bad_packets);
+  printf ("%6.0f %7d %6ld %6ld %8ld %8.1f %8.1f %7ld %7ld %7.1f %7.1f %6.1f %6.1f %7.1f\n",
+          secs, connected,
+          totals.connects - last.connects,
+          errors,
+          totals.lines_in - last.lines_in,
+          (totals.bytes_in - last.bytes_in) / 1024.0,
+          (totals.bytes_out - last.bytes_out) / 1024.0,
+          totals.moves - last.moves,
+          totals.chats - last.chats,
+          hist_percentile (&totals.connect_time, 50.0) / 1e6,
+          hist_percentile (&totals.connect_time, 99.0) / 1e6,
+          hist_percentile (&totals.rtt, 50.0) / 1e6,
+          hist_percentile (&totals.rtt, 99.0) / 1e6,
+          hist_percentile (&totals.rtt, 99.9) / 1e6);
+  fflush (stdout);
+
+  hist_merge (&all_connect_time, &totals.connect_time);
+  hist_merge (&all_rtt, &totals.rtt);
+  hist_reset (&totals.connect_time);
+  hist_reset (&totals.rtt);
+  last = totals;
+
+  loop_add_timer (loop, timer, 1000);
+}
+
+static void
+stop_timeout (LOOP *loop, TIMER *timer)
+{
+  loop_quit (loop);
+}
+
+static void
+quit_signal (int sig)
+{
+  loop_quit (loop);
+}
+
+static void
+print_summary ()
+{
+  double secs = (loop_now () - start_ms) / 1000.0;
+  int i;
+
+  hist_merge (&all_connect_time, &totals.connect_time);
+  hist_merge (&all_rtt, &totals.rtt);
+
+  printf ("\n%d sessions started in %.1f seconds; %ld connected, %ld reconnects\n", started, secs, totals.connects, totals.reconnects);
+  printf ("errors: %ld failed connection attempts, %ld connections lost, %ld bad packets\n", totals.connect_errors, totals.lost, totals.bad_packets);
+  printf ("traffic: %ld lines (%.0f/s) and %ld bytes in, %ld messages and %ld bytes out\n", totals.lines_in, totals.lines_in / secs, totals.bytes_in, totals.messages_out, totals.bytes_out);
+  printf ("bots: %ld moves, %ld chat messages\n", totals.moves, totals.chats);
+  if (session_uring_submits () > 0)
+    printf ("io_uring: %ld submissions\n", session_uring_submits ());
+  printf ("heap: %ld allocations\n", heap_allocs);
+  printf ("connect time: ");
+  hist_print_json (stdout, &all_connect_time);
+  printf ("\nround trip: ");
+  hist_print_json (stdout, &all_rtt);
+  printf ("\n");
+
+  if (stats_fp)
+  {
+    for (i = 0; i < nsessions; i++)
+    {
+      latency_print_json (stats_fp, sessions[i]);
+      fputc ('\n', stats_fp);
+    }
+    fclose (stats_fp);
+  }
+  trace_close ();
+}
+
+int
+main (int argc, char *argv[])
+{
+  const char *stats_file = NULL;
+  const char *trace_file = NULL;
+  double rate;
+  int done = 0;
+
+  srand (time (NULL));
+  base_cookie = rand ();
+  probe_interval = 1000;
+
+  while (!done)
+  {
+    switch (getopt (argc, argv, "c:d:h:k:l:m:n:p:R:r:s:T:t:UV:"))
+    {
+    case 'c':
+      rate = atof (optarg);
+      bot_chat_ms = (rate > 0 ? (int) (60000 / rate) : 0);
+      break;
+    case 'd':
+      duration = atoi (optarg);
+      break;
+    case 'h':
+      server_host = strdup (optarg);
+      break;
+    case 'k':
+      base_cookie = atoi (optarg);
+      break;
+    case 'l':
+      probe_interval = atoi (optarg) * 1000;
+      break;
+    case 'm':
+      rate = atof (optarg);
+      if (rate > 0)
+        bot_think_ms = (int) (1000 / rate);
+      break;
+    case 'n':
+      clients = atoi (optarg);
+      break;
+    case 'p':
+      server_port = atoi (optarg);
+      break;
+    case 'R':
+      ramp_rate = atof (optarg);
+      break;
+    case 'r':
+      max_reconnects = atoi (optarg);
+      break;
+    case 's':
+      stats_file = strdup (optarg);
+      break;
+    case 'T':
+      trace_file = strdup (optarg);
+      break;
+    case 't':
+      connect_timeout = atoi (optarg) * 1000;
+      break;
+    case 'U':
+      use_uring = TRUE;
+      break;
+    case 'V':
+      forced_protocol = protocol_find (optarg);
+      if (!forced_protocol)
+      {
+        fprintf (stderr, "Unknown server version %s; try 4.03 or 5.01\n", optarg);
+        exit (1);
+      }
+      break;
+    case '?':
+      fprintf (stderr, "Usage: %s [-h <host>] [-p <port>] [-n <clients>] [-R <clients started per second>] [-k <first cookie>] [-m <answers per second per client>] [-c <chat messages per minute per client>] [-d <seconds>] [-l <latency probe interval>] [-r <reconnect attempts>] [-t <connect timeout>] [-s <stats file>] [-T <trace file>] [-U] [-V <server version>]\n", argv[0]);
+      exit (1);
+    default:
+      done = 1;
+      break;
+    }
+  }
+  if (clients <= 0 || ramp_rate <= 0)
+  {
+    fprintf (stderr, "%s: need at least one client, started at a positive rate\n", argv[0]);
+    exit (1);
+  }
+
+  if (stats_file)
+  {
+    stats_fp = fopen (stats_file, "w");
+    if (!stats_fp)
+    {
+      perror (stats_file);
+      exit (1);
+    }
+  }
+  if (trace_file && trace_open (trace_file) < 0)
+  {
+    perror (trace_file);
+    exit (1);
+  }
+
+  log_init ();
+  loop = loop_new ();
+  if (!loop)
+    exit (1);
+  quit_when_idle = FALSE;
+  signal (SIGINT, quit_signal);
+  signal (SIGTERM, quit_signal);
+  signal (SIGPIPE, SIG_IGN);
+
+  start_ms = loop_now ();
+  ramp_timer.func = ramp_timeout;
+  loop_add_timer (loop, &ramp_timer, 0);
+  report_timer.func = report_timeout;
+  loop_add_timer (loop, &report_timer, 1000);
+  if (duration > 0)
+  {
+    stop_timer.func = stop_timeout;
+    loop_add_timer (loop, &stop_timer, duration * 1000);
+  }
+
+  printf ("phantload: %d clients against %s port %d, %.1f started per second\n", clients, server_host, server_port, ramp_rate);
+  loop_run (loop);
+  print_summary ();
+  return 0;
+}
@@ -0,0 +1,900 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+/* phantserv: a stand-in for the Phantasia server, so that the client can be
+ * tested and benchmarked without phantasia4.net. It speaks the server side
+ * of packet.h: the handshake, the stat packets, dialogs, chat, the
+ * scoreboard and the player list. There is no game behind it; players just
+ * walk around a map that has no monsters.
+ *
+ * Each client is first taken through the script given with -s, if any, and
+ * then gets a main menu. A script has one step per line:
+ *
+ *   # a comment
+ *   11 Welcome to the test server    send a packet; the packet's lines are
+ *   20 Yes|No||||||                  separated by '|'
+ *   sleep 500                        pause for that many milliseconds
+ *
+ * After sending a dialog (packets 20 to 25), the script waits for the
+ * client to answer it.
+ */
+
+#include "packet.h"
+#include "loop.h"
+#include "buffer.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/* Answers to the handshake. The cookie identifies the player. A 5.01
+ * client starts with "BETA", and a 4.03 one with its version. */
+#define HANDSHAKE_ANSWERS (phant5 ? 6 : 4)
+#define HANDSHAKE_COOKIE (phant5 ? 3 : 1)
+#define HANDSHAKE_FIRST (phant5 ? "BETA" : "1004")
+
+/* Lines in a PLAYER_INFO packet; see player_info_records in handlers.c */
+#define PLAYER_INFO_LINES (phant5 ? 42 : 41)
+
+/* A client that lets this much output pile up is dropped */
+#define OUT_MAX (4 * 1024 * 1024)
+
+/* What a client is doing */
+#define PHASE_HANDSHAKE 0
+#define PHASE_SCRIPT 1	/* running the script */
+#define PHASE_MENU 2	/* at the main menu */
+#define PHASE_MOVE 3	/* asked for coordinates */
+#define PHASE_EXAMINE 4	/* asked for a player's name */
+
+typedef struct
+{
+  int packet;	/* 0 for a pause */
+  char *text;	/* the whole packet, newlines included */
+  int len;
+  int ms;
+} STEP;
+
+typedef struct client CLIENT;
+
+struct client
+{
+  int fd;
+  WATCH watch;
+  INBUF in;
+  OUTBUF out;
+  DEFER flush;
+  TIMER timer;	/* for pauses in the script */
+  int index;	/* position in the clients array */
+  int phase;
+  int step;	/* next script step */
+  int answers;	/* responses still expected to the current question */
+  int command;	/* client packet whose argument comes next, or 0 */
+  int closing;	/* close once the output is flushed */
+  int joined;	/* is in the player list */
+  int cookie;
+  char name[32];
+  const char *type;
+  int x;
+  int y;
+  int energy;
+  int max_energy;
+};
+
+static STEP *steps;
+static int nsteps;
+
+static CLIENT **clients;
+static int nclients;
+static int clients_size;
+
+static LOOP *loop;
+static WATCH listen_watch;
+static TIMER listen_timer;
+static TIMER ping_timer;
+static int ping_interval = 10000;
+static int verbose;
+static int phant5 = 1; /* speak 5.01, not 4.03 */
+
+/* For the summary printed at exit */
+static long total_clients;
+static int max_clients;
+static long bytes_in;
+static long bytes_out;
+
+static const char *types[] = { "Magic-User", "Fighter", "Elf", "Dwarf", "Halfling", "Experimento" };
+
+static const char *regions[] = { "The Plains", "The Woods", "The Marshes", "The Cliffs", "The Wastelands", "The Dead Marshes", "The Dragon's Lair" };
+
+static void client_close (CLIENT *client);
+static void client_menu (CLIENT *client);
+
+static void
+client_write (CLIENT *client, const char *buf, int len)
+{
+  if (client->closing)
+    return;
+  outbuf_append (&client->out, buf, len);
+  loop_defer (loop, &client->flush);
+}
+
+/* Queues a packet. Its lines come from fmt, each ending with a newline. */
+static void
+client_printf (CLIENT *client, const char *fmt, ...)
+{
+  char buf[1024];
+  va_list args;
+  int len;
+
+  va_start (args, fmt);
+  len = vsnprintf (buf, sizeof (buf), fmt, args);
+  va_end (args);
+  if (len >= sizeof (buf))
+    len = sizeof (buf) - 1;
+  client_write (client, buf, len);
+}
+
+static void
+client_flush (LOOP *loop, DEFER *defer)
+{
+  CLIENT *client = (CLIENT *) defer->data;
+  unsigned long bytes = client->out.bytes;
+  int res;
+
+  if (outbuf_pending (&client->out) > OUT_MAX)
+  {
+    if (verbose)
+      printf ("%s: too slow; dropping\n", client->name);
+    client_close (client);
+    return;
+  }
+  res = outbuf_flush (&client->out, client->fd);
+  bytes_out += client->out.bytes - bytes;
+  if (res < 0 || (res > 0 && client->closing))
+  {
+    client_close (client);
+    return;
+  }
+  loop_modify_watch (loop, &client->watch, (res ? EPOLLIN : EPOLLIN | EPOLLOUT));
+}
+
+static const char *
+region (CLIENT *client)
+{
+  int d = abs (client->x) > abs (client->y) ? abs (client->x) : abs (client->y);
+
+  d /= 10;
+  if (d >= sizeof (regions) / sizeof (regions[0]))
+    d = sizeof (regions) / sizeof (regions[0]) - 1;
+  return regions[d];
+}
+
+static void
+send_location (CLIENT *client)
+{
+  client_printf (client, "%d\n%d\n%d\n%s\n", LOCATION_PACKET, client->x, client->y, region (client));
+}
+
+/* Everything the client shows in its stat window */
+static void
+send_stats (CLIENT *client)
+{
+  client_printf (client, "%d\n%s\n", NAME_PACKET, client->name);
+  send_location (client);
+  client_printf (client, "%d\n%d\n%d\n0\n", ENERGY_PACKET, client->energy, client->max_energy);
+  client_printf (client, "%d\n50\n50\n", STRENGTH_PACKET);
+  client_printf (client, "%d\n40\n40\n", SPEED_PACKET);
+  client_printf (client, "%d\n10\n", SHIELD_PACKET);
+  client_printf (client, "%d\n10\n", SWORD_PACKET);
+  client_printf (client, "%d\n0\n", QUICKSILVER_PACKET);
+  if (phant5)
+    client_printf (client, "%d\n20\n20\n", MANA_PACKET);
+  else
+    client_printf (client, "%d\n20\n", MANA_PACKET);
+  client_printf (client, "%d\n1\n", LEVEL_PACKET);
+  client_printf (client, "%d\n100\n", GOLD_PACKET);
+  client_printf (client, "%d\n0\n", GEMS_PACKET);
+  client_printf (client, "%d\nNo\n", CLOAK_PACKET);
+  client_printf (client, "%d\nNo\n", BLESSING_PACKET);
+  client_printf (client, "%d\nNo\n", CROWN_PACKET);
+  client_printf (client, "%d\nNo\n", PALANTIR_PACKET);
+  client_printf (client, "%d\nNo\n", RING_PACKET);
+  client_printf (client, "%d\nYes\n", VIRGIN_PACKET);
+  if (!phant5)
+    return;
+  client_printf (client, "%d\n0\n", AMULETS_PACKET);
+  client_printf (client, "%d\n0\n", CHARMS_PACKET);
+  client_printf (client, "%d\n0\n", TOKENS_PACKET);
+}
+
+static CLIENT *
+find_client (const char *name)
+{
+  int i;
+
+  for (i = 0; i < nclients; i++)
+    if (clients[i]->joined && !strcmp (clients[i]->name, name))
+      return clients[i];
+  return NULL;
+}
+
+static void
+send_player_info (CLIENT *client, CLIENT *who)
+{
+  int i;
+
+  client_printf (client, "%d\n", PLAYER_INFO_PACKET);
+  client_printf (client, "%s the %s\n%s (%d, %d)\n", who->name, who->type, region (who), who->x, who->y);
+  for (i = 2; i < PLAYER_INFO_LINES; i++)
+    client_printf (client, "%d\n", i == 8 ? who->energy : 0);
+}
+
+/* Lists the first SCOREBOARD_LINES players */
+#define SCOREBOARD_LINES 20
+
+static void
+send_scoreboard (CLIENT *client)
+{
+  int count = 0;
+  int i;
+
+  for (i = 0; i < nclients && count < SCOREBOARD_LINES; i++)
+    if (clients[i]->joined)
+      count++;
+  client_printf (client, "%d\nstart\n%d\n", SCOREBOARD_DIALOG_PACKET, count);
+  for (i = 0; i < nclients && count > 0; i++)
+  {
+    if (!clients[i]->joined)
+      continue;
+    client_printf (client, "%-16s %-12s (%d, %d)\n", clients[i]->name, clients[i]->type, clients[i]->x, clients[i]->y);
+    count--;
+  }
+}
+
+static void
+broadcast (CLIENT *from, const char *buf, int len)
+{
+  int i;
+
+  for (i = 0; i < nclients; i++)
+    if (clients[i] != from && clients[i]->joined)
+      client_write (clients[i], buf, len);
+}
+
+/* The handshake is done: send the player and the player list, then start
+ * the script */
+static void
+client_join (CLIENT *client)
+{
+  char buf[128];
+  int len;
+  int i;
+
+  snprintf (client->name, sizeof (client->name), "Player%d", client->cookie);
+  client->type = types[(unsigned int) client->cookie % (sizeof (types) / sizeof (types[0]))];
+  client->x = rand () % 21 - 10;
+  client->y = rand () % 21 - 10;
+  client->max_energy = client->energy = 100;
+
+  client_printf (client, "%d\n", CLEAR_PACKET);
+  client_printf (client, "%d\nWelcome to phantserv, %s.\n", WRITE_LINE_PACKET, client->name);
+  send_stats (client);
+  for (i = 0; i < nclients; i++)
+    if (clients[i]->joined)
+      client_printf (client, "%d\n%s\n%s\n", ADD_PLAYER_PACKET, clients[i]->name, clients[i]->type);
+  client_printf (client, "%d\n%s\n%s\n", ADD_PLAYER_PACKET, client->name, client->type);
+  client_printf (client, "%d\n", ACTIVATE_CHAT_PACKET);
+
+  len = snprintf (buf, sizeof (buf), "%d\n%s\n%s\n", ADD_PLAYER_PACKET, client->name, client->type);
+  broadcast (client, buf, len);
+  client->joined = 1;
+}
+
+static void
+run_script (CLIENT *client)
+{
+  STEP *step;
+
+  client->phase = PHASE_SCRIPT;
+  while (client->step < nsteps)
+  {
+    step = &steps[client->step++];
+    if (!step->packet)
+    {
+      loop_add_timer (loop, &client->timer, step->ms);
+      return;
+    }
+    client_write (client, step->text, step->len);
+    if (step->packet >= BUTTONS_PACKET && step->packet <= PASSWORD_DIALOG_PACKET)
+    {
+      client->answers = (step->packet == COORDINATES_DIALOG_PACKET ? 2 : 1);
+      return;
+    }
+  }
+  client_menu (client);
+}
+
+static void
+script_timeout (LOOP *loop, TIMER *timer)
+{
+  run_script ((CLIENT *) timer->data);
+}
+
+static void
+client_menu (CLIENT *client)
+{
+  client->phase = PHASE_MENU;
+  client->answers = 1;
+  client_printf (client, "%d\nMove To\nRest\nExamine\nScoreboard\n\n\n\nQuit\n", FULL_BUTTONS_PACKET);
+}
+
+static void
+move (CLIENT *client, int x, int y)
+{
+  client->x = x;
+  client->y = y;
+  send_location (client);
+  client_menu (client);
+}
+
+/* Compass answers to FULL_BUTTONS, from 8 (northwest) to 16 (southeast).
+ * 12 is the middle of the compass, and rests. */
+static const int compass_dx[] = { -1, 0, 1, -1, 0, 1, -1, 0, 1 };
+static const int compass_dy[] = { 1, 1, 1, 0, 0, 0, -1, -1, -1 };
+
+static void
+rest (CLIENT *client)
+{
+  client->energy += 10;
+  if (client->energy > client->max_energy)
+    client->energy = client->max_energy;
+  client_printf (client, "%d\nYou rest.\n", WRITE_LINE_PACKET);
+  client_printf (client, "%d\n%d\n%d\n0\n", ENERGY_PACKET, client->energy, client->max_energy);
+  client_menu (client);
+}
+
+static void
+menu_answer (CLIENT *client, int choice)
+{
+  switch (choice)
+  {
+  case 0:
+    client->phase = PHASE_MOVE;
+    client->answers = 2;
+    client_printf (client, "%d\nEnter the X Y coordinates to move to:\n", COORDINATES_DIALOG_PACKET);
+    break;
+  case 1:
+  case 12:
+    rest (client);
+    break;
+  case 2:
+    client->phase = PHASE_EXAMINE;
+    client->answers = 1;
+    client_printf (client, "%d\nWhich player do you want to examine?\n", PLAYER_DIALOG_PACKET);
+    break;
+  case 3:
+    send_scoreboard (client);
+    client_menu (client);
+    break;
+  case 7:
+    client_printf (client, "%d\n", CLOSE_CONNECTION_PACKET);
+    client->closing = 1;
+    break;
+  default:
+    if (choice >= 8 && choice <= 16)
+    {
+      move (client, client->x + compass_dx[choice - 8], client->y + compass_dy[choice - 8]);
+      break;
+    }
+    client_menu (client);
+    break;
+  }
+}
+
+/* A C_RESPONSE_PACKET answer */
+static void
+client_answer (CLIENT *client, const char *buf)
+{
+  CLIENT *who;
+
+  if (client->answers > 0)
+    client->answers--;
+  if (verbose)
+    printf ("%s: %s\n", client->name[0] ? client->name : "(handshake)", buf);
+
+  switch (client->phase)
+  {
+  case PHASE_HANDSHAKE:
+    if (client->answers == HANDSHAKE_ANSWERS - 1 && strcmp (buf, HANDSHAKE_FIRST))
+    {
+      /* A client for the other version; turn it away */
+      client_printf (client, "%d\nWrong client version\n%d\n", ERROR_PACKET, CLOSE_CONNECTION_PACKET);
+      client->answers = -1;
+      client->closing = 1;
+      break;
+    }
+    if (client->answers == HANDSHAKE_ANSWERS - HANDSHAKE_COOKIE - 1)
+      client->cookie = atoi (buf);
+    if (client->answers == 0)
+    {
+      client_join (client);
+      run_script (client);
+    }
+    break;
+  case PHASE_SCRIPT:
+    if (client->answers == 0 && !client->timer.index)
+      run_script (client);
+    break;
+  case PHASE_MENU:
+    menu_answer (client, atoi (buf));
+    break;
+  case PHASE_MOVE:
+    /* The first answer is x; keep it in y until the second arrives */
+    if (client->answers > 0)
+      client->y = atoi (buf);
+    else
+      move (client, client->y, atoi (buf));
+    break;
+  case PHASE_EXAMINE:
+    who = find_client (buf);
+    if (who)
+      send_player_info (client, who);
+    else
+      client_printf (client, "%d\nThere is no player by that name.\n", WRITE_LINE_PACKET);
+    client_menu (client);
+    break;
+  }
+}
+
+/* The client backed out of a dialog */
+static void
+client_cancel (CLIENT *client)
+{
+  client->answers = 0;
+  if (client->phase == PHASE_SCRIPT)
+    run_script (client);
+  else if (client->phase != PHASE_HANDSHAKE)
+    client_menu (client);
+}
+
+static void
+client_chat (CLIENT *client, const char *buf)
+{
+  char out[1024];
+  int len;
+
+  len = snprintf (out, sizeof (out), "%d\n%s: %s\n", CHAT_PACKET, client->name, buf);
+  if (len >= sizeof (out))
+    len = sizeof (out) - 1;
+  broadcast (NULL, out, len);
+}
+
+/* Handles one NUL-terminated message from the client. Most are a packet
+ * number on its own; some are followed by an argument. */
+static int
+client_message (CLIENT *client, const char *buf)
+{
+  int command = client->command;
+  CLIENT *who;
+
+  if (command)
+  {
+    client->command = 0;
+    switch (command)
+    {
+    case C_RESPONSE_PACKET:
+      client_answer (client, buf);
+      break;
+    case C_CHAT_PACKET:
+      if (client->joined)
+        client_chat (client, buf);
+      break;
+    case C_EXAMINE_PACKET:
+      who = find_client (buf);
+      if (who)
+        send_player_info (client, who);
+      break;
+    }
+    return 0;
+  }
+
+  switch (atoi (buf))
+  {
+  case C_RESPONSE_PACKET:
+  case C_CHAT_PACKET:
+  case C_EXAMINE_PACKET:
+    client->command = atoi (buf);
+    break;
+  case C_CANCEL_PACKET:
+    client_cancel (client);
+    break;
+  case C_PING_PACKET:
+  case C_PONG_PACKET:
+    break;
+  case C_ERROR_PACKET:
+    return -1;
+  case C_SCOREBOARD_PACKET:
+    send_scoreboard (client);
+    break;
+  case C_PING_REQUEST_PACKET:
+    client_printf (client, "%d\n", TIMED_PING_PACKET);
+    break;
+  default:
+    if (verbose)
+      printf ("%s: unexpected message %s\n", client->name, buf);
+    return -1;
+  }
+  return 0;
+}
+
+static void
+client_io (LOOP *loop, WATCH *watch, unsigned int events)
+{
+  CLIENT *client = (CLIENT *) watch->data;
+  char *buf;
+  int len;
+  int res;
+
+  if (events & EPOLLOUT)
+    loop_defer (loop, &client->flush);
+  if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+    return;
+
+  res = inbuf_read (&client->in, client->fd);
+  if (res < 0 && errno == EAGAIN)
+    return;
+  if (res <= 0)
+  {
+    client_close (client);
+    return;
+  }
+  bytes_in += res;
+
+  while ((buf = inbuf_next (&client->in, '\0', &len)))
+  {
+    if (client_message (client, buf) < 0)
+    {
+      client_close (client);
+      return;
+    }
+  }
+}
+
+static void
+client_close (CLIENT *client)
+{
+  char buf[128];
+  int len;
+
+  loop_remove_watch (loop, &client->watch);
+  loop_remove_timer (loop, &client->timer);
+  loop_cancel_defer (loop, &client->flush);
+  close (client->fd);
+
+  clients[client->index] = clients[--nclients];
+  clients[client->index]->index = client->index;
+
+  if (client->joined)
+  {
+    len = snprintf (buf, sizeof (buf), "%d\n%s\n", REMOVE_PLAYER_PACKET, client->name);
+    broadcast (client, buf, len);
+  }
+  if (verbose)
+    printf ("%s: disconnected\n", client->name[0] ? client->name : "(handshake)");
+
+  inbuf_free (&client->in);
+  outbuf_free (&client->out);
+  free (client);
+}
+
+static void
+client_new (int fd)
+{
+  CLIENT *client;
+  int one = 1;
+
+  setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+  client = (CLIENT *) calloc (sizeof (CLIENT), 1);
+  client->fd = fd;
+  client->watch.fd = fd;
+  client->watch.events = EPOLLIN;
+  client->watch.func = client_io;
+  client->watch.data = client;
+  client->flush.func = client_flush;
+  client->flush.data = client;
+  client->timer.func = script_timeout;
+  client->timer.data = client;
+  if (loop_add_watch (loop, &client->watch) < 0)
+  {
+    close (fd);
+    free (client);
+    return;
+  }
+
+  if (nclients == clients_size)
+  {
+    clients_size = (clients_size > 0 ? clients_size * 2 : 64);
+    clients = (CLIENT **) realloc (clients, clients_size * sizeof (CLIENT *));
+  }
+  client->index = nclients;
+  clients[nclients++] = client;
+  total_clients++;
+  if (nclients > max_clients)
+    max_clients = nclients;
+
+  client->phase = PHASE_HANDSHAKE;
+  client->answers = HANDSHAKE_ANSWERS;
+  client_printf (client, "%d\n", HANDSHAKE_PACKET);
+}
+
+static void
+listen_resume (LOOP *loop, TIMER *timer)
+{
+  loop_add_watch (loop, &listen_watch);
+}
+
+static void
+listen_io (LOOP *loop, WATCH *watch, unsigned int events)
+{
+  int fd;
+
+  for (;;)
+  {
+    fd = accept (watch->fd, NULL, NULL);
+    if (fd >= 0)
+    {
+      fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+      fcntl (fd, F_SETFD, FD_CLOEXEC);
+      client_new (fd);
+      continue;
+    }
+    if (errno == EINTR || errno == ECONNABORTED)
+      continue;
+    if (errno == EMFILE || errno == ENFILE)
+    {
+      /* Out of descriptors. Stop accepting for a while, rather than being
+       * woken for the same connection over and over. */
+      fprintf (stderr, "phantserv: out of file descriptors with %d clients\n", nclients);
+      loop_remove_watch (loop, &listen_watch);
+      loop_add_timer (loop, &listen_timer, 1000);
+    }
+    return;
+  }
+}
+
+/* Pings everyone, as the real server does when a question times out. The
+ * client drops the question it was answering (see ui_timeout), so ask it
+ * again. */
+static void
+ping_timeout (LOOP *loop, TIMER *timer)
+{
+  CLIENT *client;
+  STEP *step;
+  char buf[8];
+  int len;
+  int i;
+
+  len = snprintf (buf, sizeof (buf), "%d\n", PING_PACKET);
+  for (i = 0; i < nclients; i++)
+  {
+    client = clients[i];
+    if (client->phase == PHASE_HANDSHAKE)
+      continue;
+    client_write (client, buf, len);
+    if (client->phase != PHASE_SCRIPT)
+      client_menu (client);
+    else if (client->answers > 0)
+    {
+      step = &steps[client->step - 1];
+      client->answers = (step->packet == COORDINATES_DIALOG_PACKET ? 2 : 1);
+      client_write (client, step->text, step->len);
+    }
+  }
+  loop_add_timer (loop, timer, ping_interval);
+}
+
+/* Listens on both IPv6 and IPv4 if possible */
+static int
+listen_on (int port)
+{
+  struct sockaddr_in6 sin6;
+  struct sockaddr_in sin;
+  int fd;
+  int zero = 0;
+  int one = 1;
+
+  fd = socket (AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd >= 0)
+  {
+    setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+    setsockopt (fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof (zero));
+    memset (&sin6, 0, sizeof (sin6));
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_addr = in6addr_any;
+    sin6.sin6_port = htons (port);
+    if (bind (fd, (struct sockaddr *) &sin6, sizeof (sin6)) == 0)
+      return fd;
+    close (fd);
+  }
+
+  fd = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+  memset (&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl (INADDR_ANY);
+  sin.sin_port = htons (port);
+  if (bind (fd, (struct sockaddr *) &sin, sizeof (sin)) < 0)
+  {
+    close (fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Reads the script. Returns -1, after saying why, if it can't be used. */
+static int
+load_script (const char *path)
+{
+  char line[4096];
+  FILE *fp;
+  STEP *step;
+  char *p;
+  int lineno = 0;
+  int len;
+
+  fp = fopen (path, "r");
+  if (!fp)
+  {
+    perror (path);
+    return -1;
+  }
+
+  while (fgets (line, sizeof (line), fp))
+  {
+    lineno++;
+    len = strlen (line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+    p = line + strspn (line, " \t");
+    if (!*p || *p == '#')
+      continue;
+
+    steps = (STEP *) realloc (steps, (nsteps + 1) * sizeof (STEP));
+    step = &steps[nsteps];
+    memset (step, 0, sizeof (*step));
+    if (!strncmp (p, "sleep ", 6))
+    {
+      step->ms = atoi (p + 6);
+      nsteps++;
+      continue;
+    }
+
+    step->packet = atoi (p);
+    if (step->packet <= 0 || step->packet >= 64)
+    {
+      fprintf (stderr, "%s:%d: expected a packet number or sleep\n", path, lineno);
+      fclose (fp);
+      return -1;
+    }
+    /* The number and the first line are separated by a space */
+    p += strspn (p, "0123456789");
+    if (*p == ' ')
+      *p = '|';
+    len = strlen (p);
+    step->text = (char *) malloc (len + 16);
+    step->len = sprintf (step->text, "%d", step->packet);
+    for (; *p; p++)
+      step->text[step->len++] = (*p == '|' ? '\n' : *p);
+    step->text[step->len++] = '\n';
+    nsteps++;
+  }
+
+  fclose (fp);
+  return 0;
+}
+
+static void
+quit_signal (int sig)
+{
+  loop_quit (loop);
+}
+
+int
+main (int argc, char *argv[])
+{
+  int port = 43302;
+  const char *script = NULL;
+  int done = 0;
+  int fd;
+
+  while (!done)
+  {
+    switch (getopt (argc, argv, "i:p:s:vV:"))
+    {
+    case 'i':
+      ping_interval = atoi (optarg) * 1000;
+      break;
+    case 'p':
+      port = atoi (optarg);
+      break;
+    case 's':
+      script = optarg;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    case 'V':
+      phant5 = strcmp (optarg, "4.03");
+      break;
+    case '?':
+      fprintf (stderr, "Usage: %s [-p <port>] [-s <script>] [-i <ping interval>] [-v] [-V <4.03|5.01>]\n", argv[0]);
+      exit (1);
+    default:
+      done = 1;
+      break;
+    }
+  }
+
+  if (script && load_script (script) < 0)
+    exit (1);
+
+  loop = loop_new ();
+  if (!loop)
+    exit (1);
+
+  fd = listen_on (port);
+  if (fd < 0 || listen (fd, SOMAXCONN) < 0)
+  {
+    perror ("phantserv: listen");
+    exit (1);
+  }
+  listen_watch.fd = fd;
+  listen_watch.events = EPOLLIN;
+  listen_watch.func = listen_io;
+  loop_add_watch (loop, &listen_watch);
+  listen_timer.func = listen_resume;
+
+  if (ping_interval > 0)
+  {
+    ping_timer.func = ping_timeout;
+    loop_add_timer (loop, &ping_timer, ping_interval);
+  }
+
+  signal (SIGINT, quit_signal);
+  signal (SIGTERM, quit_signal);
+  signal (SIGPIPE, SIG_IGN);
+  srand (time (NULL));
+
+  printf ("phantserv: listening on port %d\n", port);
+  fflush (stdout);
+  loop_run (loop);
+
+  printf ("phantserv: %ld connections, %d at most at once, %ld bytes in, %ld bytes out\n", total_clients, max_clients, bytes_in, bytes_out);
+  return 0;
+}
@@ -0,0 +1,474 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+/* Session recordings, and replaying them.
+ *
+ * A recording is the 8 byte header REC_MAGIC followed by one record per
+ * line read from the server, or per message sent to it:
+ *   1 byte	direction (REC_IN or REC_OUT)
+ *   varint	nanoseconds since the previous record (or since recording began)
+ *   varint	length
+ *   bytes	the line, without its newline, or the message as sent
+ * Varints are unsigned LEB128: 7 bits per byte, low bits first, with the
+ * high bit set on every byte but the last.
+ *
+ * A replay plays the server's side of a recording into one end of a socket
+ * pair, while the session reads the other end with read_socket as usual.
+ * Whatever the session sends back is compared against what was recorded.
+ */
+
+#include "phantcli.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define REC_MAGIC "PHREC\001\000\000"
+#define REC_MAGIC_LEN 8
+
+/* Size of the recorder's write buffer */
+#define REC_BUFSIZE 65536
+
+/* In fast mode, queue about this much before writing to the session */
+#define REPLAY_BATCH 65536
+
+/* Milliseconds to wait for replies after the last line has been played */
+#define REPLAY_SETTLE 100
+
+struct recorder
+{
+  int fd;
+  char buf[REC_BUFSIZE];
+  int len;
+  unsigned long long last_ns;
+};
+
+struct replay
+{
+  LOOP *loop;
+  STATE *state;
+  const unsigned char *data; /* the mapped recording */
+  size_t size;
+  size_t pos; /* next record */
+  pbool fast;
+  WATCH watch; /* our end of the socket pair */
+  TIMER timer;
+  OUTBUF out; /* server lines waiting to be written */
+  unsigned long long start_ns;
+  unsigned long long due_ns; /* recorded time of the next record */
+  size_t expected_pos; /* how far into the recording outgoing data matches */
+  int expected_off; /* offset into the REC_OUT record at expected_pos */
+  int loose; /* REC_OUT records to come that differ every time */
+  int loose_strings; /* strings the session still owes for the current one */
+  long lines;
+  long bytes_out;
+  long mismatches;
+  pbool draining; /* everything is sent; waiting for the last replies */
+  unsigned long long end_ns; /* when the last line was sent */
+};
+
+static void
+write_all (int fd, const char *buf, int len)
+{
+  int off = 0;
+  int res;
+
+  while (off < len)
+  {
+    res = write (fd, buf + off, len - off);
+    if (res < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    off += res;
+  }
+}
+
+static void
+flush_recorder (RECORDER *rec)
+{
+  write_all (rec->fd, rec->buf, rec->len);
+  rec->len = 0;
+}
+
+static void
+put_varint (RECORDER *rec, unsigned long long val)
+{
+  while (val >= 0x80)
+  {
+    rec->buf[rec->len++] = (char) (val | 0x80);
+    val >>= 7;
+  }
+  rec->buf[rec->len++] = (char) val;
+}
+
+/* Opens a new recording, replacing any file that is already there */
+RECORDER *
+recorder_open (const char *path)
+{
+  RECORDER *rec;
+  int fd;
+
+  fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+  if (fd == -1)
+  {
+    perror (path);
+    return NULL;
+  }
+
+  rec = (RECORDER *) malloc (sizeof (RECORDER));
+  rec->fd = fd;
+  memcpy (rec->buf, REC_MAGIC, REC_MAGIC_LEN);
+  rec->len = REC_MAGIC_LEN;
+  rec->last_ns = loop_now_ns ();
+  return rec;
+}
+
+void
+recorder_add (RECORDER *rec, int dir, const char *buf, int len)
+{
+  unsigned long long now = loop_now_ns ();
+
+  /* Room for the direction and two varints */
+  if (rec->len + 21 > REC_BUFSIZE)
+    flush_recorder (rec);
+  rec->buf[rec->len++] = (char) dir;
+  put_varint (rec, now - rec->last_ns);
+  put_varint (rec, len);
+  rec->last_ns = now;
+
+  if (len > REC_BUFSIZE - rec->len)
+  {
+    flush_recorder (rec);
+    if (len > REC_BUFSIZE)
+    {
+      write_all (rec->fd, buf, len);
+      return;
+    }
+  }
+  memcpy (rec->buf + rec->len, buf, len);
+  rec->len += len;
+}
+
+void
+recorder_close (RECORDER *rec)
+{
+  flush_recorder (rec);
+  close (rec->fd);
+  free (rec);
+}
+
+static int
+get_varint (REPLAY *replay, size_t *pos, unsigned long long *val)
+{
+  int shift = 0;
+  unsigned char c;
+
+  *val = 0;
+  do
+  {
+    if (*pos >= replay->size || shift > 63)
+      return -1;
+    c = replay->data[(*pos)++];
+    *val |= (unsigned long long) (c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  return 0;
+}
+
+/* Decodes the record at *pos, advancing past it. Returns -1 at the end of
+ * the recording, or if it is truncated. */
+static int
+get_record (REPLAY *replay, size_t *pos, int *dir, unsigned long long *delta, const unsigned char **buf, int *len)
+{
+  unsigned long long val;
+
+  if (*pos >= replay->size)
+    return -1;
+  *dir = replay->data[(*pos)++];
+  if (get_varint (replay, pos, delta) < 0 || get_varint (replay, pos, &val) < 0)
+    return -1;
+  if (val > replay->size - *pos)
+    return -1;
+  *buf = replay->data + *pos;
+  *len = (int) val;
+  *pos += val;
+  return 0;
+}
+
+static void
+replay_finish (REPLAY *replay)
+{
+  double secs = (replay->end_ns - replay->start_ns) / 1e9;
+  char buf[256];
+
+  snprintf (buf, sizeof (buf), "Replay finished: %ld lines in %.3f seconds (%.0f lines/s), %ld bytes sent, %ld mismatched", replay->lines, secs, (secs > 0 ? replay->lines / secs : 0), replay->bytes_out, replay->mismatches);
+  log_info (LOG_REPLAY, "%s\n", buf);
+  if (replay->state->ui)
+    ui_writeline (replay->state, buf);
+  else
+  {
+    fprintf (stderr, "%s\n", buf);
+    loop_quit (replay->loop);
+  }
+}
+
+/* Queues server lines that are due, and writes them. Arranges to be called
+ * again when the next line is due or when the socket has room. */
+static void
+replay_pump (REPLAY *replay)
+{
+  unsigned long long delta;
+  const unsigned char *buf;
+  int dir;
+  int len;
+  int res;
+  size_t pos;
+
+  for (;;)
+  {
+    if (outbuf_pending (&replay->out) >= REPLAY_BATCH)
+      break;
+    pos = replay->pos;
+    if (get_record (replay, &pos, &dir, &delta, &buf, &len) < 0)
+      break;
+    if (!replay->fast && replay->start_ns + replay->due_ns + delta > loop_now_ns ())
+      break;
+    replay->pos = pos;
+    replay->due_ns += delta;
+    if (dir != REC_IN)
+      continue;
+    outbuf_append (&replay->out, (const char *) buf, len);
+    outbuf_append (&replay->out, "\n", 1);
+    replay->lines++;
+  }
+
+  res = outbuf_flush (&replay->out, replay->watch.fd);
+  if (res < 0)
+  {
+    perror ("replay");
+    loop_remove_watch (replay->loop, &replay->watch);
+    return;
+  }
+  if (res == 0)
+  {
+    /* The session is behind; wait for it to read */
+    loop_modify_watch (replay->loop, &replay->watch, EPOLLIN | EPOLLOUT);
+    return;
+  }
+  loop_modify_watch (replay->loop, &replay->watch, EPOLLIN);
+
+  pos = replay->pos;
+  if (get_record (replay, &pos, &dir, &delta, &buf, &len) < 0)
+  {
+    /* Give the session a moment to answer the last lines */
+    if (!replay->draining)
+    {
+      replay->draining = TRUE;
+      replay->end_ns = loop_now_ns ();
+      loop_add_timer (replay->loop, &replay->timer, REPLAY_SETTLE);
+    }
+    return;
+  }
+  if (replay->fast)
+    loop_add_timer (replay->loop, &replay->timer, 0);
+  else
+    loop_add_timer (replay->loop, &replay->timer, (int) ((replay->start_ns + replay->due_ns + delta - loop_now_ns () + 999999) / 1000000));
+}
+
+/* Whether a recorded message is one that a replaying session won't send.
+ * Latency probes are turned off during a replay. */
+static pbool
+is_skipped (const unsigned char *buf, int len)
+{
+  char probe[8];
+
+  snprintf (probe, sizeof (probe), "%d", C_PING_REQUEST_PACKET);
+  return (len == strlen (probe) + 1 && !memcmp (buf, probe, len));
+}
+
+/* Whether a recorded message is the handshake answer that comes before
+ * the cookie, its hash and the time, which are different every time */
+static pbool
+is_before_cookie (const unsigned char *buf, int len)
+{
+  char answer[16];
+  int n;
+
+  /* As respondv sends it: the packet number and the answer, each a string */
+  n = snprintf (answer, sizeof (answer), "%d", C_RESPONSE_PACKET) + 1;
+  n += sprintf (answer + n, "1004") + 1;
+  return (len == n && !memcmp (buf, answer, len));
+}
+
+/* Compares what the session sent with the next REC_OUT records */
+static void
+check_output (REPLAY *replay, const char *buf, int len)
+{
+  unsigned long long delta;
+  const unsigned char *rbuf;
+  size_t pos;
+  int dir;
+  int rlen;
+  int n;
+
+  replay->bytes_out += len;
+  while (len > 0)
+  {
+    pos = replay->expected_pos;
+    do
+    {
+      replay->expected_pos = pos;
+      if (get_record (replay, &pos, &dir, &delta, &rbuf, &rlen) < 0)
+      {
+        replay->mismatches++; /* more output than was recorded */
+        return;
+      }
+    } while (dir != REC_OUT || replay->expected_off >= rlen || is_skipped (rbuf, rlen));
+
+    if (replay->loose)
+    {
+      /* Take whatever the session sent in its place, as many strings as
+       * were recorded */
+      if (!replay->loose_strings)
+        for (n = 0; n < rlen; n++)
+          replay->loose_strings += !rbuf[n];
+      for (; len > 0 && replay->loose_strings; buf++, len--)
+        if (!*buf)
+          replay->loose_strings--;
+      if (replay->loose_strings)
+        return;
+      replay->loose--;
+      replay->expected_pos = pos;
+      replay->expected_off = 0;
+      continue;
+    }
+
+    n = rlen - replay->expected_off;
+    if (n > len)
+      n = len;
+    if (memcmp (rbuf + replay->expected_off, buf, n) != 0)
+      replay->mismatches++;
+    replay->expected_off += n;
+    buf += n;
+    len -= n;
+    if (replay->expected_off == rlen)
+    {
+      if (is_before_cookie (rbuf, rlen))
+        replay->loose = 3;
+      replay->expected_pos = pos;
+      replay->expected_off = 0;
+    }
+  }
+}
+
+static void
+replay_io (LOOP *loop, WATCH *watch, unsigned int events)
+{
+  REPLAY *replay = (REPLAY *) watch->data;
+  char buf[4096];
+  int res;
+
+  if (events & EPOLLIN)
+  {
+    while ((res = read (watch->fd, buf, sizeof (buf))) > 0)
+      check_output (replay, buf, res);
+  }
+  if (events & EPOLLOUT)
+    replay_pump (replay);
+}
+
+static void
+replay_timeout (LOOP *loop, TIMER *timer)
+{
+  REPLAY *replay = (REPLAY *) timer->data;
+
+  if (replay->draining)
+    replay_finish (replay);
+  else
+    replay_pump (replay);
+}
+
+/* Starts playing the recording at path to the session. Returns the
+ * session's end of the connection, to be used as if it were a socket to the
+ * server, or -1 on error. */
+int
+replay_start (LOOP *loop, STATE *state, const char *path, pbool fast)
+{
+  REPLAY *replay;
+  struct stat st;
+  void *data;
+  int sv[2];
+  int fd;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+  {
+    perror (path);
+    return -1;
+  }
+  if (fstat (fd, &st) < 0 || st.st_size < REC_MAGIC_LEN)
+  {
+    fprintf (stderr, "%s: not a recording\n", path);
+    close (fd);
+    return -1;
+  }
+  data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (data == MAP_FAILED || memcmp (data, REC_MAGIC, REC_MAGIC_LEN) != 0)
+  {
+    fprintf (stderr, "%s: not a recording\n", path);
+    if (data != MAP_FAILED)
+      munmap (data, st.st_size);
+    return -1;
+  }
+
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) < 0)
+  {
+    perror ("socketpair");
+    munmap (data, st.st_size);
+    return -1;
+  }
+
+  replay = (REPLAY *) calloc (sizeof (REPLAY), 1);
+  replay->loop = loop;
+  replay->state = state;
+  replay->data = (const unsigned char *) data;
+  replay->size = st.st_size;
+  replay->pos = replay->expected_pos = REC_MAGIC_LEN;
+  replay->fast = fast;
+  replay->start_ns = loop_now_ns ();
+  replay->watch.fd = sv[1];
+  replay->watch.events = EPOLLIN;
+  replay->watch.func = replay_io;
+  replay->watch.data = replay;
+  replay->timer.func = replay_timeout;
+  replay->timer.data = replay;
+  loop_add_watch (loop, &replay->watch);
+  loop_add_timer (loop, &replay->timer, 0);
+
+  return sv[0];
+}
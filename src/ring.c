@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+#include "ring.h"
+
+#include <stdlib.h>
+
+/* size is rounded up to a power of two. Returns -1 if out of memory. */
+int
+ring_init (RING *ring, unsigned int size)
+{
+  unsigned int n = 1;
+
+  while (n < size)
+    n *= 2;
+  ring->slots = (void **) calloc (n, sizeof (void *));
+  if (!ring->slots)
+    return -1;
+  ring->size = n;
+  ring->head = ring->tail = 0;
+  return 0;
+}
+
+void
+ring_free (RING *ring)
+{
+  free (ring->slots);
+  ring->slots = NULL;
+}
+
+/* Producer only. Returns 0, or -1 if the ring is full. */
+int
+ring_push (RING *ring, void *item)
+{
+  unsigned int tail = __atomic_load_n (&ring->tail, __ATOMIC_RELAXED);
+
+  if (tail - __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE) == ring->size)
+    return -1;
+  ring->slots[tail & (ring->size - 1)] = item;
+  /* Publish the slot before the new tail */
+  __atomic_store_n (&ring->tail, tail + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Consumer only. Returns the oldest item, or NULL if the ring is empty. */
+void *
+ring_pop (RING *ring)
+{
+  unsigned int head = __atomic_load_n (&ring->head, __ATOMIC_RELAXED);
+  void *item;
+
+  if (head == __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  item = ring->slots[head & (ring->size - 1)];
+  /* Done with the slot before the producer may reuse it */
+  __atomic_store_n (&ring->head, head + 1, __ATOMIC_RELEASE);
+  return item;
+}
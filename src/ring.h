@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+/* A bounded queue of pointers between one producer thread and one consumer
+ * thread. Neither side ever takes a lock or waits: a push to a full ring or
+ * a pop from an empty one just fails. The producer alone writes tail and the
+ * consumer alone writes head, and they are kept on separate cache lines so
+ * that the two threads don't fight over them. Like loop.h, nothing here
+ * knows about the protocol. */
+
+typedef struct
+{
+  void **slots;
+  unsigned int size; /* a power of two */
+  unsigned int tail __attribute__ ((aligned (64))); /* free-running */
+  unsigned int head __attribute__ ((aligned (64)));
+} RING;
+
+int ring_init (RING *ring, unsigned int size);
+void ring_free (RING *ring);
+int ring_push (RING *ring, void *item);
+void *ring_pop (RING *ring);
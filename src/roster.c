@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+#include "roster.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_SIZE 16
+
+/* Index slots that hold no player. DELETED ones once did, so lookups must
+ * go on past them. */
+#define EMPTY -1
+#define DELETED -2
+
+/* FNV-1a */
+static unsigned int
+hash_name (const char *name)
+{
+  unsigned int hash = 2166136261u;
+
+  while (*name)
+  {
+    hash ^= (unsigned char) *name++;
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+/* Returns the index slot that points at name, or -1 */
+static int
+lookup (ROSTER *roster, const char *name, unsigned int hash)
+{
+  unsigned int mask = roster->index_size - 1;
+  unsigned int i;
+  int slot;
+
+  if (!roster->index)
+    return -1;
+  for (i = hash & mask; (slot = roster->index[i]) != EMPTY; i = (i + 1) & mask)
+  {
+    if (slot >= 0 && roster->players[slot].hash == hash && !strcmp (roster->players[slot].name, name))
+      return i;
+  }
+  return -1;
+}
+
+static void
+index_insert (ROSTER *roster, int slot)
+{
+  unsigned int mask = roster->index_size - 1;
+  unsigned int i = roster->players[slot].hash & mask;
+
+  while (roster->index[i] >= 0)
+    i = (i + 1) & mask;
+  roster->index[i] = slot;
+}
+
+/* Called when the array is full. Squeezes out the holes, first doubling the
+ * array if that wouldn't free at least half of it, and rebuilds the index.
+ * Either way it costs O(n), but only after n/2 adds. */
+static void
+make_room (ROSTER *roster)
+{
+  int n = 0;
+  int i;
+
+  if (roster->count > roster->size / 2 || !roster->size)
+  {
+    roster->size = (roster->size ? roster->size * 2 : MIN_SIZE);
+    roster->players = (PLAYER *) realloc (roster->players, roster->size * sizeof (PLAYER));
+    free (roster->index);
+    roster->index_size = roster->size * 2;
+    roster->index = (int *) malloc (roster->index_size * sizeof (int));
+  }
+
+  for (i = 0; i < roster->len; i++)
+    if (roster->players[i].name)
+      roster->players[n++] = roster->players[i];
+  roster->len = n;
+
+  for (i = 0; i < roster->index_size; i++)
+    roster->index[i] = EMPTY;
+  for (i = 0; i < roster->len; i++)
+    index_insert (roster, i);
+}
+
+/* Adds a player, without a type yet. Someone we already have is moved to
+ * the end, as if they were new. The pointer is good until the next add. */
+PLAYER *
+roster_add (ROSTER *roster, const char *name)
+{
+  PLAYER *player;
+
+  roster_remove (roster, name);
+  if (roster->len == roster->size)
+    make_room (roster);
+  player = &roster->players[roster->len];
+  player->name = strdup (name);
+  player->type = NULL;
+  player->hash = hash_name (name);
+  index_insert (roster, roster->len++);
+  roster->count++;
+  return player;
+}
+
+PLAYER *
+roster_find (ROSTER *roster, const char *name)
+{
+  int i = lookup (roster, name, hash_name (name));
+
+  return (i < 0 ? NULL : &roster->players[roster->index[i]]);
+}
+
+/* Returns 0, or -1 if there was nobody by that name */
+int
+roster_remove (ROSTER *roster, const char *name)
+{
+  int i = lookup (roster, name, hash_name (name));
+  PLAYER *player;
+
+  if (i < 0)
+    return -1;
+  player = &roster->players[roster->index[i]];
+  free (player->name);
+  free (player->type);
+  player->name = player->type = NULL;
+  roster->index[i] = DELETED;
+  roster->count--;
+  return 0;
+}
+
+/* Removes everyone, and frees the memory */
+void
+roster_clear (ROSTER *roster)
+{
+  int i;
+
+  for (i = 0; i < roster->len; i++)
+  {
+    free (roster->players[i].name);
+    free (roster->players[i].type);
+  }
+  free (roster->players);
+  free (roster->index);
+  memset (roster, 0, sizeof (ROSTER));
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+/* The players online, in the order they arrived. They are kept in an
+ * array, and found by name through an open-addressing hash index into it,
+ * so adding and removing a player are O(1). Removing leaves a hole (name
+ * NULL), and the holes are squeezed out when the array fills up, so walk
+ * the first len entries and skip them. A zeroed ROSTER is empty. */
+
+typedef struct
+{
+  char *name; /* NULL for a hole */
+  char *type;
+  unsigned int hash;
+} PLAYER;
+
+typedef struct
+{
+  PLAYER *players;
+  int len; /* entries in use, holes included */
+  int size;
+  int count; /* players, not counting holes */
+  int *index; /* slots in players, by hash of name */
+  int index_size; /* twice size, so it is never more than half full */
+} ROSTER;
+
+PLAYER *roster_add (ROSTER *roster, const char *name);
+PLAYER *roster_find (ROSTER *roster, const char *name);
+int roster_remove (ROSTER *roster, const char *name);
+void roster_clear (ROSTER *roster);
@@ -0,0 +1,543 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+/* Sessions: connecting, reading and writing, and reconnecting. Shared by
+ * phantcli and phantload. */
+
+#include "phantcli.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <unistd.h>
+
+/* Handles every complete line in the input buffer */
+static void
+parse_input (STATE *state)
+{
+  int res;
+  int len;
+  char *line;
+  unsigned long long begin = 0;
+
+  while ((line = inbuf_next (&state->in, '\n', &len)))
+  {
+    if (state->recorder)
+      recorder_add (state->recorder, REC_IN, line, len);
+    if (state->publisher)
+      publisher_line (state->publisher, line, len, state->sdh == handle_packet);
+    totals.lines_in++;
+    if (trace_fp)
+      begin = trace_line_begin (state);
+    res = state->sdh (state, line, len);
+    if (trace_fp)
+      trace_line_end (state, begin, res);
+    if (res < 0)
+      totals.bad_packets++;
+    if (res == 0)
+      state->sdh = handle_packet;
+    if (state->publisher && res <= 0)
+      publisher_commit (state->publisher, (res < 0 ? 0 : state->cur_packet));
+  }
+}
+
+int
+read_socket (STATE *state)
+{
+  int res;
+
+  res = inbuf_read (&state->in, state->fd);
+  if (res < 0 && errno == EAGAIN)
+    return 0;
+  if (res <= 0)
+    return -1;
+  state->latency.read_ns = loop_now_ns ();
+  totals.bytes_in += res;
+  log_trace (LOG_NET, "data: %.*s", res, state->in.data + state->in.end - res);
+  parse_input (state);
+  return 0;
+}
+
+/* Reconnect delays start around this many milliseconds, and double with
+ * each failed attempt up to RECONNECT_MAX. The actual delay is a random
+ * fraction of that, so that many sessions don't all come back at once. */
+#define RECONNECT_BASE 500
+#define RECONNECT_MAX 30000
+
+const char *server_host = "phantasia.dev";
+int server_port = 43302;
+int connect_timeout = 10000;
+int max_reconnects = -1;
+int probe_interval = 10000;
+pbool use_uring;
+const char *record_file;
+FILE *stats_fp;
+pbool quit_when_idle = TRUE;
+TOTALS totals;
+
+/* All open sessions. Removal swaps the last session into the hole, so that
+ * adding and removing sessions is O(1). */
+STATE **sessions;
+int nsessions;
+static int sessions_size;
+
+/* Shared by all sessions, if use_uring is set and we could get one */
+static URING *uring;
+
+static void
+session_add (STATE *state)
+{
+  static int next_id;
+
+  state->id = next_id++;
+  if (nsessions == sessions_size)
+  {
+    sessions_size = (sessions_size > 0 ? sessions_size * 2 : 16);
+    sessions = (STATE **) realloc (sessions, sessions_size * sizeof (STATE *));
+  }
+  state->index = nsessions;
+  sessions[nsessions++] = state;
+}
+
+/* Stops reading the socket, before it is closed */
+static void
+session_unwatch (STATE *state)
+{
+  if (uring)
+    uring_remove (uring, &state->conn);
+  else
+    loop_remove_watch (state->loop, &state->watch);
+}
+
+static void
+session_close (STATE *state)
+{
+  loop_remove_timer (state->loop, &state->reconnect.timer);
+  latency_stop (state);
+  if (state->connector)
+    connector_cancel (state->connector);
+  if (state->fd != -1)
+  {
+    session_unwatch (state);
+    close (state->fd);
+  }
+  loop_cancel_defer (state->loop, &state->flush);
+  publisher_free (state->publisher);
+  log_info (LOG_NET, "session %d: input buffer high water %d bytes, grown %d times\n", state->id, state->in.high_water, state->in.grows);
+  log_info (LOG_NET, "session %d: wrote %ld bytes in %ld flushes, %ld syscalls, largest flush %u bytes\n", state->id, state->out.bytes, state->out.flushes, state->out.syscalls, state->out.max_flush);
+  log_info (LOG_NET, "session %d: reconnected %d times, %llu ms to recover at most, %llu ms in total\n", state->id, state->reconnect.count, state->reconnect.max_ms, state->reconnect.total_ms);
+
+  ui_teardown (state);
+
+  /* Sessions that are still open at exit are handled by cleanup */
+  if (stats_fp)
+  {
+    latency_print_json (stats_fp, state);
+    fputc ('\n', stats_fp);
+  }
+  if (state->recorder)
+    recorder_close (state->recorder);
+
+  sessions[state->index] = sessions[--nsessions];
+  sessions[state->index]->index = state->index;
+  if (nsessions == 0 && quit_when_idle)
+    loop_quit (state->loop);
+  inbuf_free (&state->in);
+  outbuf_free (&state->out);
+  roster_clear (&state->roster);
+  arena_free (&state->dialog_arena);
+  arena_free (&state->strings[0]);
+  arena_free (&state->strings[1]);
+  free (state);
+}
+
+static void
+reconnect_timeout (LOOP *loop, TIMER *timer)
+{
+  STATE *state = (STATE *) timer->data;
+
+  state->connector = connector_start (loop, server_host, server_port, connect_timeout, session_connected, state);
+  if (!state->connector)
+    session_connected (-1, "could not start connecting", state);
+}
+
+/* Waits a while before trying to reconnect, backing off exponentially with
+ * jitter. Closes the session once we run out of attempts. */
+static void
+schedule_reconnect (STATE *state)
+{
+  int limit;
+  int i;
+
+  if (state->reconnect.max_attempts >= 0 && state->reconnect.attempts >= state->reconnect.max_attempts)
+  {
+    session_close (state);
+    return;
+  }
+
+  limit = RECONNECT_BASE;
+  for (i = 0; i < state->reconnect.attempts && limit < RECONNECT_MAX; i++)
+    limit *= 2;
+  if (limit > RECONNECT_MAX)
+    limit = RECONNECT_MAX;
+  state->reconnect.attempts++;
+  loop_add_timer (state->loop, &state->reconnect.timer, rand () % limit + 1);
+}
+
+/* The handshake doesn't say which version the server is, so we answer as
+ * 5.01, and if the server refuses that answer, with an error or by closing
+ * the connection, try again once as 4.03. A connection that was merely
+ * lost is tried again as it was, and -r 0 is respected either way. Returns
+ * TRUE if we are switching. */
+static pbool
+try_other_version (STATE *state)
+{
+  pbool refused = state->refused;
+
+  state->refused = FALSE;
+  if (!refused || forced_protocol || state->protocol_switched || state->reconnect.max_attempts == 0)
+    return FALSE;
+  state->protocol_switched = TRUE;
+  state->protocol = (state->protocol == &protocol_501 ? &protocol_403 : &protocol_501);
+  state->reconnect.closing = FALSE;
+  log_info (LOG_PROTO, "session %d: refused at the handshake, trying version %s\n", state->id, state->protocol->name);
+  return TRUE;
+}
+
+/* Called when the connection breaks. Unless the server told us it was
+ * closing it, or reconnecting is turned off, drop the socket and any
+ * half-read packet, but keep the player, the player list and the UI, and
+ * try again. The server recognizes us by our cookie. */
+static void
+session_lost (STATE *state)
+{
+  pbool switching = try_other_version (state);
+
+  if (!switching && (state->reconnect.closing || state->reconnect.max_attempts == 0))
+  {
+    session_close (state);
+    return;
+  }
+
+  session_unwatch (state);
+  close (state->fd);
+  state->fd = -1;
+  loop_cancel_defer (state->loop, &state->flush);
+  inbuf_reset (&state->in);
+  outbuf_reset (&state->out);
+  state->sdh = handle_packet;
+  state->line_count = 0;
+  ui_timeout (state);
+
+  latency_stop (state);
+  totals.lost++;
+  state->reconnect.lost_at = loop_now ();
+  state->reconnect.attempts = 0;
+  if (switching)
+  {
+    char buf[64];
+
+    snprintf (buf, sizeof (buf), "The server turned us away. Trying version %s...", state->protocol->name);
+    ui_writeline (state, buf);
+    loop_add_timer (state->loop, &state->reconnect.timer, 1);
+    return;
+  }
+  log_info (LOG_NET, "session %d: lost connection, reconnecting\n", state->id);
+  ui_writeline (state, "Lost the connection to the server. Reconnecting...");
+  schedule_reconnect (state);
+}
+
+/* Writes out everything that was queued for the session during this pass
+ * through the loop. If the socket can't take it all, wait for it to become
+ * writable and try again from session_io. */
+static void
+session_flush (LOOP *loop, DEFER *defer)
+{
+  STATE *state = (STATE *) defer->data;
+  int res;
+
+  if (uring)
+  {
+    /* Anything left goes when the send in flight completes */
+    if (uring_flush (uring, &state->conn) > 0)
+      latency_reply_flushed (state);
+    return;
+  }
+
+  res = outbuf_flush (&state->out, state->fd);
+  if (res < 0)
+  {
+    session_lost (state);
+    return;
+  }
+  if (res > 0)
+    latency_reply_flushed (state);
+  loop_modify_watch (loop, &state->watch, (res ? EPOLLIN : EPOLLIN | EPOLLOUT));
+}
+
+static void
+session_io (LOOP *loop, WATCH *watch, unsigned int events)
+{
+  STATE *state = (STATE *) watch->data;
+
+  if (events & EPOLLOUT)
+    loop_defer (loop, &state->flush);
+  if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && read_socket (state) < 0)
+    session_lost (state);
+}
+
+/* Data from io_uring, in place of session_io */
+static void
+session_recv (UCONN *conn, const char *buf, int len)
+{
+  STATE *state = (STATE *) conn->data;
+
+  if (len <= 0 || inbuf_append (&state->in, buf, len) < 0)
+  {
+    session_lost (state);
+    return;
+  }
+  state->latency.read_ns = loop_now_ns ();
+  totals.bytes_in += len;
+  log_trace (LOG_NET, "data: %.*s", len, buf);
+  parse_input (state);
+}
+
+/* Starts reading the socket, through io_uring if we can */
+static int
+session_watch (STATE *state)
+{
+  static pbool uring_tried;
+
+  if (use_uring && !uring_tried)
+  {
+    uring_tried = TRUE;
+    uring = uring_new (state->loop);
+    if (!uring)
+      fprintf (stderr, "io_uring is not available; using epoll\n");
+  }
+
+  if (uring)
+  {
+    state->conn.fd = state->fd;
+    state->conn.out = &state->out;
+    state->conn.func = session_recv;
+    state->conn.data = state;
+    return uring_add (uring, &state->conn);
+  }
+
+  state->watch.fd = state->fd;
+  state->watch.events = EPOLLIN;
+  state->watch.func = session_io;
+  state->watch.data = state;
+  return loop_add_watch (state->loop, &state->watch);
+}
+
+long
+session_uring_submits ()
+{
+  return (uring ? uring_submits (uring) : 0);
+}
+
+void
+session_connected (int fd, const char *error, void *data)
+{
+  STATE *state = (STATE *) data;
+  int one = 1;
+
+  state->connector = NULL;
+  if (fd == -1)
+    totals.connect_errors++;
+  if (fd == -1 && state->reconnect.lost_at)
+  {
+    log_info (LOG_NET, "session %d: reconnect attempt %d failed: %s\n", state->id, state->reconnect.attempts, error);
+    schedule_reconnect (state);
+    return;
+  }
+  if (fd == -1)
+  {
+    fprintf (stderr, "Could not connect to %s port %d: %s\n", server_host, server_port, error);
+    if (state->want_ui)
+      loop_quit (state->loop);
+    session_close (state);
+    return;
+  }
+
+  /* Output is batched by the event loop, so send each batch right away */
+  setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+  state->fd = fd;
+  if (session_watch (state) < 0)
+  {
+    close (fd);
+    state->fd = -1;
+    session_close (state);
+    return;
+  }
+
+  if (state->reconnect.lost_at)
+  {
+    char buf[64];
+    unsigned long long ms = loop_now () - state->reconnect.lost_at;
+
+    state->reconnect.lost_at = 0;
+    state->reconnect.count++;
+    totals.reconnects++;
+    state->reconnect.last_ms = ms;
+    state->reconnect.total_ms += ms;
+    if (ms > state->reconnect.max_ms)
+      state->reconnect.max_ms = ms;
+    log_info (LOG_NET, "session %d: reconnected after %llu ms, %d attempts\n", state->id, ms, state->reconnect.attempts);
+    snprintf (buf, sizeof (buf), "Reconnected after %.1f seconds.", ms / 1000.0);
+    ui_writeline (state, buf);
+    ui_update_status (state);
+  }
+  if (!state->watching)
+    latency_start (state, probe_interval); /* a viewer's probes are never sent */
+
+  if (state->reconnect.count == 0)
+  {
+    /* First time connected */
+    totals.connects++;
+    hist_record (&totals.connect_time, loop_now_ns () - state->connect_start);
+    ui_init (state);
+  }
+}
+
+/* Creates a session. With more than one session, each is recorded to its
+ * own file, named by adding the session number. */
+STATE *
+session_alloc (LOOP *loop, int cookie, int count)
+{
+  STATE *state;
+  char path[1024];
+
+  state = (STATE *) calloc (sizeof (STATE), 1);
+  state->fd = -1;
+  state->sdh = handle_packet;
+  state->protocol = (forced_protocol ? forced_protocol : &protocol_501);
+  state->cookie = cookie;
+  state->loop = loop;
+  state->flush.func = session_flush;
+  state->flush.data = state;
+  state->reconnect.max_attempts = max_reconnects;
+  state->reconnect.timer.func = reconnect_timeout;
+  state->reconnect.timer.data = state;
+  session_add (state);
+
+  if (record_file)
+  {
+    if (count > 1)
+      snprintf (path, sizeof (path), "%s.%d", record_file, state->id);
+    else
+      snprintf (path, sizeof (path), "%s", record_file);
+    state->recorder = recorder_open (path);
+  }
+  return state;
+}
+
+STATE *
+session_new (LOOP *loop, int cookie, int count)
+{
+  STATE *state = session_alloc (loop, cookie, count);
+
+  state->connect_start = loop_now_ns ();
+  state->connector = connector_start (loop, server_host, server_port, connect_timeout, session_connected, state);
+  if (!state->connector)
+  {
+    fprintf (stderr, "Could not connect to %s port %d\n", server_host, server_port);
+    session_close (state);
+    return NULL;
+  }
+
+  return state;
+}
+
+/* Queues data for the server. It goes out when the event loop next flushes
+ * the session. */
+void
+queue_output (STATE *state, const char *buf, int len)
+{
+  if (state->mirror)
+  {
+    /* The network thread sends it */
+    bridge_output (state->bridge, buf, len);
+    return;
+  }
+  if (state->watching)
+    return; /* only the player answers */
+  if (state->fd == -1)
+    return; /* not connected; the server will ask again */
+  if (state->recorder)
+    recorder_add (state->recorder, REC_OUT, buf, len);
+  totals.messages_out++;
+  totals.bytes_out += len;
+  outbuf_append (&state->out, buf, len);
+  loop_defer (state->loop, &state->flush);
+}
+
+void
+send_string (STATE *state, const char *buf)
+{
+  queue_output (state, buf, strlen (buf) + 1);
+}
+
+void
+send_string_fv (STATE *state, const char *fmt, va_list args)
+{
+  char buf[1024];
+
+  vsnprintf (buf, sizeof (buf), fmt, args);
+  buf[sizeof(buf) - 1] = '\0';
+  queue_output (state, buf, strlen (buf) + 1);
+}
+
+void
+send_string_f (STATE *state, const char *fmt, ...)
+{
+  va_list args;
+
+  va_start (args, fmt);
+  send_string_fv (state, fmt, args);
+  va_end (args);
+}
+
+void
+respondv (STATE *state, const char *fmt, va_list args)
+{
+  char buf[1024];
+
+  sprintf (buf, "%d", C_RESPONSE_PACKET);
+  vsnprintf (buf + 2, sizeof (buf) - 2, fmt, args);
+  log_trace (LOG_PROTO, "sending response: %s\n", buf);
+  queue_output (state, buf, strlen (buf + 2) + 3);
+}
+
+void
+respond (STATE *state, const char *fmt, ...)
+{
+  va_list args;
+
+  va_start (args, fmt);
+  respondv (state, fmt, args);
+  va_end (args);
+}
@@ -0,0 +1,586 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+/* Spectators. A publishing session passes every packet it gets from the
+ * server on to viewers connected to a Unix socket; a viewer is a session
+ * like any other, except that it reads from the socket and never answers,
+ * so it draws exactly what the player sees.
+ *
+ * Each packet is copied once, when it is complete, into a chain shared by
+ * all viewers, and each viewer keeps its own place in the chain. Packets
+ * are freed once every viewer has sent them. A viewer that joins, or that
+ * falls too far behind, is sent a snapshot instead: the latest of each
+ * packet that sets some state, the player list, the last few lines and
+ * the open dialog, after a reset packet. A slow viewer never holds up the
+ * session; it only misses what happened while it was stuck. */
+
+#include "phantcli.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+/* A viewer this many bytes behind is skipped forward */
+#define VIEWER_BACKLOG (1024 * 1024)
+
+/* Lines and chat messages kept for the snapshot */
+#define RECENT_LINES 32
+#define RECENT_CHAT 16
+
+/* Packets sent by one writev */
+#define WRITE_BATCH 64
+
+typedef struct pkt PKT;
+typedef struct viewer VIEWER;
+
+/* A packet from the server, as it arrived */
+struct pkt
+{
+  PKT *next;
+  int refs; /* viewers whose next packet this is */
+  int len;
+  char data[];
+};
+
+/* Copies of packets, for snapshots. The buffers are kept and reused, so
+ * that remembering a packet seldom allocates. */
+typedef struct
+{
+  char *data;
+  int len; /* 0 if nothing is saved */
+  int size;
+} SAVED;
+
+struct viewer
+{
+  PUBLISHER *pub;
+  WATCH watch;
+  PKT *rest; /* a packet to finish before the snapshot, if skipped */
+  int rest_off;
+  OUTBUF snap;
+  PKT *cur; /* next packet to send, or NULL when caught up */
+  int off; /* bytes of it already sent */
+  long backlog; /* bytes not yet sent */
+  VIEWER *next;
+};
+
+struct publisher
+{
+  STATE *state;
+  LOOP *loop;
+  char *path;
+  WATCH listen;
+  DEFER flush;
+  char *pkt; /* the packet being read */
+  int pkt_len;
+  int pkt_size;
+  PKT *head; /* oldest packet a viewer still needs */
+  PKT *tail;
+  VIEWER *viewers;
+  SAVED latest[MAX_PACKET_COUNT];
+  SAVED lines[RECENT_LINES];
+  int nlines;
+  SAVED chat[RECENT_CHAT];
+  int nchat;
+  long packets;
+  long skipped;
+};
+
+static void
+save (SAVED *saved, const char *data, int len)
+{
+  if (len > saved->size)
+  {
+    saved->size = len;
+    saved->data = (char *) realloc (saved->data, len);
+  }
+  memcpy (saved->data, data, len);
+  saved->len = len;
+}
+
+/* Adds to a list of the most recent packets of some kind */
+static void
+save_recent (SAVED *list, int *count, int max, const char *data, int len)
+{
+  if (*count == max)
+  {
+    SAVED oldest = list[0];
+
+    memmove (list, list + 1, (max - 1) * sizeof (SAVED));
+    list[max - 1] = oldest;
+    (*count)--;
+  }
+  save (&list[(*count)++], data, len);
+}
+
+static void
+forget_recent (SAVED *list, int *count)
+{
+  int i;
+
+  for (i = 0; i < *count; i++)
+    list[i].len = 0;
+  *count = 0;
+}
+
+static void
+free_saved (SAVED *list, int count)
+{
+  int i;
+
+  for (i = 0; i < count; i++)
+    free (list[i].data);
+}
+
+/* Keeps what a viewer joining later will need */
+static void
+remember (PUBLISHER *pub, int type, const char *data, int len)
+{
+  if (type == CLEAR_PACKET)
+    forget_recent (pub->lines, &pub->nlines);
+  else if (type == WRITE_LINE_PACKET)
+    save_recent (pub->lines, &pub->nlines, RECENT_LINES, data, len);
+  else if (type == CHAT_PACKET)
+    save_recent (pub->chat, &pub->nchat, RECENT_CHAT, data, len);
+  else if (type == ACTIVATE_CHAT_PACKET || type == DEACTIVATE_CHAT_PACKET)
+    save (&pub->latest[ACTIVATE_CHAT_PACKET], data, len);
+  else if (type >= BUTTONS_PACKET && type <= PASSWORD_DIALOG_PACKET)
+    save (&pub->latest[BUTTONS_PACKET], data, len);
+  else if (type >= NAME_PACKET && type != TIMED_PING_PACKET)
+    save (&pub->latest[type], data, len);
+}
+
+static void
+append_saved (OUTBUF *out, SAVED *saved)
+{
+  if (saved->len)
+    outbuf_append (out, saved->data, saved->len);
+}
+
+/* Writes what a viewer needs to catch up, as packets */
+static void
+snapshot (PUBLISHER *pub, OUTBUF *out)
+{
+  STATE *state = pub->state;
+  PLAYER *p;
+  char buf[64];
+  int i;
+
+  snprintf (buf, sizeof (buf), "%d\n%s\n", SPECTATE_RESET_PACKET, state->protocol->name);
+  outbuf_append (out, buf, strlen (buf));
+  for (i = NAME_PACKET; i < MAX_PACKET_COUNT; i++)
+    append_saved (out, &pub->latest[i]);
+  append_saved (out, &pub->latest[ACTIVATE_CHAT_PACKET]);
+  for (i = 0; i < state->roster.len; i++)
+  {
+    p = &state->roster.players[i];
+    if (!p->name)
+      continue;
+    snprintf (buf, sizeof (buf), "%d\n", ADD_PLAYER_PACKET);
+    outbuf_append (out, buf, strlen (buf));
+    outbuf_append (out, p->name, strlen (p->name));
+    outbuf_append (out, "\n", 1);
+    if (p->type)
+      outbuf_append (out, p->type, strlen (p->type));
+    outbuf_append (out, "\n", 1);
+  }
+  for (i = 0; i < pub->nlines; i++)
+    append_saved (out, &pub->lines[i]);
+  for (i = 0; i < pub->nchat; i++)
+    append_saved (out, &pub->chat[i]);
+  if (state->dialog_mode)
+    append_saved (out, &pub->latest[BUTTONS_PACKET]);
+}
+
+/* Frees packets that every viewer has sent */
+static void
+trim (PUBLISHER *pub)
+{
+  PKT *pkt;
+
+  while ((pkt = pub->head) && pkt->refs == 0)
+  {
+    pub->head = pkt->next;
+    if (!pub->head)
+      pub->tail = NULL;
+    free (pkt);
+  }
+}
+
+/* Moves v on from the packet it has just sent */
+static void
+advance (VIEWER *v)
+{
+  PKT *pkt = v->cur;
+
+  pkt->refs--;
+  v->cur = pkt->next;
+  v->off = 0;
+  if (v->cur)
+    v->cur->refs++;
+}
+
+/* Starts v over from a snapshot. Whatever it was in the middle of sending
+ * is finished first, so that it never gets half a packet. */
+static void
+restart (VIEWER *v)
+{
+  if (v->cur && v->off > 0)
+  {
+    v->rest = v->cur;
+    v->rest_off = v->off;
+    v->cur = v->cur->next;
+    if (v->cur)
+      v->cur->refs++;
+  }
+  while (v->cur)
+    advance (v);
+  snapshot (v->pub, &v->snap);
+  v->backlog = outbuf_pending (&v->snap) + (v->rest ? v->rest->len - v->rest_off : 0);
+}
+
+static void
+viewer_close (VIEWER *v)
+{
+  PUBLISHER *pub = v->pub;
+  VIEWER **p;
+
+  for (p = &pub->viewers; *p != v; p = &(*p)->next);
+  *p = v->next;
+  if (v->rest)
+    v->rest->refs--;
+  while (v->cur)
+    advance (v);
+  loop_remove_watch (pub->loop, &v->watch);
+  close (v->watch.fd);
+  outbuf_free (&v->snap);
+  free (v);
+  trim (pub);
+}
+
+/* Sends v as much as it will take. Returns -1 if the viewer has gone. */
+static int
+viewer_write (VIEWER *v)
+{
+  struct iovec iov[WRITE_BATCH];
+  PKT *pkt;
+  int n;
+  int res;
+
+  if (v->rest)
+  {
+    res = write (v->watch.fd, v->rest->data + v->rest_off, v->rest->len - v->rest_off);
+    if (res < 0)
+      return (errno == EAGAIN ? 0 : -1);
+    v->rest_off += res;
+    v->backlog -= res;
+    if (v->rest_off < v->rest->len)
+      return 0;
+    v->rest->refs--;
+    v->rest = NULL;
+  }
+
+  if (outbuf_pending (&v->snap) > 0)
+  {
+    n = outbuf_pending (&v->snap);
+    res = outbuf_flush (&v->snap, v->watch.fd);
+    if (res < 0)
+      return -1;
+    v->backlog -= n - outbuf_pending (&v->snap);
+    if (res == 0)
+      return 0;
+  }
+
+  while (v->cur)
+  {
+    n = 0;
+    for (pkt = v->cur; pkt && n < WRITE_BATCH; pkt = pkt->next)
+    {
+      iov[n].iov_base = pkt->data + (n == 0 ? v->off : 0);
+      iov[n].iov_len = pkt->len - (n == 0 ? v->off : 0);
+      n++;
+    }
+    res = writev (v->watch.fd, iov, n);
+    if (res < 0)
+      return (errno == EAGAIN ? 0 : -1);
+    v->backlog -= res;
+    while (v->cur && res >= v->cur->len - v->off)
+    {
+      res -= v->cur->len - v->off;
+      advance (v);
+    }
+    if (v->cur)
+    {
+      v->off += res;
+      return 0;
+    }
+  }
+  return 0;
+}
+
+static void
+viewer_flush (VIEWER *v)
+{
+  int res = viewer_write (v);
+
+  if (res < 0)
+  {
+    viewer_close (v);
+    return;
+  }
+  loop_modify_watch (v->pub->loop, &v->watch, (v->backlog > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN));
+}
+
+static void
+publisher_flush (LOOP *loop, DEFER *defer)
+{
+  PUBLISHER *pub = (PUBLISHER *) defer->data;
+  VIEWER *v;
+  VIEWER *next;
+
+  for (v = pub->viewers; v; v = next)
+  {
+    next = v->next;
+    viewer_flush (v);
+  }
+  trim (pub);
+}
+
+static void
+viewer_io (LOOP *loop, WATCH *watch, unsigned int events)
+{
+  VIEWER *v = (VIEWER *) watch->data;
+  char buf[256];
+
+  /* Viewers have nothing to say; anything readable means they've gone */
+  if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && read (watch->fd, buf, sizeof (buf)) <= 0)
+  {
+    viewer_close (v);
+    return;
+  }
+  if (events & EPOLLOUT)
+  {
+    viewer_flush (v);
+    trim (v->pub);
+  }
+}
+
+static void
+listen_io (LOOP *loop, WATCH *watch, unsigned int events)
+{
+  PUBLISHER *pub = (PUBLISHER *) watch->data;
+  VIEWER *v;
+  int fd;
+
+  while ((fd = accept (watch->fd, NULL, NULL)) != -1)
+  {
+    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+    fcntl (fd, F_SETFD, FD_CLOEXEC);
+    v = (VIEWER *) calloc (sizeof (VIEWER), 1);
+    v->pub = pub;
+    v->watch.fd = fd;
+    v->watch.events = EPOLLIN;
+    v->watch.func = viewer_io;
+    v->watch.data = v;
+    if (loop_add_watch (loop, &v->watch) < 0)
+    {
+      close (fd);
+      free (v);
+      continue;
+    }
+    v->next = pub->viewers;
+    pub->viewers = v;
+    restart (v);
+    log_info (LOG_SPECTATE, "viewer joined, %d bytes of snapshot\n", outbuf_pending (&v->snap));
+  }
+  loop_defer (loop, &pub->flush);
+}
+
+/* Publishes the session on a Unix socket at path */
+PUBLISHER *
+publisher_new (STATE *state, const char *path)
+{
+  PUBLISHER *pub;
+  struct sockaddr_un addr;
+  int fd;
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen (path) >= sizeof (addr.sun_path))
+  {
+    fprintf (stderr, "%s: path too long\n", path);
+    return NULL;
+  }
+  strcpy (addr.sun_path, path);
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+  {
+    perror ("socket");
+    return NULL;
+  }
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+  fcntl (fd, F_SETFD, FD_CLOEXEC);
+  unlink (path);
+  if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) == -1 || listen (fd, 16) == -1)
+  {
+    perror (path);
+    close (fd);
+    return NULL;
+  }
+
+  pub = (PUBLISHER *) calloc (sizeof (PUBLISHER), 1);
+  pub->state = state;
+  pub->loop = state->loop;
+  pub->path = strdup (path);
+  pub->flush.func = publisher_flush;
+  pub->flush.data = pub;
+  pub->listen.fd = fd;
+  pub->listen.events = EPOLLIN;
+  pub->listen.func = listen_io;
+  pub->listen.data = pub;
+  loop_add_watch (pub->loop, &pub->listen);
+  state->publisher = pub;
+  return pub;
+}
+
+void
+publisher_free (PUBLISHER *pub)
+{
+  if (!pub)
+    return;
+  log_info (LOG_SPECTATE, "published %ld packets, skipped viewers forward %ld times\n", pub->packets, pub->skipped);
+  while (pub->viewers)
+    viewer_close (pub->viewers);
+  trim (pub);
+  loop_cancel_defer (pub->loop, &pub->flush);
+  loop_remove_watch (pub->loop, &pub->listen);
+  close (pub->listen.fd);
+  unlink (pub->path);
+  free_saved (pub->latest, MAX_PACKET_COUNT);
+  free_saved (pub->lines, RECENT_LINES);
+  free_saved (pub->chat, RECENT_CHAT);
+  pub->state->publisher = NULL;
+  free (pub->path);
+  free (pub->pkt);
+  free (pub);
+}
+
+/* A line of the packet being read. start is TRUE for its first line. */
+void
+publisher_line (PUBLISHER *pub, const char *line, int len, pbool start)
+{
+  if (start)
+    pub->pkt_len = 0;
+  if (pub->pkt_len + len + 1 > pub->pkt_size)
+  {
+    pub->pkt_size = (pub->pkt_len + len + 1) * 2;
+    pub->pkt = (char *) realloc (pub->pkt, pub->pkt_size);
+  }
+  memcpy (pub->pkt + pub->pkt_len, line, len);
+  pub->pkt[pub->pkt_len + len] = '\n';
+  pub->pkt_len += len + 1;
+}
+
+/* The packet is complete, and was of the given type, or 0 if it was bad
+ * and should not be passed on */
+void
+publisher_commit (PUBLISHER *pub, int type)
+{
+  PKT *pkt;
+  VIEWER *v;
+  VIEWER *next;
+
+  if (type <= 0 || pub->pkt_len == 0)
+  {
+    pub->pkt_len = 0;
+    return;
+  }
+  remember (pub, type, pub->pkt, pub->pkt_len);
+  pub->packets++;
+  if (!pub->viewers)
+  {
+    pub->pkt_len = 0;
+    return;
+  }
+
+  pkt = (PKT *) malloc (sizeof (PKT) + pub->pkt_len);
+  pkt->next = NULL;
+  pkt->refs = 0;
+  pkt->len = pub->pkt_len;
+  memcpy (pkt->data, pub->pkt, pub->pkt_len);
+  pub->pkt_len = 0;
+  if (pub->tail)
+    pub->tail->next = pkt;
+  else
+    pub->head = pkt;
+  pub->tail = pkt;
+
+  for (v = pub->viewers; v; v = next)
+  {
+    next = v->next;
+    if (!v->cur)
+    {
+      v->cur = pkt;
+      pkt->refs++;
+    }
+    v->backlog += pkt->len;
+    if (v->backlog <= VIEWER_BACKLOG)
+      continue;
+    if (outbuf_pending (&v->snap) > 0)
+    {
+      /* It hasn't even taken its last snapshot; give up on it */
+      log_info (LOG_SPECTATE, "dropping a viewer that is stuck\n");
+      viewer_close (v);
+      continue;
+    }
+    pub->skipped++;
+    restart (v);
+  }
+  trim (pub);
+  loop_defer (pub->loop, &pub->flush);
+}
+
+/* Connects to a publishing session, for -W */
+int
+spectate_connect (const char *path)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strncpy (addr.sun_path, path, sizeof (addr.sun_path) - 1);
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1 || connect (fd, (struct sockaddr *) &addr, sizeof (addr)) == -1)
+  {
+    perror (path);
+    if (fd != -1)
+      close (fd);
+    return -1;
+  }
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+  fcntl (fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+}
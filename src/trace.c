@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+/* Packet tracing. Each packet a session parses becomes one complete event
+ * in a Chrome trace-event JSON file, which chrome://tracing, Perfetto and
+ * speedscope can open. The event starts when the packet's first line
+ * arrived and lasts as long as its handlers ran, in total, so the viewers'
+ * summaries by name show which packet types cost the most. Its arguments
+ * give the lines it took, the time in handlers and in the ui_ calls they
+ * made, and how long the packet took to arrive in full. Each session is a
+ * thread in the trace.
+ *
+ * Everything here runs on the thread that runs the sessions. */
+
+#include "phantcli.h"
+
+#include <stdio.h>
+
+FILE *trace_fp;
+static unsigned long long trace_start;
+static long trace_events;
+
+/* Returns 0, or -1 if the file can't be written */
+int
+trace_open (const char *path)
+{
+  trace_fp = fopen (path, "w");
+  if (!trace_fp)
+    return -1;
+  setvbuf (trace_fp, NULL, _IOFBF, 65536);
+  fputs ("[", trace_fp);
+  trace_start = loop_now_ns ();
+  return 0;
+}
+
+void
+trace_close ()
+{
+  if (!trace_fp)
+    return;
+  fputs ("\n]\n", trace_fp);
+  fclose (trace_fp);
+  trace_fp = NULL;
+}
+
+static void
+write_event (STATE *state, unsigned long long end, pbool bad)
+{
+  const char *name = state->protocol->packets[state->cur_packet].name;
+
+  fprintf (trace_fp, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"lines\":%d,\"handler_us\":%.3f,\"ui_us\":%.3f,\"arrival_us\":%.3f}}",
+           (trace_events ? "," : ""),
+           (name ? name : "unknown"), (bad ? "bad" : "packet"), state->id,
+           (state->trace.arrived_ns - trace_start) / 1e3, state->trace.handler_ns / 1e3,
+           state->trace.lines, state->trace.handler_ns / 1e3, state->trace.ui_ns / 1e3,
+           (end - state->trace.arrived_ns) / 1e3);
+  trace_events++;
+}
+
+/* Called before a line is handed to the session's handler. Returns the
+ * time to pass on to trace_line_end. */
+unsigned long long
+trace_line_begin (STATE *state)
+{
+  if (!state->trace.lines)
+    state->trace.arrived_ns = state->latency.read_ns;
+  state->trace.in_handler = TRUE;
+  return loop_now_ns ();
+}
+
+/* Called with what the handler returned. When the packet is over, writes
+ * its event. */
+void
+trace_line_end (STATE *state, unsigned long long begin, int res)
+{
+  unsigned long long now = loop_now_ns ();
+
+  state->trace.in_handler = FALSE;
+  state->trace.handler_ns += now - begin;
+  state->trace.lines++;
+  if (res > 0)
+    return;
+  write_event (state, now, res < 0);
+  state->trace.handler_ns = 0;
+  state->trace.ui_ns = 0;
+  state->trace.lines = 0;
+}
+
+/* Around each call into the front end. Only calls made by handlers are
+ * timed, and calls the front end makes back into the ui_ functions are
+ * counted once. */
+unsigned long long
+trace_ui_begin (STATE *state)
+{
+  if (!state->trace.in_handler || state->trace.in_ui)
+    return 0;
+  state->trace.in_ui = TRUE;
+  return loop_now_ns ();
+}
+
+void
+trace_ui_end (STATE *state, unsigned long long begin)
+{
+  if (!begin)
+    return;
+  state->trace.ui_ns += loop_now_ns () - begin;
+  state->trace.in_ui = FALSE;
+}
@@ -16,6 +16,7 @@
  */
 
 #include "phantcli.h"
+#include "history.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -23,6 +24,7 @@
 #include <ncurses.h>
 #include <termios.h>
 #include <ctype.h>
+#include <sys/epoll.h>
 
 typedef struct
 {
@@ -32,7 +34,33 @@ typedef struct
   int data_col;
 } STAT;
 
+/* A screen row of special text, once wrapped */
+typedef struct
+{
+  int start; /* in special_text */
+  int len;
+} PAGER_ROW;
+
 #define MSGROWS 6
+#define MSGLINES 10000 /* kept for scrolling back */
+
+/* What sequence_key makes of the keys' escape sequences */
+#define PAGE_UP_KEY 0x1b5b357e /* ESC [ 5 ~ */
+#define PAGE_DOWN_KEY 0x1b5b367e
+#define UP_KEY 0x1b5b41 /* ESC [ A */
+#define DOWN_KEY 0x1b5b42
+
+#define ESC_MS 50 /* how long a lone ESC waits to see if a sequence follows */
+
+/* The windows, in the order a frame copies them out (see draw_frame) */
+#define WIN_LOC 0
+#define WIN_MSG 1
+#define WIN_STATUS 2
+#define WIN_DLG 3
+#define WIN_STAT 4
+#define WIN_CHAT 5
+#define WIN_CHATRESP 6
+#define NWINDOWS 7
 
 typedef struct UI UI;
 struct UI
@@ -45,47 +73,422 @@ struct UI
   WINDOW *statwin;
   WINDOW *chatwin;
   WINDOW *chatrespwin;
+  WINDOW *statuswin;
   char kbuf[256];
   int kbufpos;
   char chatkbuf[256];
   int chatkbufpos;
   int inpline;
-  char *msglin[MSGROWS];
-  int msgpos;
+  char *msgtext; /* the last MSGLINES lines, ncols + 1 bytes each, as a ring */
+  long msgcount; /* lines written */
+  long msgtop; /* msgcount when the window was last cleared */
+  int msgpending; /* lines not drawn yet */
+  long msgend; /* scrolled back: the line after the last one shown; 0 to follow */
+  HISTORY chat; /* every chat message, shown or not */
+  int chatpending; /* messages not drawn yet */
+  long chatscroll; /* messages scrolled back from the bottom */
+  long msglines; /* written in all, and drawn; the rest scrolled away unseen */
+  long msgdrawn;
   int chatmode;
-  char **special_text;
+  char *special_text; /* posted lines, each NUL-terminated, end to end */
+  int special_text_used;
   int special_text_size;
-  int special_text_len;
-  int special_text_pos;
+  int *special_lines; /* where each line starts in special_text */
+  int special_lines_len;
+  int pager_lines; /* of those, the ones the open pager shows; the rest wait */
+  pbool special_done; /* the waiting ones were all posted */
+  int special_lines_size;
+  WINDOW *pagerwin; /* shows the special text over everything else */
+  PAGER_ROW *rows; /* special_lines wrapped so far, to rows_width */
+  int rows_len;
+  int rows_size;
+  int rows_lines; /* special lines wrapped */
+  int rows_width;
+  int pager_top; /* first row shown */
+  char search[64]; /* what to look for, with / */
+  int search_len;
+  pbool searching; /* typing it */
+  pbool repaint; /* everything, now that the pager is gone */
   pbool is_class_dlg;
   int class;
+  WATCH input; /* the terminal */
+  unsigned char esc[16]; /* an escape sequence read so far */
+  int esc_len; /* bytes in it, including any that didn't fit */
+  TIMER esc_timer; /* makes a lone ESC the escape key */
+  pbool pasting; /* between the terminal's bracketed paste markers */
+  char paste[256]; /* pasted text not inserted yet */
+  int paste_len;
+  STAT stats[MAX_PACKET_COUNT];
+  const PROTOCOL *layout; /* whose stats are laid out */
+  unsigned int dirty; /* 1 << WIN_ for each window changed since the last frame */
+  int cursor; /* the WIN_ that was drawn in last, which gets the cursor */
+  DEFER render; /* draws a frame once this pass through the loop is over */
+  TIMER frame_timer; /* or once it's time for one, if term_fps is set */
+  unsigned long long last_frame; /* loop_now () */
+  long frames;
+  long marks; /* mark_dirty calls, ie what used to be a refresh each */
+  unsigned long long io_start[2]; /* the thread's wchar and syscw at init */
 };
 
-static STAT stats[MAX_PACKET_COUNT];
+int term_fps = 60;
+
+static void term_teardown (STATE *state);
+static void term_update_stat (STATE *state, int packet);
+static void term_get_key (STATE *state);
+static void show_roster (STATE *state);
+static void scroll_chat (STATE *state, int pages);
+static void handle_key (STATE *state, int ch);
+
+static void
+input_io (LOOP *loop, WATCH *watch, unsigned int events)
+{
+  term_get_key ((STATE *) watch->data);
+}
+
+/* Nothing followed an ESC, so it was the key itself. The start of a longer
+ * sequence that never ended is dropped. */
+static void
+esc_timeout (LOOP *loop, TIMER *timer)
+{
+  STATE *state = (STATE *) timer->data;
+  int len = state->ui->esc_len;
+
+  state->ui->esc_len = 0;
+  if (len == 1 && !state->ui->pasting)
+    handle_key (state, 27);
+}
+
+static WINDOW *
+get_window (UI *ui, int which)
+{
+  switch (which)
+  {
+  case WIN_LOC:
+    return ui->locwin;
+  case WIN_MSG:
+    return ui->msgwin;
+  case WIN_STATUS:
+    return ui->statuswin;
+  case WIN_DLG:
+    return ui->dlgwin;
+  case WIN_STAT:
+    return ui->statwin;
+  case WIN_CHAT:
+    return ui->chatwin;
+  default:
+    return ui->chatrespwin;
+  }
+}
+
+static char *
+msg_line (UI *ui, long n)
+{
+  return ui->msgtext + (n % MSGLINES) * (ui->ncols + 1);
+}
+
+/* The first line that is still kept */
+static long
+oldest_message (UI *ui)
+{
+  return (ui->msgcount > MSGLINES ? ui->msgcount - MSGLINES : 0);
+}
+
+/* The first line shown at the bottom, where the window was last cleared
+ * if that was recent */
+static long
+bottom_message (UI *ui)
+{
+  long start = ui->msgcount - (MSGROWS - 1);
+
+  return (start > ui->msgtop ? start : ui->msgtop);
+}
+
+/* The first line shown when scrolled back to end */
+static long
+scrolled_message (UI *ui, long end)
+{
+  long start = end - (MSGROWS - 1);
+
+  return (start > oldest_message (ui) ? start : oldest_message (ui));
+}
+
+/* Draws the message window from scratch. At the bottom, that's the lines
+ * since the last clear, as many as fit, with the cursor on the row after
+ * them; scrolled back, it's older lines, clear or no clear, and a note of
+ * how many follow. */
+static void
+draw_messages (STATE *state)
+{
+  UI *ui = state->ui;
+  long end = (ui->msgend ? ui->msgend : ui->msgcount);
+  long start = (ui->msgend ? scrolled_message (ui, end) : bottom_message (ui));
+  int rows = end - start;
+  int i;
+
+  werase (ui->msgwin);
+  for (i = 0; i < rows; i++)
+    mvwaddstr (ui->msgwin, i, 0, msg_line (ui, start + i));
+  if (ui->msgend)
+  {
+    wattron (ui->msgwin, A_REVERSE);
+    if (ui->msgend < ui->msgcount)
+      mvwprintw (ui->msgwin, MSGROWS - 1, 0, "-- %ld more lines (PgDn) --", ui->msgcount - ui->msgend);
+    else
+      mvwprintw (ui->msgwin, MSGROWS - 1, 0, "-- since cleared (PgDn) --");
+    wattroff (ui->msgwin, A_REVERSE);
+    return;
+  }
+  wmove (ui->msgwin, rows, 0);
+  ui->msgdrawn += (ui->msgpending < rows ? ui->msgpending : rows);
+  ui->msgpending = 0;
+}
+
+/* Draws the lines written since the last frame. When there are enough of
+ * them to scroll the window over, only the ones that end up on it are. */
+static void
+flush_messages (STATE *state)
+{
+  UI *ui = state->ui;
+  long i;
+  int len;
+
+  if (!ui->msgpending || ui->msgend)
+    return;
+  if (ui->msgpending >= MSGROWS - 1)
+  {
+    draw_messages (state);
+    return;
+  }
+  for (i = ui->msgcount - ui->msgpending; i < ui->msgcount; i++)
+  {
+    len = strlen (msg_line (ui, i));
+    waddstr (ui->msgwin, msg_line (ui, i));
+    if (len < ui->ncols)
+      waddch (ui->msgwin, '\n'); /* a full line already moved on */
+  }
+  ui->msgdrawn += ui->msgpending;
+  ui->msgpending = 0;
+}
+
+/* Rows a chat message takes up, wrapped */
+static int
+chat_rows (UI *ui, const char *message)
+{
+  int len = strlen (message);
+
+  return (len ? (len + ui->ncols - 1) / ui->ncols : 1);
+}
+
+static void
+add_chat_line (UI *ui, const char *message)
+{
+  int len = strlen (message);
+
+  waddstr (ui->chatwin, message);
+  if (len % ui->ncols || !len)
+    waddch (ui->chatwin, '\n'); /* a full row already moved on */
+}
+
+/* Draws the chat window from scratch: the messages that fit, ending with
+ * the newest unless scrolled back. The last row is kept for the next
+ * message, or a note of how many follow. */
+static void
+draw_chat (STATE *state)
+{
+  UI *ui = state->ui;
+  int rows = getmaxy (ui->chatwin) - 1;
+  long end = ui->chat.count - ui->chatscroll;
+  long first = end;
+  int used = 0;
+  int h;
+
+  while (first > 0 && used + (h = chat_rows (ui, history_get (&ui->chat, first - 1))) <= rows)
+  {
+    used += h;
+    first--;
+  }
+  werase (ui->chatwin);
+  for (; first < end; first++)
+    add_chat_line (ui, history_get (&ui->chat, first));
+  if (ui->chatscroll)
+  {
+    wattron (ui->chatwin, A_REVERSE);
+    mvwprintw (ui->chatwin, rows, 0, "-- %ld more messages (PgDn) --", ui->chatscroll);
+    wattroff (ui->chatwin, A_REVERSE);
+  }
+  ui->chatpending = 0;
+}
+
+/* As flush_messages, for chat */
+static void
+flush_chat (STATE *state)
+{
+  UI *ui = state->ui;
+  long i;
+
+  if (!ui->chatpending || ui->chatscroll || !ui->chatwin)
+    return;
+  if (ui->chatpending >= getmaxy (ui->chatwin) - 1)
+  {
+    draw_chat (state);
+    return;
+  }
+  for (i = ui->chat.count - ui->chatpending; i < ui->chat.count; i++)
+    add_chat_line (ui, history_get (&ui->chat, i));
+  ui->chatpending = 0;
+}
+
+/* Copies the changed windows to the screen with one doupdate, leaving the
+ * cursor where the last of them was drawn in */
+static void
+draw_frame (STATE *state)
+{
+  UI *ui = state->ui;
+  WINDOW *win;
+  int i;
+
+  flush_messages (state);
+  flush_chat (state);
+
+  if (ui->pagerwin)
+  {
+    /* It covers everything, so the rest wait until it closes */
+    wnoutrefresh (ui->pagerwin);
+    doupdate ();
+    ui->frames++;
+    ui->last_frame = loop_now ();
+    return;
+  }
+
+  if (ui->repaint)
+  {
+    touchwin (stdscr);
+    wnoutrefresh (stdscr);
+  }
+  for (i = 0; i < NWINDOWS; i++)
+  {
+    win = get_window (ui, i);
+    if (!win || i == ui->cursor || !(ui->repaint || (ui->dirty & (1 << i))))
+      continue;
+    if (ui->repaint)
+      touchwin (win);
+    wnoutrefresh (win);
+  }
+  win = get_window (ui, ui->cursor);
+  if (win)
+  {
+    if (ui->repaint)
+      touchwin (win);
+    wnoutrefresh (win);
+  }
+  doupdate ();
+  ui->dirty = 0;
+  ui->repaint = FALSE;
+  ui->frames++;
+  ui->last_frame = loop_now ();
+}
+
+static void
+frame_timeout (LOOP *loop, TIMER *timer)
+{
+  draw_frame ((STATE *) timer->data);
+}
+
+/* Runs after everything that came in with this pass through the loop has
+ * been drawn into the windows. Frames come no closer than 1/term_fps of a
+ * second apart; changes in between wait for the next. */
+static void
+render (LOOP *loop, DEFER *defer)
+{
+  STATE *state = (STATE *) defer->data;
+  UI *ui = state->ui;
+  unsigned long long next;
+
+  if (term_fps > 0)
+  {
+    next = ui->last_frame + 1000 / term_fps;
+    if (next > loop_now ())
+    {
+      loop_add_timer (loop, &ui->frame_timer, next - loop_now ());
+      return;
+    }
+  }
+  draw_frame (state);
+}
+
+static void
+request_frame (STATE *state)
+{
+  if (!state->ui->frame_timer.index)
+    loop_defer (state->loop, &state->ui->render);
+}
+
+/* Called in place of wrefresh: the window is copied out with the next
+ * frame, and as with wrefresh, the last window drawn in gets the cursor */
+static void
+mark_dirty (STATE *state, WINDOW *win)
+{
+  UI *ui = state->ui;
+  int i;
 
+  for (i = 0; i < NWINDOWS && get_window (ui, i) != win; i++);
+  if (i == NWINDOWS)
+    return;
+  ui->dirty |= 1 << i;
+  ui->cursor = i;
+  ui->marks++;
+  request_frame (state);
+}
+
+/* What this thread has written so far, and in how many syscalls. The UI
+ * thread writes little but the terminal. */
 static void
-add_stat (STATE *state, int index, const char *label)
+get_thread_io (unsigned long long *io)
 {
-  static int row = 0, col = 0;
+  FILE *fp = fopen ("/proc/thread-self/io", "r");
+  char line[64];
 
-  if (row >= 8)
-    return; /* no room for it */
+  io[0] = io[1] = 0;
+  if (!fp)
+    return;
+  while (fgets (line, sizeof (line), fp))
+  {
+    sscanf (line, "wchar: %llu", &io[0]);
+    sscanf (line, "syscw: %llu", &io[1]);
+  }
+  fclose (fp);
+}
 
-  stats[index].label = label;
-  stats[index].row = row;
-  stats[index].label_col = col * 40;
-  stats[index].data_col = stats[index].label_col + 15;
+/* Places the stats that the server's version has, as many as fit */
+static void
+lay_out_stats (STATE *state)
+{
+  STAT *stats = state->ui->stats;
+  int row = 0, col = 0;
+  int i;
 
-  col++;
-  if (col >= state->ui->ncols / 40)
+  memset (stats, 0, sizeof (state->ui->stats));
+  state->ui->layout = state->protocol;
+  for (i = 0; i < MAX_PACKET_COUNT && row < 8; i++)
   {
-    row++;
-    col = 0;
+    if (!state->protocol->packets[i].label)
+      continue;
+    stats[i].label = state->protocol->packets[i].label;
+    stats[i].row = row;
+    stats[i].label_col = col * 40;
+    stats[i].data_col = stats[i].label_col + 15;
+
+    col++;
+    if (col >= state->ui->ncols / 40)
+    {
+      row++;
+      col = 0;
+    }
   }
 }
 
-void
-ui_init (STATE *state)
+static void
+term_init (STATE *state)
 {
   struct termios tty;
 
@@ -100,36 +503,34 @@ ui_init (STATE *state)
 #endif
   state->ui->nrows = getmaxy (stdscr);
   state->ui->ncols = getmaxx (stdscr);
+  state->ui->msgtext = (char *) calloc (MSGLINES, state->ui->ncols + 1);
+
+  lay_out_stats (state);
 
-  add_stat (state, ENERGY_PACKET, "Energy");
-  add_stat (state, STRENGTH_PACKET, "Strength");
-  add_stat (state, SPEED_PACKET, "Speed");
-  add_stat (state, SHIELD_PACKET, "Shield");
-  add_stat (state, SWORD_PACKET, "Sword");
-  add_stat (state, QUICKSILVER_PACKET, "Quicksilver");
-  add_stat (state, MANA_PACKET, "Mana");
-  add_stat (state, LEVEL_PACKET, "Level");
-  add_stat (state, GOLD_PACKET, "Gold");
-  add_stat (state, GEMS_PACKET, "Gems");
-  add_stat (state, CLOAK_PACKET, "Cloak");
-  add_stat (state, BLESSING_PACKET, "Blessing");
-  add_stat (state, CROWN_PACKET, "Crowns");
-  add_stat (state, PALANTIR_PACKET, "Palantir");
-  add_stat (state, RING_PACKET, "Ring");
-  add_stat (state, VIRGIN_PACKET, "Virgin");
-#ifdef PHANT5
-  add_stat (state, AMULETS_PACKET, "Amulets");
-  add_stat (state, CHARMS_PACKET, "Charms");
-  add_stat (state, TOKENS_PACKET, "Tokens");
-#endif
-  
 	clear();
 	refresh();
+  fputs ("\033[?2004h", stdout); /* so pastes come bracketed */
+  fflush (stdout);
   state->ui->msgwin = newwin (MSGROWS, state->ui->ncols, 1, 0);
   scrollok (state->ui->msgwin, TRUE);
   idlok (state->ui->msgwin, TRUE);
   state->ui->dlgwin = newwin (2, state->ui->ncols, MSGROWS + 3, 0);
   state->ui->locwin = newwin (1, state->ui->ncols, 0, 0);
+  state->ui->statuswin = newwin (1, state->ui->ncols, MSGROWS + 1, 0);
+
+  state->ui->input.fd = 0;
+  state->ui->input.events = EPOLLIN;
+  state->ui->input.func = input_io;
+  state->ui->input.data = state;
+  loop_add_watch (state->loop, &state->ui->input);
+
+  state->ui->render.func = render;
+  state->ui->render.data = state;
+  state->ui->frame_timer.func = frame_timeout;
+  state->ui->frame_timer.data = state;
+  state->ui->esc_timer.func = esc_timeout;
+  state->ui->esc_timer.data = state;
+  get_thread_io (state->ui->io_start);
 }
 
 /* Moves the cursor to where it should be, if necessary. This is needed when
@@ -141,25 +542,30 @@ fix_cursor (STATE *state)
   if (state->ui->chatmode)
   {
     wmove (state->ui->chatrespwin, 0, state->ui->chatkbufpos);
-    wrefresh (state->ui->chatrespwin);
+    mark_dirty (state, state->ui->chatrespwin);
   }
   else if (state->dialog_mode == STRING_DIALOG_PACKET || state->dialog_mode == COORDINATES_DIALOG_PACKET || state->dialog_mode == PLAYER_DIALOG_PACKET || state->dialog_mode == PASSWORD_DIALOG_PACKET)
   {
     wmove (state->ui->msgwin, state->ui->inpline, state->ui->kbufpos);
-    wrefresh (state->ui->msgwin);
+    mark_dirty (state, state->ui->msgwin);
   }
   else if (state->dialog_mode == BUTTONS_PACKET || state->dialog_mode == FULL_BUTTONS_PACKET)
   {
     wmove (state->ui->dlgwin, 0, 0);
-    wrefresh (state->ui->dlgwin);
+    mark_dirty (state, state->ui->dlgwin);
   }
 }
 
-void
-ui_writeline (STATE *state, const char *buf)
+/* Lines go into msgtext, and are drawn with the next frame (see
+ * flush_messages), so that a burst costs little more than copying it */
+static void
+term_writeline (STATE *state, const char *buf)
 {
   int curpos = 0, count;
-  int i;
+  char *line;
+
+  if (!state->ui)
+    return;
 
   while (buf[curpos])
   {
@@ -172,25 +578,17 @@ ui_writeline (STATE *state, const char *buf)
       if (!count)
         count = state->ui->ncols;
     }
-    if (!state->ui->special_text_pos)
-    {
-      waddnstr (state->ui->msgwin, buf + curpos, count);
-      waddch (state->ui->msgwin, '\n');
-    }
-    if (state->ui->msgpos == MSGROWS)
-    {
-      free (state->ui->msglin[0]);
-      for (i = 0; i < MSGROWS - 1; i++)
-        state->ui->msglin[i] = state->ui->msglin[i + 1];
-      state->ui->msgpos--;
-    }
-    state->ui->msglin[state->ui->msgpos] = (char *) malloc(count + 1);
-    memcpy (state->ui->msglin[state->ui->msgpos], buf + curpos, count);
-    state->ui->msglin[state->ui->msgpos][count] = '\0';
+    line = msg_line (state->ui, state->ui->msgcount++);
+    memcpy (line, buf + curpos, count);
+    line[count] = '\0';
     curpos += count;
-    state->ui->msgpos++;
+    state->ui->msgpending++;
+    state->ui->msglines++;
+    /* Scrolled back, the same lines stay in view while they last */
+    if (state->ui->msgend && state->ui->msgend - (MSGROWS - 1) < oldest_message (state->ui))
+      state->ui->msgend = oldest_message (state->ui) + (MSGROWS - 1);
   }
-  wrefresh (state->ui->msgwin);
+  mark_dirty (state, state->ui->msgwin);
 }
 
 static int
@@ -227,15 +625,15 @@ do_reroll (STATE *state)
   }
 }
 
-void
-ui_present_dialog (STATE *state)
+static void
+term_present_dialog (STATE *state)
 {
   char buf[256];
   int i;
   int curcol = 0;
   int len;
 
-  if (state->ui->special_text_pos > 0)
+  if (!state->ui)
     return;
 
   werase (state->ui->dlgwin);
@@ -246,7 +644,7 @@ ui_present_dialog (STATE *state)
   {
     sprintf (buf, "--%s--", state->buttons[0]);
     waddstr (state->ui->dlgwin, buf);
-    wrefresh (state->ui->dlgwin);
+    mark_dirty (state, state->ui->dlgwin);
     return;
   }
 
@@ -278,18 +676,22 @@ ui_present_dialog (STATE *state)
     }
   }
   waddstr (state->ui->dlgwin, "> ");
-  wrefresh (state->ui->dlgwin);
+  mark_dirty (state, state->ui->dlgwin);
 }
 
-void
-ui_present_string_dialog (STATE *state, const char *buf)
+static void
+term_present_string_dialog (STATE *state, const char *buf)
 {
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-but-set-variable"
   int x;
 #pragma GCC diagnostic pop
 
-  ui_writeline (state, buf);
+  if (!state->ui)
+    return;
+
+  term_writeline (state, buf);
+  flush_messages (state); /* so that the cursor is where the answer goes */
   state->ui->kbufpos = 0;
   memset (state->ui->kbuf, 0, sizeof (state->ui->kbuf));
   getyx (state->ui->msgwin, state->ui->inpline, x);
@@ -301,7 +703,7 @@ end_dialog (STATE *state, const char *fmt, ...)
   va_list args;
   int x, y;
 
-  dlog ("end_dialog: %s\n", fmt);
+  log_debug (LOG_UI, "end_dialog: %s\n", fmt);
   va_start (args, fmt);
   if (state->dialog_mode == COORDINATES_DIALOG_PACKET)
   {
@@ -309,7 +711,7 @@ end_dialog (STATE *state, const char *fmt, ...)
     buf = va_arg (args, char *);
     if (sscanf (buf, "%d %d", &x, &y) != 2)
     {
-      ui_writeline (state, "Must enter x y coordinates");
+      term_writeline (state, "Must enter x y coordinates");
     }
     else
     {
@@ -323,26 +725,42 @@ end_dialog (STATE *state, const char *fmt, ...)
   if (state->dialog_mode == BUTTONS_PACKET)
   {
     werase (state->ui->dlgwin);
-    wrefresh (state->ui->dlgwin);
+    mark_dirty (state, state->ui->dlgwin);
   }
   state->dialog_mode = 0;
 }
 
-static int
-getkey (const char *buf, int size)
+/* Inserts text at *bufpos, as much as fits, and draws it once */
+static void
+insert_text (STATE *state, WINDOW *win, int top, char *buf, int *bufpos, int bufsize, int password, const char *text, int len)
 {
-  int key;
-  const unsigned char *ubuf = (const unsigned char *)buf;
-
-  key = (int) ubuf[0];
-  if (size > 1)
-    key = (key << 8) + ubuf[1];
-  if (size > 2)
-    key = (key << 8) + ubuf[2];
-  if (size > 3)
-    key = (key << 8) + ubuf[3];
+  int pos = *bufpos;
+  int tail;
+  int row, col;
+  int i;
 
-  return key;
+  if (len > bufsize - 1 - pos)
+    len = bufsize - 1 - pos;
+  if (len <= 0)
+    return;
+  tail = strlen (buf + pos);
+  if (tail > bufsize - 1 - pos - len)
+    tail = bufsize - 1 - pos - len;
+  memmove (buf + pos + len, buf + pos, tail);
+  buf[pos + len + tail] = '\0';
+  memcpy (buf + pos, text, len);
+  row = pos / state->ui->ncols;
+  col = pos % state->ui->ncols;
+  if (password)
+  {
+    wmove (win, row + top, col);
+    for (i = 0; i < len; i++)
+      waddch (win, '*');
+  }
+  else
+    mvwaddstr (win, row + top, col, buf + pos);
+  *bufpos = pos + len;
+  mark_dirty (state, win);
 }
 
 static void
@@ -369,25 +787,16 @@ add_key (STATE *state, WINDOW *win, int top, char *buf, int *bufpos, int bufsize
       col2 = end % state->ui->ncols;
       mvwaddch (win, row2 + top, col2, ' ');
       wmove (win, row + top, col);
-      wrefresh (win);
+      mark_dirty (state, win);
     }
     break;
   default:
-    if (pos < bufsize - 1)
     {
-      memmove (buf + pos + 1, buf + pos, strlen (buf + pos));
-      buf[bufsize - 1] = '\0';
+      char c = ch;
+
+      insert_text (state, win, top, buf, bufpos, bufsize, password, &c, 1);
     }
-    buf[pos] = ch;
-    row = pos / state->ui->ncols;
-    col = pos% state->ui->ncols;
-    if (password)
-      mvwaddch (win, row + top, col, '*');
-    else
-      mvwaddstr (win, row + top, col, buf + pos);
-    pos++;
-    wrefresh (win);
-    break;
+    return;
   }
   *bufpos = pos;
 }
@@ -439,6 +848,9 @@ handle_key_for_dialog (STATE *state, int ch)
     case 'n':
       end_dialog (state, "16");
       break;
+    case 'w':
+      show_roster (state);
+      break;
   }
   /* fall through to next case */
   case BUTTONS_PACKET:
@@ -475,7 +887,6 @@ handle_key_for_dialog (STATE *state, int ch)
 static void
 handle_key_for_chat (STATE *state, int ch)
 {
-  /* TODO: Support scrolling via pgup/pgdn */
   if (ch > 0x7f)
     return;
 
@@ -490,7 +901,8 @@ handle_key_for_chat (STATE *state, int ch)
       state->ui->chatkbufpos = 0;
       memset (state->ui->chatkbuf, 0, sizeof (state->ui->chatkbuf));
       werase (state->ui->chatrespwin);
-      wrefresh (state->ui->chatrespwin);
+      mark_dirty (state, state->ui->chatrespwin);
+      scroll_chat (state, 0); /* to see the answers */
     }
     break;
   default:
@@ -501,66 +913,432 @@ handle_key_for_chat (STATE *state, int ch)
 static void
 redraw_msgwin (STATE *state)
 {
+  draw_messages (state);
+  mark_dirty (state, state->ui->msgwin);
+}
+
+/* Moves the message window pages back (or forward, if negative) through
+ * the lines kept; 0 goes back to the bottom. The first page back from the
+ * bottom ends where the bottom's first line is, so after a clear it starts
+ * with what was cleared. */
+static void
+scroll_messages (STATE *state, int pages)
+{
+  UI *ui = state->ui;
+  long end = 0;
+
+  if (pages < 0 && !ui->msgend)
+    return; /* already at the bottom */
+  if (pages)
+  {
+    end = (ui->msgend ? ui->msgend : bottom_message (ui) + (MSGROWS - 1)) - pages * (MSGROWS - 1);
+    if (end < oldest_message (ui) + (MSGROWS - 1))
+      end = oldest_message (ui) + (MSGROWS - 1);
+    if (end > ui->msgcount)
+      end = ui->msgcount;
+    if (end == ui->msgcount && (pages < 0 || scrolled_message (ui, end) >= bottom_message (ui)))
+      end = 0; /* no further than the bottom */
+  }
+  if (end == ui->msgend)
+    return;
+  ui->msgend = end;
+  redraw_msgwin (state);
+}
+
+static const char *
+special_line (UI *ui, int n)
+{
+  return ui->special_text + ui->special_lines[n];
+}
+
+/* Wraps special lines until there are at least n rows, or no lines left.
+ * Rows are kept, so each line is wrapped once for a given width. Returns
+ * the number of rows there are. */
+static int
+wrap_rows (UI *ui, int n)
+{
+  const char *line;
+  int start, len, count;
+
+  if (ui->rows_width != ui->ncols)
+  {
+    ui->rows_len = ui->rows_lines = 0;
+    ui->rows_width = ui->ncols;
+  }
+  while (ui->rows_len < n && ui->rows_lines < ui->pager_lines)
+  {
+    line = special_line (ui, ui->rows_lines);
+    start = ui->special_lines[ui->rows_lines++];
+    len = strlen (line);
+    do
+    {
+      /* As term_writeline breaks them */
+      count = len;
+      if (count > ui->ncols)
+      {
+        count = ui->ncols;
+        while (count > 0 && line[count] != ' ')
+          count--;
+        if (!count)
+          count = ui->ncols;
+      }
+      if (ui->rows_len == ui->rows_size)
+      {
+        ui->rows_size = (ui->rows_size ? ui->rows_size * 2 : 256);
+        ui->rows = (PAGER_ROW *) realloc (ui->rows, ui->rows_size * sizeof (PAGER_ROW));
+      }
+      ui->rows[ui->rows_len].start = start;
+      ui->rows[ui->rows_len++].len = count;
+      line += count;
+      start += count;
+      len -= count;
+    } while (len > 0);
+  }
+  return ui->rows_len;
+}
+
+static void
+draw_pager (STATE *state)
+{
+  UI *ui = state->ui;
+  int page = ui->nrows - 1;
+  int shown = wrap_rows (ui, ui->pager_top + page + 1) - ui->pager_top;
   int i;
 
-  werase (state->ui->msgwin);
-  for (i = 0; i < state->ui->msgpos; i++)
-    waddstr (state->ui->msgwin, state->ui->msglin[i]);
-  wrefresh (state->ui->msgwin);
+  if (shown > page)
+    shown = page;
+  werase (ui->pagerwin);
+  for (i = 0; i < shown; i++)
+    mvwaddnstr (ui->pagerwin, i, 0, ui->special_text + ui->rows[ui->pager_top + i].start, ui->rows[ui->pager_top + i].len);
+
+  wattron (ui->pagerwin, A_REVERSE);
+  if (ui->searching)
+    mvwprintw (ui->pagerwin, page, 0, "/%s", ui->search);
+  else
+    mvwprintw (ui->pagerwin, page, 0, "-- %s -- Space, b: page  /: search  n: next  q: done",
+               (ui->pager_top + shown < wrap_rows (ui, ui->pager_top + page + 1) ? "more" : "end"));
+  wattroff (ui->pagerwin, A_REVERSE);
+  request_frame (state);
+}
+
+/* Moves the top of the page to row, as far as there are rows */
+static void
+pager_move (STATE *state, int row)
+{
+  UI *ui = state->ui;
+  int last = wrap_rows (ui, row + ui->nrows - 1) - (ui->nrows - 1);
+
+  if (row > last)
+    row = last;
+  if (row < 0)
+    row = 0;
+  ui->pager_top = row;
+  draw_pager (state);
+}
+
+/* Looks for the search text in the rows after the top one, wrapping more
+ * as it goes. The row it is found in becomes the top. */
+static void
+pager_search (STATE *state)
+{
+  UI *ui = state->ui;
+  int row;
+
+  if (!ui->search_len)
+    return;
+  for (row = ui->pager_top + 1; row < wrap_rows (ui, row + 1); row++)
+  {
+    const char *text = ui->special_text + ui->rows[row].start;
+    const char *found = strstr (text, ui->search);
+
+    /* Matches that start in this row; the line goes on past it */
+    if (found && found - text < ui->rows[row].len)
+    {
+      pager_move (state, row);
+      return;
+    }
+  }
+  beep ();
 }
 
+/* Shows the special text that has been posted, from the top */
 static void
-draw_special_text (STATE *state)
+pager_open (STATE *state)
 {
+  UI *ui = state->ui;
+
+  ui->pagerwin = newwin (ui->nrows, ui->ncols, 0, 0);
+  ui->pager_lines = ui->special_lines_len;
+  ui->special_done = FALSE;
+  ui->pager_top = 0;
+  ui->rows_len = ui->rows_lines = 0;
+  ui->searching = FALSE;
+  draw_pager (state);
+}
+
+/* Lets go of the special text that was shown, and puts the screen back,
+ * or shows the text that was posted in the meantime */
+static void
+pager_close (STATE *state)
+{
+  UI *ui = state->ui;
+  int shift;
   int i;
 
-  if (state->ui->special_text_pos >= state->ui->special_text_len)
+  delwin (ui->pagerwin);
+  ui->pagerwin = NULL;
+  ui->special_lines_len -= ui->pager_lines;
+  if (ui->special_lines_len)
+  {
+    shift = ui->special_lines[ui->pager_lines];
+    ui->special_text_used -= shift;
+    memmove (ui->special_text, ui->special_text + shift, ui->special_text_used);
+    for (i = 0; i < ui->special_lines_len; i++)
+      ui->special_lines[i] = ui->special_lines[i + ui->pager_lines] - shift;
+  }
+  else
+    ui->special_text_used = 0;
+  ui->pager_lines = 0;
+  ui->rows_len = ui->rows_lines = 0;
+  ui->repaint = TRUE;
+  if (ui->special_done)
+  {
+    pager_open (state);
+    return;
+  }
+  redraw_msgwin (state);
+  term_present_dialog (state);
+  fix_cursor (state);
+}
+
+static void
+pager_key (STATE *state, int ch)
+{
+  UI *ui = state->ui;
+  int page = ui->nrows - 1;
+
+  if (ui->searching)
   {
-    /* We're done. Free the text from memory, and redraw the normal text */
-    for (i = 0; i < state->ui->special_text_len; i++)
+    if (ch == '\n')
     {
-      free (state->ui->special_text[i]);
-      state->ui->special_text[i] = NULL;
+      ui->searching = FALSE;
+      pager_search (state);
     }
-    state->ui->special_text_len = state->ui->special_text_pos = 0;
-    redraw_msgwin (state);
-    ui_present_dialog (state);
+    else if (ch == 27)
+      ui->searching = FALSE;
+    else if (ch == 0x7f && ui->search_len > 0)
+      ui->search[--ui->search_len] = '\0';
+    else if (ch >= ' ' && ch < 0x7f && ui->search_len < sizeof (ui->search) - 1)
+    {
+      ui->search[ui->search_len++] = ch;
+      ui->search[ui->search_len] = '\0';
+    }
+    draw_pager (state);
     return;
   }
 
-  werase (state->ui->msgwin);
-  for (i = 0; i < MSGROWS; i++)
+  switch (ch)
   {
-    if (state->ui->special_text_pos + i >= state->ui->special_text_len)
+  case ' ':
+  case PAGE_DOWN_KEY:
+    if (ui->pager_top + page >= wrap_rows (ui, ui->pager_top + page + 1))
+    {
+      if (ch == ' ')
+        pager_close (state); /* as the --more-- prompts did */
       break;
-    waddstr (state->ui->msgwin, state->ui->special_text[state->ui->special_text_pos + i]);
-    if (i < MSGROWS - 1)
-      waddch (state->ui->msgwin, '\n');
+    }
+    pager_move (state, ui->pager_top + page);
+    break;
+  case 'b':
+  case PAGE_UP_KEY:
+    pager_move (state, ui->pager_top - page);
+    break;
+  case 'j':
+  case '\n':
+  case DOWN_KEY:
+    pager_move (state, ui->pager_top + 1);
+    break;
+  case 'k':
+  case UP_KEY:
+    pager_move (state, ui->pager_top - 1);
+    break;
+  case '/':
+    ui->searching = TRUE;
+    ui->search_len = 0;
+    ui->search[0] = '\0';
+    draw_pager (state);
+    break;
+  case 'n':
+    pager_search (state);
+    break;
+  case 'q':
+  case 27:
+    pager_close (state);
+    break;
   }
-  state->ui->special_text_pos += i;
-  wrefresh (state->ui->msgwin);
+}
 
-  werase (state->ui->dlgwin);
-  waddstr (state->ui->dlgwin, "--more--");
-  wrefresh (state->ui->dlgwin);
+/* Puts the text pasted so far where typing would go, all at once. Pastes
+ * go into the chat line or a string dialog, and are dropped anywhere
+ * else, rather than taken as commands. */
+static void
+flush_paste (STATE *state)
+{
+  UI *ui = state->ui;
+  int len = ui->paste_len;
+  int i, n;
+
+  ui->paste_len = 0;
+  if (!len || ui->pagerwin)
+    return;
+  if (ui->chatmode)
+  {
+    insert_text (state, ui->chatrespwin, 0, ui->chatkbuf, &ui->chatkbufpos, sizeof (ui->chatkbuf), FALSE, ui->paste, len);
+    return;
+  }
+  switch (state->dialog_mode)
+  {
+  case COORDINATES_DIALOG_PACKET:
+    for (i = n = 0; i < len; i++)
+      if (ui->paste[i] == ' ' || ui->paste[i] == '-' || isdigit (ui->paste[i]))
+        ui->paste[n++] = ui->paste[i];
+    len = n;
+  /* fall through */
+  case STRING_DIALOG_PACKET:
+  case PLAYER_DIALOG_PACKET:
+  case PASSWORD_DIALOG_PACKET:
+    if (ui->msgend)
+      scroll_messages (state, 0);
+    insert_text (state, ui->msgwin, ui->inpline, ui->kbuf, &ui->kbufpos, sizeof (ui->kbuf), state->dialog_mode == PASSWORD_DIALOG_PACKET, ui->paste, len);
+    break;
+  }
+}
+
+/* Keeps a pasted character. A paste is one line, so line breaks and tabs
+ * become spaces. */
+static void
+add_paste (STATE *state, unsigned char c)
+{
+  UI *ui = state->ui;
+
+  if (c == '\n' || c == '\r' || c == '\t')
+    c = ' ';
+  if (c < ' ' || c >= 0x7f)
+    return;
+  if (ui->paste_len == sizeof (ui->paste))
+    flush_paste (state);
+  ui->paste[ui->paste_len++] = c;
+}
+
+/* Returns the key a complete escape sequence stands for, or 0 for one we
+ * have no use for. Short ones are packed into an int, a byte at a time;
+ * ESC O A, as sent in keypad mode, is the same key as ESC [ A. */
+static int
+sequence_key (const unsigned char *seq, int len)
+{
+  int key = 0x1b5b;
+  int i;
+
+  if (len > 4)
+    return 0;
+  for (i = 2; i < len; i++)
+    key = (key << 8) + seq[i];
+  return key;
+}
+
+static void
+end_sequence (STATE *state)
+{
+  UI *ui = state->ui;
+  int len = ui->esc_len;
+  int key;
+
+  ui->esc_len = 0;
+  if (len > sizeof (ui->esc))
+    return;
+  if (len == 6 && !memcmp (ui->esc, "\033[200~", 6))
+    ui->pasting = TRUE;
+  else if (len == 6 && !memcmp (ui->esc, "\033[201~", 6))
+  {
+    flush_paste (state);
+    ui->pasting = FALSE;
+  }
+  else if (!ui->pasting && (key = sequence_key (ui->esc, len)))
+    handle_key (state, key);
+}
+
+/* Takes the next byte from the terminal. Escape sequences are collected
+ * until their final byte: after ESC [, parameter and intermediate bytes
+ * (0x20 to 0x3f) go on, and anything else ends it; after ESC O, the next
+ * byte does. */
+static void
+decode_byte (STATE *state, unsigned char c)
+{
+  UI *ui = state->ui;
+
+  if (ui->esc_len == 1 && c != '[' && c != 'O')
+  {
+    /* A lone ESC after all, and c is a key of its own */
+    ui->esc_len = 0;
+    if (!ui->pasting)
+      handle_key (state, 27);
+  }
+  else if (ui->esc_len)
+  {
+    if (ui->esc_len < sizeof (ui->esc))
+      ui->esc[ui->esc_len] = c;
+    ui->esc_len++;
+    if (ui->esc_len == 2 || (ui->esc[1] == '[' && c >= 0x20 && c < 0x40))
+      return;
+    end_sequence (state);
+    return;
+  }
+
+  if (c == 27)
+  {
+    ui->esc[0] = c;
+    ui->esc_len = 1;
+  }
+  else if (ui->pasting)
+    add_paste (state, c);
+  else
+    handle_key (state, c);
 }
 
-void
-ui_get_key (STATE *state)
+/* Decodes everything read, so a burst of typing loses nothing. What
+ * handling a key does is drawn with the next frame, once for the lot. */
+static void
+term_get_key (STATE *state)
 {
-  int ch;
   int size;
-  char buf[32];
+  int i;
+  unsigned char buf[256];
+
+  if (!state->ui)
+    return;
 
   size = read(0, buf, sizeof (buf));
   if (size <= 0)
   {
-    ui_teardown (state);
+    term_teardown (state);
     exit (0);
   }
-  ch = getkey (buf, size);
+  loop_remove_timer (state->loop, &state->ui->esc_timer);
 
-  dlog ("Got char %x\n", ch);
+  for (i = 0; i < size && state->ui; i++)
+    decode_byte (state, buf[i]);
+  if (!state->ui)
+    return;
+  if (state->ui->paste_len)
+    flush_paste (state);
+  if (state->ui->esc_len)
+    loop_add_timer (state->loop, &state->ui->esc_timer, ESC_MS);
+}
+
+static void
+handle_key (STATE *state, int ch)
+{
+  log_debug (LOG_UI, "Got key %x\n", ch);
 
   if (ch == '\t')
   {
@@ -571,56 +1349,93 @@ ui_get_key (STATE *state)
     return;
   }
 
+  if (state->ui->pagerwin)
+  {
+    pager_key (state, ch);
+    return;
+  }
+
+  if (ch == PAGE_UP_KEY || ch == PAGE_DOWN_KEY)
+  {
+    if (state->ui->chatmode)
+      scroll_chat (state, (ch == PAGE_UP_KEY ? 1 : -1));
+    else
+      scroll_messages (state, (ch == PAGE_UP_KEY ? 1 : -1));
+    fix_cursor (state);
+    return;
+  }
+  if (state->ui->msgend && !state->ui->chatmode)
+    scroll_messages (state, 0); /* back to where the typing goes */
+
   if (state->ui->chatmode)
     handle_key_for_chat (state, ch);
-  else if (state->ui->special_text_pos > 0)
-    draw_special_text (state);
   else
     handle_key_for_dialog (state, ch);
 }
 
-void
-ui_teardown (STATE *state)
+static void
+term_teardown (STATE *state)
 {
+  unsigned long long io[2];
+
+  if (!state->ui)
+    return;
+  loop_remove_watch (state->loop, &state->ui->input);
+  loop_cancel_defer (state->loop, &state->ui->render);
+  loop_remove_timer (state->loop, &state->ui->frame_timer);
+  loop_remove_timer (state->loop, &state->ui->esc_timer);
+  if (state->ui->dirty)
+    draw_frame (state);
+  get_thread_io (io);
+  log_info (LOG_UI, "%ld refreshes drawn in %ld frames; %llu bytes written in %llu syscalls\n",
+            state->ui->marks, state->ui->frames, io[0] - state->ui->io_start[0], io[1] - state->ui->io_start[1]);
+  log_info (LOG_UI, "%ld message lines, %ld drawn, %ld skipped\n",
+            state->ui->msglines, state->ui->msgdrawn, state->ui->msglines - state->ui->msgdrawn);
+  log_info (LOG_UI, "%ld heap allocations so far\n", heap_allocs);
   endwin ();
+  fputs ("\033[?2004l", stdout);
+  fflush (stdout);
+  free (state->ui->special_text);
+  free (state->ui->special_lines);
+  free (state->ui->rows);
+  free (state->ui->msgtext);
+  history_free (&state->ui->chat);
   free (state->ui);
   state->ui = NULL;
 }
 
-void
-ui_clear (STATE *state)
+static void
+term_clear (STATE *state)
 {
-  int i;
+  if (!state->ui)
+    return;
 
-  if (!state->ui->special_text_pos)
-  {
-    werase (state->ui->msgwin);
-    wrefresh (state->ui->msgwin);
-  }
+  werase (state->ui->msgwin);
+  mark_dirty (state, state->ui->msgwin);
 
-  state->ui->msgpos = 0;
-  for (i = 0; i < MSGROWS; i++)
-  {
-    free (state->ui->msglin[i]);
-    state->ui->msglin[i] = NULL;
-  }
+  /* The lines stay, for scrolling back to */
+  state->ui->msgtop = state->ui->msgcount;
+  state->ui->msgpending = 0;
+  state->ui->msgend = 0;
 }
 
 static void
 draw_stats (STATE *state)
 {
+  STAT *stats = state->ui->stats;
   int i;
 
   if (state->ui->statwin)
-    return;
-  state->ui->statwin = newwin (8, state->ui->ncols, MSGROWS + 5, 0);
+    werase (state->ui->statwin);
+  else
+    state->ui->statwin = newwin (8, state->ui->ncols, MSGROWS + 5, 0);
 
   for (i = 0; i < MAX_PACKET_COUNT; i++)
   {
     if (stats[i].label)
     {
       mvwaddstr (state->ui->statwin, stats[i].row, stats[i].label_col, stats[i].label);
-      ui_update_stat (state, i);
+      term_update_stat (state, i);
     }
   }
 }
@@ -635,16 +1450,23 @@ get_bool (int val, char *buf)
   else
   {
     strcpy (buf, "???");
-    dlog ("ERROR: %s: unexpected value %d\n", __func__, val);
+    log_error (LOG_UI, "%s: unexpected value %d\n", __func__, val);
   }
 }
 
-void
-ui_update_stat (STATE *state, int packet)
+static void
+term_update_stat (STATE *state, int packet)
 {
+  const PACKET_INFO *info = &state->protocol->packets[packet];
+  STAT *stats;
   char buf[256];
+  char *field;
   int i;
 
+  if (!state->ui)
+    return;
+  stats = state->ui->stats;
+
   if (packet == NAME_PACKET || packet == LOCATION_PACKET)
   {
     if (state->player.name && state->player.location)
@@ -652,11 +1474,22 @@ ui_update_stat (STATE *state, int packet)
       snprintf (buf, sizeof (buf), "%s is in %s (%d, %d)", state->player.name, state->player.location, state->player.y, state->player.x);
       werase (state->ui->locwin);
       mvwaddstr (state->ui->locwin, 0, 0, buf);
-      wrefresh (state->ui->locwin);
+      mark_dirty (state, state->ui->locwin);
     }
     return;
   }
 
+  /* We fell back to another version, or a spectator learned it */
+  if (state->ui->layout != state->protocol)
+  {
+    lay_out_stats (state);
+    if (state->ui->statwin)
+    {
+      draw_stats (state);
+      return;
+    }
+  }
+
   if (!stats[packet].label)
     return; /* unsupported stat, or no room for it on screen */
 
@@ -666,89 +1499,36 @@ ui_update_stat (STATE *state, int packet)
   wmove (state->ui->statwin, stats[packet].row, stats[packet].data_col);
   buf[0] = '\0';
 
-  switch (packet)
+  field = (char *) state + info->offset;
+  if (info->kind == PACKET_BOOL)
+    get_bool (*(pbool *) field, buf);
+  else
   {
-  case ENERGY_PACKET:
-    if (state->player.energy[2] > 0)
-      sprintf (buf, "%d (%d) %d", state->player.energy[0], state->player.energy[1], state->player.energy[2]);
-    else
-      sprintf (buf, "%d (%d)", state->player.energy[0], state->player.energy[1]);
-    break;
-  case SHIELD_PACKET:
-    sprintf (buf, "%d", state->player.shield);
-    break;
-  case STRENGTH_PACKET:
-    sprintf (buf, "%d (%d)", state->player.strength[0], state->player.strength[1]);
-    break;
-  case SPEED_PACKET:
-    sprintf (buf, "%d (%d)", state->player.speed[0], state->player.speed[1]);
-    break;
-  case SWORD_PACKET:
-    sprintf (buf, "%d", state->player.sword);
-    break;
-  case QUICKSILVER_PACKET:
-    sprintf (buf, "%d", state->player.quicksilver);
-    break;
-  case MANA_PACKET:
-#ifdef PHANT5
-    sprintf (buf, "%d (%d)", state->player.mana[0], state->player.mana[1]);
-#else
-    sprintf (buf, "%d", state->player.mana[0]);
-#endif
-    break;
-  case LEVEL_PACKET:
-    sprintf (buf, "%d", state->player.level);
-    break;
-  case GOLD_PACKET:
-    sprintf (buf, "%d", state->player.gold);
-    break;
-  case GEMS_PACKET:
-    sprintf (buf, "%d", state->player.gems);
-    break;
-  case CLOAK_PACKET:
-    get_bool (state->player.cloak, buf);
-    break;
-  case BLESSING_PACKET:
-    get_bool (state->player.blessing, buf);
-    break;
-  case CROWN_PACKET:
-    get_bool (state->player.crown, buf);
-    break;
-  case PALANTIR_PACKET:
-    get_bool (state->player.palantir, buf);
-    break;
-  case RING_PACKET:
-    get_bool (state->player.ring, buf);
-    break;
-  case VIRGIN_PACKET:
-    get_bool (state->player.virgin, buf);
-    break;
-  case AMULETS_PACKET:
-    sprintf (buf, "%d", state->player.amulets);
-    break;
-  case CHARMS_PACKET:
-    sprintf (buf, "%d", state->player.charms);
-    break;
-  case TOKENS_PACKET:
-    sprintf (buf, "%d", state->player.tokens);
-    break;
-  default:
-    dlog ("ERROR: %s: unexpected stat %d\n", packet);
-    break;
+    /* Like 100 (120), with a third number only if it isn't 0 */
+    int *vals = (int *) field;
+    int count = info->count;
+
+    if (count == 3 && vals[2] <= 0)
+      count = 2;
+    for (i = 0; i < count; i++)
+      sprintf (buf + strlen (buf), (i == 0 ? "%d" : i == 1 ? " (%d)" : " %d"), vals[i]);
   }
   i = strlen (buf);
   while (i < 24)
     buf[i++] = ' ';
   buf[i] = '\0';
   waddstr (state->ui->statwin, buf);
-  wrefresh (state->ui->statwin);
+  mark_dirty (state, state->ui->statwin);
 }
 
-void
-ui_chat_enable (STATE *state, pbool enable)
+static void
+term_chat_enable (STATE *state, pbool enable)
 {
   int top;
 
+  if (!state->ui)
+    return;
+
   if (enable)
   {
     if (state->ui->chatwin)
@@ -758,6 +1538,9 @@ ui_chat_enable (STATE *state, pbool enable)
     scrollok (state->ui->chatwin, TRUE);
     idlok (state->ui->chatwin, TRUE);
     state->ui->chatrespwin = newwin (1, state->ui->ncols, state->ui->nrows - 1, 0);
+    state->ui->chatscroll = 0;
+    draw_chat (state); /* what was said before */
+    mark_dirty (state, state->ui->chatwin);
   }
   else if (state->ui->chatwin)
   {
@@ -773,42 +1556,178 @@ ui_chat_enable (STATE *state, pbool enable)
   }
 }
 
-void
-ui_chat_message (STATE *state, const char *message)
+/* Messages are kept even while there is no chat window, and drawn with
+ * the next frame */
+static void
+term_chat_message (STATE *state, const char *message)
 {
+  if (!state->ui)
+    return;
+  history_add (&state->ui->chat, message);
+  if (state->ui->chatscroll)
+    state->ui->chatscroll++; /* keep the same ones in view */
   if (!state->ui->chatwin)
     return;
-  waddstr (state->ui->chatwin, message);
-  waddch (state->ui->chatwin, '\n');
-  wrefresh (state->ui->chatwin);
+  state->ui->chatpending++;
+  mark_dirty (state, state->ui->chatwin);
   fix_cursor (state);
 }
 
-void
-ui_timeout (STATE *state)
+/* As scroll_messages, for the chat window. It stops with the first message
+ * at the top. */
+static void
+scroll_chat (STATE *state, int pages)
 {
-  state->dialog_mode = 0;
+  UI *ui = state->ui;
+  int rows = getmaxy (ui->chatwin) - 1;
+  long scroll = (pages ? ui->chatscroll + pages * rows : 0);
+  long fit = 0;
+  int used = 0;
+  int h;
+
+  while (fit < ui->chat.count && used + (h = chat_rows (ui, history_get (&ui->chat, fit))) <= rows)
+  {
+    used += h;
+    fit++;
+  }
+  if (scroll > ui->chat.count - fit)
+    scroll = ui->chat.count - fit;
+  if (scroll < 0)
+    scroll = 0;
+  if (scroll == ui->chatscroll)
+    return;
+  ui->chatscroll = scroll;
+  draw_chat (state);
+  mark_dirty (state, ui->chatwin);
 }
 
 /* Present special text. Used for, eg, displaying the scoreboard or examining
  * a player.
- * Passing NULL indicates that the caller is done posting special text.
+ * Passing NULL indicates that the caller is done posting special text, which
+ * is then shown in the pager. The lines are wrapped as it gets to them.
  */
-void
-ui_post_special_text (STATE *state, const char *buf)
+static void
+term_post_special_text (STATE *state, const char *buf)
 {
-  if (!buf && state->ui->special_text_len)
+  UI *ui = state->ui;
+  int len;
+
+  if (!ui)
+    return;
+
+  if (!buf)
   {
-    draw_special_text (state);
+    /* With the pager open, this text waits for it to close */
+    if (ui->pagerwin)
+      ui->special_done = (ui->special_lines_len > ui->pager_lines);
+    else if (ui->special_lines_len)
+      pager_open (state);
     return;
   }
 
-  if (state->ui->special_text_len == state->ui->special_text_size)
+  len = strlen (buf) + 1;
+  while (ui->special_text_used + len > ui->special_text_size)
+  {
+    ui->special_text_size = (ui->special_text_size > 0 ? ui->special_text_size * 2 : 4096);
+    ui->special_text = (char *) realloc (ui->special_text, ui->special_text_size);
+  }
+  if (ui->special_lines_len == ui->special_lines_size)
+  {
+    ui->special_lines_size = (ui->special_lines_size > 0 ? ui->special_lines_size * 2 : 64);
+    ui->special_lines = (int *) realloc (ui->special_lines, ui->special_lines_size * sizeof (int));
+  }
+  ui->special_lines[ui->special_lines_len++] = ui->special_text_used;
+  memcpy (ui->special_text + ui->special_text_used, buf, len);
+  ui->special_text_used += len;
+}
+
+static const char *
+player_type (const PLAYER *player)
+{
+  return (player->type ? player->type : "");
+}
+
+/* By type, and otherwise in the order they arrived */
+static int
+compare_players (const void *a, const void *b)
+{
+  const PLAYER *pa = *(const PLAYER **) a;
+  const PLAYER *pb = *(const PLAYER **) b;
+  int res = strcmp (player_type (pa), player_type (pb));
+
+  if (res)
+    return res;
+  return (pa < pb ? -1 : pa > pb);
+}
+
+/* Lists who is online, grouped by type, in place of the messages */
+static void
+show_roster (STATE *state)
+{
+  PLAYER **list;
+  char buf[256];
+  int n = 0;
+  int i, j, k;
+
+  if (state->roster.count == 0 || state->ui->special_lines_len)
+    return;
+  list = (PLAYER **) malloc (state->roster.count * sizeof (PLAYER *));
+  for (i = 0; i < state->roster.len; i++)
+    if (state->roster.players[i].name)
+      list[n++] = &state->roster.players[i];
+  qsort (list, n, sizeof (PLAYER *), compare_players);
+
+  for (i = 0; i < n; i = j)
   {
-    state->ui->special_text_size = (state->ui->special_text_size > 0 ? state->ui->special_text_size * 2 : 64);
-    state->ui->special_text = (char **) realloc (state->ui->special_text, state->ui->special_text_size * sizeof (char *));
+    for (j = i + 1; j < n && !strcmp (player_type (list[j]), player_type (list[i])); j++);
+    snprintf (buf, sizeof (buf), "%s (%d):", (list[i]->type ? list[i]->type : "Unknown"), j - i);
+    term_post_special_text (state, buf);
+    for (k = i; k < j; k++)
+    {
+      snprintf (buf, sizeof (buf), "  %s", list[k]->name);
+      term_post_special_text (state, buf);
+    }
   }
+  term_post_special_text (state, NULL);
+  free (list);
+}
 
-  /* TODO: THis doesn't handle lines longer than the screen width */
-  state->ui->special_text[state->ui->special_text_len++] = strdup (buf);
+/* Shows connection health: round trip times, and how often we've had to
+ * reconnect. */
+static void
+term_update_status (STATE *state)
+{
+  char buf[256];
+  int len;
+
+  if (!state->ui)
+    return;
+
+  latency_describe (state, buf, sizeof (buf));
+  if (state->reconnect.count > 0)
+  {
+    len = strlen (buf);
+    snprintf (buf + len, sizeof (buf) - len, "  Reconnects: %d (last took %.1fs)", state->reconnect.count, state->reconnect.last_ms / 1000.0);
+  }
+  werase (state->ui->statuswin);
+  waddnstr (state->ui->statuswin, buf, state->ui->ncols - 1);
+  mark_dirty (state, state->ui->statuswin);
+  fix_cursor (state);
 }
+
+const FRONTEND term_frontend =
+{
+  term_init,
+  term_teardown,
+  term_writeline,
+  term_present_dialog,
+  term_present_string_dialog,
+  term_get_key,
+  term_clear,
+  term_update_stat,
+  term_chat_enable,
+  term_chat_message,
+  NULL,
+  term_post_special_text,
+  term_update_status
+};
@@ -0,0 +1,458 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+#include "uring.h"
+
+#include <stddef.h>
+
+#ifdef HAVE_LIBURING
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <liburing.h>
+
+/* Submission queue entries; more than this in one pass are submitted in
+ * several batches */
+#define QUEUE_DEPTH 256
+
+/* Completion queue entries. Every socket can post several receives
+ * between two passes through the loop, so leave plenty of room; overflow
+ * costs extra syscalls to recover. */
+#define CQ_DEPTH 4096
+
+/* Buffers the kernel receives into. Each is handed back as soon as its
+ * data has been copied to the connection's INBUF, so these only need to
+ * cover one batch of completions. */
+#define RECV_BUFFERS 256
+#define RECV_SIZE 16384
+#define RECV_GROUP 0
+
+/* Registered buffers for sending. A connection uses one at a time; if
+ * they are all busy, connections wait their turn. */
+#define SEND_BUFFERS 128
+#define SEND_SIZE 16384
+
+#define OP_RECV 1
+#define OP_SEND 2
+
+/* A request in flight. It belongs to the ring, not the connection, so that
+ * a connection can be removed (and freed) before its requests complete.
+ * Sends are kept one per send buffer, and receives are kept for the next
+ * connection once they are done, so neither is allocated in steady state. */
+struct uop
+{
+  int kind;
+  UCONN *conn; /* NULL once the connection has been removed */
+  int slot; /* send buffer */
+  unsigned int off; /* sent so far */
+  unsigned int len;
+  UOP *next_free; /* a receive that is done */
+};
+
+struct uring
+{
+  struct io_uring ring;
+  LOOP *loop;
+  WATCH watch; /* readable when there are completions */
+  DEFER submit;
+  struct io_uring_buf_ring *bufs;
+  char *recv_mem;
+  char *send_mem;
+  int free_slots[SEND_BUFFERS];
+  int nfree;
+  UOP send_ops[SEND_BUFFERS]; /* by slot */
+  UOP *free_recvs;
+  UCONN *waiting; /* for a send buffer, oldest first */
+  UCONN *waiting_tail;
+  long submits;
+};
+
+static void
+submit_deferred (LOOP *loop, DEFER *defer)
+{
+  URING *ring = (URING *) defer->data;
+
+  io_uring_submit (&ring->ring);
+  ring->submits++;
+}
+
+/* Returns an entry to fill in, submitting what we have if the queue is
+ * full. It goes out at the end of this pass through the loop. */
+static struct io_uring_sqe *
+get_sqe (URING *ring)
+{
+  struct io_uring_sqe *sqe;
+
+  while (!(sqe = io_uring_get_sqe (&ring->ring)))
+  {
+    io_uring_submit (&ring->ring);
+    ring->submits++;
+  }
+  loop_defer (ring->loop, &ring->submit);
+  return sqe;
+}
+
+static void
+arm_recv (URING *ring, UOP *op)
+{
+  struct io_uring_sqe *sqe = get_sqe (ring);
+
+  io_uring_prep_recv_multishot (sqe, op->conn->fd, NULL, 0, 0);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = RECV_GROUP;
+  io_uring_sqe_set_data (sqe, op);
+}
+
+static void
+send_slot (URING *ring, UOP *op)
+{
+  struct io_uring_sqe *sqe = get_sqe (ring);
+  char *buf = ring->send_mem + (size_t) op->slot * SEND_SIZE;
+
+  io_uring_prep_write_fixed (sqe, op->conn->fd, buf + op->off, op->len - op->off, 0, op->slot);
+  io_uring_sqe_set_data (sqe, op);
+}
+
+static void
+release_slot (URING *ring, int slot)
+{
+  UCONN *conn;
+
+  ring->free_slots[ring->nfree++] = slot;
+  if (!(conn = ring->waiting))
+    return;
+  ring->waiting = conn->next_waiting;
+  if (!ring->waiting)
+    ring->waiting_tail = NULL;
+  conn->waiting = 0;
+  uring_flush (ring, conn);
+}
+
+static void
+recv_done (URING *ring, UOP *op, int res, unsigned int flags)
+{
+  UCONN *conn;
+  int bid;
+  char *buf;
+
+  if (flags & IORING_CQE_F_BUFFER)
+  {
+    bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    buf = ring->recv_mem + (size_t) bid * RECV_SIZE;
+    if (op->conn && res > 0)
+      op->conn->func (op->conn, buf, res);
+    io_uring_buf_ring_add (ring->bufs, buf, RECV_SIZE, bid, io_uring_buf_ring_mask (RECV_BUFFERS), 0);
+    io_uring_buf_ring_advance (ring->bufs, 1);
+  }
+  if (flags & IORING_CQE_F_MORE)
+    return;
+
+  /* The multishot receive has stopped */
+  conn = op->conn;
+  if (conn && (res > 0 || res == -ENOBUFS))
+  {
+    arm_recv (ring, op);
+    return;
+  }
+  op->next_free = ring->free_recvs;
+  ring->free_recvs = op;
+  if (!conn)
+    return;
+  conn->recv = NULL;
+  conn->func (conn, NULL, res);
+}
+
+static void
+send_done (URING *ring, UOP *op, int res)
+{
+  UCONN *conn = op->conn;
+
+  if (conn && res < 0)
+  {
+    conn->send = NULL;
+    release_slot (ring, op->slot);
+    conn->func (conn, NULL, res);
+    return;
+  }
+  if (res > 0)
+    op->off += res;
+  if (conn && op->off < op->len)
+  {
+    send_slot (ring, op);
+    return;
+  }
+  if (conn)
+    conn->send = NULL;
+  release_slot (ring, op->slot);
+  if (conn && outbuf_pending (conn->out) > 0)
+    uring_flush (ring, conn);
+}
+
+static void
+uring_io (LOOP *loop, WATCH *watch, unsigned int events)
+{
+  URING *ring = (URING *) watch->data;
+  struct io_uring_cqe *cqe;
+  UOP *op;
+  int res;
+  unsigned int flags;
+
+  while (io_uring_peek_cqe (&ring->ring, &cqe) == 0)
+  {
+    op = (UOP *) io_uring_cqe_get_data (cqe);
+    res = cqe->res;
+    flags = cqe->flags;
+    io_uring_cqe_seen (&ring->ring, cqe);
+    if (!op)
+      continue; /* a cancellation */
+    if (op->kind == OP_RECV)
+      recv_done (ring, op, res, flags);
+    else
+      send_done (ring, op, res);
+  }
+}
+
+URING *
+uring_new (LOOP *loop)
+{
+  URING *ring = (URING *) calloc (sizeof (URING), 1);
+  struct io_uring_params params;
+  struct iovec iov[SEND_BUFFERS];
+  int res;
+  int i;
+
+  ring->loop = loop;
+  memset (&params, 0, sizeof (params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = CQ_DEPTH;
+  res = io_uring_queue_init_params (QUEUE_DEPTH, &ring->ring, &params);
+  if (res < 0)
+  {
+    free (ring);
+    return NULL;
+  }
+
+  ring->bufs = io_uring_setup_buf_ring (&ring->ring, RECV_BUFFERS, RECV_GROUP, 0, &res);
+  ring->recv_mem = (char *) malloc ((size_t) RECV_BUFFERS * RECV_SIZE);
+  ring->send_mem = (char *) malloc ((size_t) SEND_BUFFERS * SEND_SIZE);
+  if (!ring->bufs || !ring->recv_mem || !ring->send_mem)
+    goto fail;
+  for (i = 0; i < RECV_BUFFERS; i++)
+    io_uring_buf_ring_add (ring->bufs, ring->recv_mem + (size_t) i * RECV_SIZE, RECV_SIZE, i, io_uring_buf_ring_mask (RECV_BUFFERS), i);
+  io_uring_buf_ring_advance (ring->bufs, RECV_BUFFERS);
+
+  for (i = 0; i < SEND_BUFFERS; i++)
+  {
+    iov[i].iov_base = ring->send_mem + (size_t) i * SEND_SIZE;
+    iov[i].iov_len = SEND_SIZE;
+    ring->free_slots[i] = SEND_BUFFERS - 1 - i;
+  }
+  ring->nfree = SEND_BUFFERS;
+  if (io_uring_register_buffers (&ring->ring, iov, SEND_BUFFERS) < 0)
+    goto fail;
+
+  ring->submit.func = submit_deferred;
+  ring->submit.data = ring;
+  ring->watch.fd = ring->ring.ring_fd;
+  ring->watch.events = EPOLLIN;
+  ring->watch.func = uring_io;
+  ring->watch.data = ring;
+  if (loop_add_watch (loop, &ring->watch) < 0)
+    goto fail;
+  return ring;
+
+fail:
+  if (ring->bufs)
+    io_uring_free_buf_ring (&ring->ring, ring->bufs, RECV_BUFFERS, RECV_GROUP);
+  io_uring_queue_exit (&ring->ring);
+  free (ring->recv_mem);
+  free (ring->send_mem);
+  free (ring);
+  return NULL;
+}
+
+/* Requests still in flight are abandoned */
+void
+uring_free (URING *ring)
+{
+  UOP *op;
+
+  if (!ring)
+    return;
+  while ((op = ring->free_recvs))
+  {
+    ring->free_recvs = op->next_free;
+    free (op);
+  }
+  loop_remove_watch (ring->loop, &ring->watch);
+  loop_cancel_defer (ring->loop, &ring->submit);
+  io_uring_free_buf_ring (&ring->ring, ring->bufs, RECV_BUFFERS, RECV_GROUP);
+  io_uring_queue_exit (&ring->ring);
+  free (ring->recv_mem);
+  free (ring->send_mem);
+  free (ring);
+}
+
+/* Starts receiving on conn->fd */
+int
+uring_add (URING *ring, UCONN *conn)
+{
+  UOP *op = ring->free_recvs;
+
+  if (op)
+    ring->free_recvs = op->next_free;
+  else
+    op = (UOP *) malloc (sizeof (UOP));
+  memset (op, 0, sizeof (UOP));
+  op->kind = OP_RECV;
+  op->conn = conn;
+  conn->recv = op;
+  conn->send = NULL;
+  conn->waiting = 0;
+  arm_recv (ring, op);
+  return 0;
+}
+
+/* Stops using conn, which the caller can then close and free. Requests in
+ * flight finish on their own and are thrown away. */
+void
+uring_remove (URING *ring, UCONN *conn)
+{
+  struct io_uring_sqe *sqe;
+  UCONN *prev;
+  UCONN *p;
+
+  if (conn->recv)
+  {
+    conn->recv->conn = NULL;
+    sqe = get_sqe (ring);
+    io_uring_prep_cancel (sqe, conn->recv, 0);
+    io_uring_sqe_set_data (sqe, NULL);
+    conn->recv = NULL;
+  }
+  if (conn->send)
+  {
+    conn->send->conn = NULL;
+    conn->send = NULL;
+  }
+  if (conn->waiting)
+  {
+    prev = NULL;
+    for (p = ring->waiting; p != conn; p = p->next_waiting)
+      prev = p;
+    if (prev)
+      prev->next_waiting = conn->next_waiting;
+    else
+      ring->waiting = conn->next_waiting;
+    if (ring->waiting_tail == conn)
+      ring->waiting_tail = prev;
+    conn->waiting = 0;
+  }
+
+  /* The caller is about to close the fd, so don't wait for the end of the
+   * pass */
+  io_uring_submit (&ring->ring);
+  ring->submits++;
+}
+
+/* Hands as much of conn->out to the kernel as a send buffer will hold.
+ * Like outbuf_flush, returns 1 if nothing is left, or 0 if some is still
+ * pending; it will go once the send in flight completes. */
+int
+uring_flush (URING *ring, UCONN *conn)
+{
+  UOP *op;
+  unsigned int len;
+
+  if (conn->send || conn->waiting)
+    return 0;
+  if (outbuf_pending (conn->out) == 0)
+    return 1;
+  if (ring->nfree == 0)
+  {
+    conn->waiting = 1;
+    conn->next_waiting = NULL;
+    if (ring->waiting_tail)
+      ring->waiting_tail->next_waiting = conn;
+    else
+      ring->waiting = conn;
+    ring->waiting_tail = conn;
+    return 0;
+  }
+
+  op = &ring->send_ops[ring->free_slots[--ring->nfree]];
+  op->kind = OP_SEND;
+  op->conn = conn;
+  op->slot = op - ring->send_ops;
+  op->off = 0;
+  len = outbuf_take (conn->out, ring->send_mem + (size_t) op->slot * SEND_SIZE, SEND_SIZE);
+  op->len = len;
+  conn->out->flushes++;
+  conn->out->bytes += len;
+  if (len > conn->out->max_flush)
+    conn->out->max_flush = len;
+  conn->send = op;
+  send_slot (ring, op);
+  return (outbuf_pending (conn->out) == 0);
+}
+
+long
+uring_submits (URING *ring)
+{
+  return ring->submits;
+}
+
+#else /* !HAVE_LIBURING */
+
+URING *
+uring_new (LOOP *loop)
+{
+  return NULL;
+}
+
+void
+uring_free (URING *ring)
+{
+}
+
+int
+uring_add (URING *ring, UCONN *conn)
+{
+  return -1;
+}
+
+void
+uring_remove (URING *ring, UCONN *conn)
+{
+}
+
+int
+uring_flush (URING *ring, UCONN *conn)
+{
+  return -1;
+}
+
+long
+uring_submits (URING *ring)
+{
+  return 0;
+}
+
+#endif /* HAVE_LIBURING */
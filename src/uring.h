@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2021 by Mike Gorse.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see: <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+/* Socket I/O through io_uring, in place of reading and writing each socket
+ * when epoll says it is ready. Receives are multishot, into a ring of
+ * buffers provided to the kernel; sends go out from registered buffers; and
+ * everything asked for during one pass through the loop is submitted with
+ * one syscall. The ring's completions are picked up by the epoll loop, so
+ * timers and other watches work as before.
+ *
+ * This is only built if liburing was found. Without it, or if the kernel
+ * won't give us a ring, uring_new returns NULL and callers use epoll. Like
+ * loop.h and buffer.h, nothing here knows about the protocol. */
+
+#include "loop.h"
+#include "buffer.h"
+
+typedef struct uring URING;
+typedef struct uconn UCONN;
+typedef struct uop UOP;
+
+/* Called with received data, or with len 0 at end of file or -errno if
+ * the connection failed. buf is only valid during the call. */
+typedef void (*UringFunc) (UCONN *conn, const char *buf, int len);
+
+/* A socket handed to the ring. Like a WATCH, it is embedded in its owner,
+ * and must stay put until it is removed. */
+struct uconn
+{
+  int fd;
+  OUTBUF *out; /* sent from by uring_flush */
+  UringFunc func;
+  void *data;
+  UOP *recv; /* requests in flight */
+  UOP *send;
+  UCONN *next_waiting; /* for a send buffer to come free */
+  int waiting;
+};
+
+URING *uring_new (LOOP *loop);
+void uring_free (URING *ring);
+int uring_add (URING *ring, UCONN *conn);
+void uring_remove (URING *ring, UCONN *conn);
+int uring_flush (URING *ring, UCONN *conn);
+long uring_submits (URING *ring);